@@ -0,0 +1,697 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "avm.h"
+#include "avm_def.h"
+
+/* Parses a generated program of a few hundred megabytes and reports the
+ * throughput of avm_parse, and of the streaming parser fed 64 KiB chunks.
+ * `sched` runs a mix of short and long guests on the scheduler instead and
+ * reports its throughput and how long slices waited. `vector` compares the
+ * vector instructions to the scalar ones doing the same work.
+ *
+ * `corpus` runs a fixed set of workloads on every engine, plus parsing and
+ * disassembly, and prints the results as JSON to compare between builds.
+ * `scale` multiplies the size of every workload.
+ *
+ * usage: avm_bench [megabytes]
+ *        avm_bench sched [guests] [threads]
+ *        avm_bench vector [lanes]
+ *        avm_bench corpus [scale]
+ */
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15u;
+
+static uint32_t rng(void)
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return (uint32_t) rng_state;
+}
+
+/* Code the way a compiler would emit it: labeled functions of arithmetic,
+ * memory traffic and branches
+ */
+static char *generate(size_t bytes, size_t *len)
+{
+  char *source = malloc(bytes + 64);
+  if (source == NULL) {
+    return NULL;
+  }
+
+  size_t used = 0;
+  uint32_t loc = 0;
+  while (used < bytes) {
+    int n = 0;
+    char *out = source + used;
+    uint32_t kind = rng() % 16;
+
+    if (kind == 0) {
+      loc += 16;
+      n = sprintf(out, "%x:\n", loc);
+    } else if (kind < 6) {
+      n = sprintf(out, "push %x\n", rng());
+      loc += 2;
+    } else if (kind < 8) {
+      n = sprintf(out, "load 1 %x\n", rng() & 0xffff);
+      loc += 1;
+    } else if (kind < 9) {
+      n = sprintf(out, "store 1 %x\n", rng() & 0xffff);
+      loc += 1;
+    } else if (kind < 10) {
+      n = sprintf(out, "jmpez %x\n", loc + (rng() & 0xff));
+      loc += 1;
+    } else {
+      static const char *const plain[] = {
+        "add", "sub", "mul", "xor", "dup", "call",
+      };
+      n = sprintf(out, "%s\n", plain[rng() % 6]);
+      loc += 1;
+    }
+    used += (size_t) n;
+  }
+
+  *len = used;
+  return source;
+}
+
+static double seconds(void)
+{
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/* A guest counting down from `count`, then evaluating to `id` */
+static AVM_Program *countdown(unsigned count, unsigned id)
+{
+  char source[256];
+  snprintf(source, sizeof(source),
+           "push %x\n"
+           "2:\n push 1\n sub\n dup\n jmpez 1F\n push 0\n jmpez 2\n"
+           "1F:\n push %x\n quit\n", count, id);
+
+  avm_int *code;
+  char *error = NULL;
+  size_t words;
+  if (avm_parse(source, &code, &error, &words)) {
+    free(error);
+    return NULL;
+  }
+  AVM_Program *program = avm_program_new(code, words, &error);
+  free(code);
+  free(error);
+  return program;
+}
+
+/* Upper bound of the wait of the `fraction` of slices that waited least,
+ * in microseconds
+ */
+static double wait_percentile(const AVM_Sched_Stats *stats, double fraction)
+{
+  uint64_t total = 0, seen = 0;
+  for (unsigned i = 0; i < AVM_SCHED_WAIT_BUCKETS; ++i) {
+    total += stats->waits[i];
+  }
+  unsigned i = 0;
+  for (; i < AVM_SCHED_WAIT_BUCKETS - 1; ++i) {
+    seen += stats->waits[i];
+    if (seen >= fraction * (double) total) {
+      break;
+    }
+  }
+  double bound = (double) (2ull << i) * 1e3;
+  return bound < stats->max_wait_ns ? bound / 1e3 : stats->max_wait_ns / 1e3;
+}
+
+/* Mostly short guests, with every tenth running a few hundred times as
+ * long at a higher priority, all sharing one program per length
+ */
+static int bench_sched(unsigned guests, unsigned threads)
+{
+  static const unsigned counts[] = { 0x1000, 0x100000 };
+  AVM_Program *programs[2] = {
+    countdown(counts[0], 1), countdown(counts[1], 2),
+  };
+  AVM_Context *contexts = calloc(guests, sizeof(AVM_Context));
+  AVM_Task *tasks = calloc(guests, sizeof(AVM_Task));
+  AVM_Scheduler *sched = avm_sched_new(threads, 0);
+  if (programs[0] == NULL || programs[1] == NULL || contexts == NULL ||
+      tasks == NULL || sched == NULL) {
+    fprintf(stderr, "unable to set up %u guests\n", guests);
+    return 1;
+  }
+
+  unsigned ready = 0;
+  uint64_t steps = 0;
+  for (; ready < guests; ++ready) {
+    int kind = ready % 10 == 0;
+    if (avm_init_program(&contexts[ready], programs[kind])) {
+      fprintf(stderr, "guest %u: %s\n", ready, contexts[ready].error);
+      avm_free(&contexts[ready]);
+      break;
+    }
+    tasks[ready].ctx = &contexts[ready];
+    tasks[ready].priority = (unsigned) kind;
+    avm_sched_add(sched, &tasks[ready]);
+    steps += counts[kind];
+  }
+
+  double start = seconds();
+  int failed = avm_sched_run(sched);
+  double elapsed = seconds() - start;
+
+  AVM_Sched_Stats stats;
+  avm_sched_stats(sched, avm_sched_workers(sched), &stats);
+  printf("sched: %u guests on %u threads in %.3f s, %.0f guests/s, "
+         "%.1fM loop iterations/s\n", ready, avm_sched_workers(sched),
+         elapsed, ready / elapsed, steps / elapsed / 1e6);
+  printf("sched: %llu slices, %llu steals of %llu tasks, "
+         "longest queue %zu\n", (unsigned long long) stats.slices,
+         (unsigned long long) stats.steals,
+         (unsigned long long) stats.stolen, stats.longest);
+  printf("sched: slice wait p50 < %.0f us, p99 < %.0f us, p99.9 < %.0f us, "
+         "max %.0f us\n", wait_percentile(&stats, 0.5),
+         wait_percentile(&stats, 0.99), wait_percentile(&stats, 0.999),
+         stats.max_wait_ns / 1e3);
+
+  for (unsigned i = 0; i < ready; ++i) {
+    free(tasks[i].error);
+    avm_free(&contexts[i]);
+  }
+  avm_sched_free(sched);
+  avm_program_free(programs[0]);
+  avm_program_free(programs[1]);
+  free(tasks);
+  free(contexts);
+  return failed || ready < guests;
+}
+
+/* Loop control around a body, 6 instructions an iteration */
+#define LOOP_INSTRUCTIONS 6
+
+/* A program running `body` `iterations` times, with the code in `after`
+ * at 10000 and up. The body has to leave the stack as it found it. `after`
+ * goes before the `quit`, code ends at the last word parsed.
+ */
+static char *loop_source(const char *body, unsigned iterations,
+                         const char *after)
+{
+  size_t size = strlen(body) + strlen(after) + 256;
+  char *source = malloc(size);
+  if (source == NULL) {
+    return NULL;
+  }
+  snprintf(source, size,
+           "push %x\n"
+           "2:\n%s push 1\n sub\n dup\n jmpez FFFF0\n push 0\n jmpez 2\n"
+           "%sFFFF0:\n quit\n", iterations, body, after);
+  return source;
+}
+
+/* Runs `iterations` of `body` in a loop, compiled by the JIT if `jit` is
+ * set. Nanoseconds per iteration, or a negative number if it failed.
+ */
+static double time_loop(const char *body, unsigned iterations, int jit)
+{
+  char *source = loop_source(body, iterations, "");
+  if (source == NULL) {
+    return -1;
+  }
+
+  avm_int *code;
+  char *error = NULL;
+  size_t words;
+  int failed = avm_parse(source, &code, &error, &words);
+  free(source);
+  free(error);
+  if (failed) {
+    free(code);
+    return -1;
+  }
+
+  AVM_Context ctx;
+  avm_int result;
+  double elapsed = 0;
+  failed = avm_init(&ctx, code, words);
+  free(code);
+  if (!failed) {
+    failed = jit && avm_jit_enable(&ctx, 1);
+    double start = seconds();
+    failed = failed || avm_eval(&ctx, &result);
+    elapsed = seconds() - start;
+    avm_free(&ctx);
+  }
+  return failed ? -1 : elapsed * 1e9 / iterations;
+}
+
+/* Adds, multiplies and shifts two arrays of `lanes` words into a third,
+ * with one vector instruction and with a load, an operation and a store
+ * for every word
+ */
+static int bench_vector(unsigned lanes)
+{
+  static const char *const ops[] = { "add", "mul", "shl" };
+  size_t size = 64 + (size_t) lanes * 64;
+  char *vector = malloc(size), *scalar = malloc(size);
+  if (vector == NULL || scalar == NULL || lanes == 0 || lanes >= 1 << 16) {
+    fprintf(stderr, "unable to set up %u lanes\n", lanes);
+    free(vector);
+    free(scalar);
+    return 1;
+  }
+
+  unsigned iterations = (1u << 24) / lanes + 1;
+  int failed = 0;
+  for (int jit = 0; jit < 2; ++jit) {
+    for (size_t k = 0; k < sizeof(ops) / sizeof(*ops); ++k) {
+      snprintf(vector, size, " load %x 100000\n load %x 200000\n v%s %x\n"
+               " store %x 300000\n", lanes, lanes, ops[k], lanes, lanes);
+      size_t used = 0;
+      for (unsigned i = 0; i < lanes; ++i) {
+        used += (size_t) snprintf(scalar + used, size - used,
+                                  " load 1 %x\n load 1 %x\n %s\n"
+                                  " store 1 %x\n", 0x100000 + i,
+                                  0x200000 + i, ops[k], 0x300000 + i);
+      }
+
+      double v = time_loop(vector, iterations, jit);
+      double s = time_loop(scalar, iterations, jit);
+      if (v < 0 || s < 0) {
+        failed = jit == 0;  // the JIT may not be built
+        break;
+      }
+      printf("vector: %-11s v%s %u lanes %6.2f ns/lane, %s %6.2f ns/lane, "
+             "%.1fx\n", jit ? "jit" : "interpreter", ops[k], lanes,
+             v / lanes, ops[k], s / lanes, s / v);
+    }
+  }
+  free(vector);
+  free(scalar);
+  return failed;
+}
+
+/* A workload of the corpus and what running it took. Rates are derived
+ * from whichever of the counts it sets.
+ */
+typedef struct {
+  const char *name;
+  const char *engine;     /* NULL for workloads that don't run code */
+  double seconds;
+  uint64_t instructions;  /* guest instructions run */
+  uint64_t bytes;         /* source parsed */
+  uint64_t words;         /* code words disassembled */
+  long peak_rss_kb;
+  AVM_Alloc_Stats allocs;
+} Result;
+
+/* Peak resident memory since the last reset_peak_rss, in KiB. Only Linux
+ * can reset it, elsewhere it's the peak of the whole process.
+ */
+static long peak_rss_kb(void)
+{
+  FILE *status = fopen("/proc/self/status", "r");
+  long kb = -1;
+  char line[256];
+  while (status != NULL && fgets(line, sizeof(line), status) != NULL) {
+    if (strncmp(line, "VmHWM:", 6) == 0) {
+      kb = strtol(line + 6, NULL, 10);
+    }
+  }
+  if (status != NULL) {
+    fclose(status);
+  }
+  if (kb < 0) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    kb = usage.ru_maxrss;
+  }
+  return kb;
+}
+
+static void reset_peak_rss(void)
+{
+  FILE *refs = fopen("/proc/self/clear_refs", "w");
+  if (refs != NULL) {
+    fputs("5", refs);
+    fclose(refs);
+  }
+}
+
+static void measure_start(Result *result)
+{
+  reset_peak_rss();
+  avm_alloc_stats(&result->allocs);
+  result->seconds = seconds();
+}
+
+static void measure_end(Result *result)
+{
+  AVM_Alloc_Stats allocs;
+  result->seconds = seconds() - result->seconds;
+  avm_alloc_stats(&allocs);
+  result->allocs.count = allocs.count - result->allocs.count;
+  result->allocs.bytes = allocs.bytes - result->allocs.bytes;
+  result->peak_rss_kb = peak_rss_kb();
+}
+
+static const char *const engines[] = { "interpreter", "ir", "jit" };
+
+/* Runs `source` `runs` times on a fresh context with engine `engine`. 1 if
+ * it failed, -1 if the engine isn't available.
+ */
+static int run_program(const char *source, int engine, unsigned runs,
+                       Result *result)
+{
+  avm_int *code;
+  char *error = NULL;
+  size_t words;
+  if (avm_parse(source, &code, &error, &words)) {
+    fprintf(stderr, "%s: parse error: %s\n", result->name, error);
+    free(code);
+    free(error);
+    return 1;
+  }
+
+  int failed = 0;
+  measure_start(result);
+  for (unsigned i = 0; i < runs && !failed; ++i) {
+    AVM_Context ctx;
+    avm_int value;
+    if (avm_init(&ctx, code, words)) {
+      fprintf(stderr, "%s: %s\n", result->name, ctx.error);
+      failed = 1;
+      break;
+    }
+    if ((engine == 1 && avm_ir_enable(&ctx, 1)) ||
+        (engine == 2 && avm_jit_enable(&ctx, 1))) {
+      failed = -1;
+    } else if (avm_eval(&ctx, &value)) {
+      fprintf(stderr, "%s: %s\n", result->name, ctx.error);
+      failed = 1;
+    }
+    avm_free(&ctx);
+  }
+  measure_end(result);
+  free(code);
+  return failed;
+}
+
+/* Programs of the corpus, sized by `scale`. Each one sets how many
+ * instructions it runs in all and how many times it's run.
+ */
+typedef char *(*Generator)(unsigned scale, uint64_t *instructions,
+                           unsigned *runs);
+
+/* longloop.avm, counting down with nothing else in the loop */
+static char *gen_countdown(unsigned scale, uint64_t *instructions,
+                           unsigned *runs)
+{
+  unsigned iterations = 0x2000000u * scale;
+  *instructions = (uint64_t) iterations * LOOP_INSTRUCTIONS;
+  *runs = 1;
+  return loop_source("", iterations, "");
+}
+
+/* Arithmetic on a copy of the counter, stored every iteration */
+static char *gen_arith(unsigned scale, uint64_t *instructions,
+                       unsigned *runs)
+{
+  unsigned iterations = 0x1000000u * scale;
+  *instructions = (uint64_t) iterations * (8 + LOOP_INSTRUCTIONS);
+  *runs = 1;
+  return loop_source(" dup\n push 3\n mul\n push 7\n xor\n push 1\n shr\n"
+                     " store 1 100000\n", iterations, "");
+}
+
+/* Recursion 0x400 calls deep and back, over and over */
+static char *gen_recursion(unsigned scale, uint64_t *instructions,
+                           unsigned *runs)
+{
+  unsigned depth = 0x400, iterations = 0x4000u * scale;
+  // 6 instructions a level and 3 at the bottom, 3 more to start it
+  *instructions = (uint64_t) iterations * (6 * depth + 6 + LOOP_INSTRUCTIONS);
+  *runs = 1;
+  char body[64];
+  snprintf(body, sizeof(body), " push %x\n calli 10000\n store 1 100000\n",
+           depth);
+  return loop_source(body, iterations, "10000:\n dup\n jmpez 10006\n"
+                     " push 1\n sub\n calli 10000\n10006:\n ret\n");
+}
+
+/* Copies of 0x400 words through the stack */
+static char *gen_blocks(unsigned scale, uint64_t *instructions,
+                        unsigned *runs)
+{
+  unsigned iterations = 0x40000u * scale;
+  *instructions = (uint64_t) iterations * (2 + LOOP_INSTRUCTIONS);
+  *runs = 1;
+  return loop_source(" load 400 100000\n store 400 200000\n", iterations, "");
+}
+
+/* A word written to each of 0x400 pages spread over the top half of
+ * memory, like large_ram.avm, on a fresh context every run
+ */
+static char *gen_sparse(unsigned scale, uint64_t *instructions,
+                        unsigned *runs)
+{
+  unsigned pages = 0x400;
+  size_t size = (size_t) pages * 48 + 64, used = 0;
+  char *source = malloc(size);
+  if (source == NULL) {
+    return NULL;
+  }
+  for (unsigned i = 0; i < pages; ++i) {
+    used += (size_t) snprintf(source + used, size - used,
+                              "push %x\nstore 1 %x\n", i + 1,
+                              0x80000000u + i * 0x10000u);
+  }
+  snprintf(source + used, size - used, "push 0\nquit\n");
+  *runs = 64 * scale;
+  *instructions = (uint64_t) *runs * (2 * pages + 2);
+  return source;
+}
+
+static const struct {
+  const char *name;
+  Generator generate;
+} programs[] = {
+  { "countdown", gen_countdown },
+  { "arith", gen_arith },
+  { "recursion", gen_recursion },
+  { "blocks", gen_blocks },
+  { "sparse_memory", gen_sparse },
+};
+
+/* Parses a generated program of 16 MB a scale */
+static int bench_parse_corpus(unsigned scale, Result *result)
+{
+  size_t len;
+  rng_state = 0x9e3779b97f4a7c15u;
+  char *source = generate((size_t) scale << 24, &len);
+  if (source == NULL) {
+    return 1;
+  }
+
+  avm_int *code;
+  char *error = NULL;
+  size_t words;
+  measure_start(result);
+  int failed = avm_parse_len(source, len, &code, &error, &words);
+  measure_end(result);
+  result->bytes = len;
+
+  free(source);
+  free(code);
+  free(error);
+  return failed;
+}
+
+/* Disassembles a generated program of 16 MB a scale */
+static int bench_disassemble(unsigned scale, Result *result)
+{
+  size_t len;
+  rng_state = 0x9e3779b97f4a7c15u;
+  char *source = generate((size_t) scale << 24, &len);
+  avm_int *code = NULL;
+  char *error = NULL;
+  size_t words;
+  if (source == NULL || avm_parse_len(source, len, &code, &error, &words)) {
+    free(source);
+    free(code);
+    free(error);
+    return 1;
+  }
+  free(source);
+
+  AVM_Context ctx;
+  char *text = NULL;
+  int failed = avm_init(&ctx, code, words);
+  free(code);
+  if (!failed) {
+    measure_start(result);
+    failed = avm_stringify_count(&ctx, 0, (avm_size_t) words, &text);
+    measure_end(result);
+    avm_free(&ctx);
+  }
+  result->words = words;
+  free(text);
+  return failed;
+}
+
+static void print_result(const Result *result, int last)
+{
+  printf("    {\"name\": \"%s\"", result->name);
+  if (result->engine != NULL) {
+    printf(", \"engine\": \"%s\"", result->engine);
+  }
+  printf(", \"seconds\": %.6f", result->seconds);
+  if (result->instructions > 0) {
+    printf(", \"instructions\": %llu, \"instructions_per_second\": %.0f, "
+           "\"ns_per_op\": %.3f",
+           (unsigned long long) result->instructions,
+           result->instructions / result->seconds,
+           result->seconds * 1e9 / result->instructions);
+  }
+  if (result->bytes > 0) {
+    printf(", \"bytes\": %llu, \"mb_per_second\": %.1f",
+           (unsigned long long) result->bytes,
+           result->bytes / result->seconds / (1 << 20));
+  }
+  if (result->words > 0) {
+    printf(", \"words\": %llu, \"words_per_second\": %.0f",
+           (unsigned long long) result->words,
+           result->words / result->seconds);
+  }
+  printf(", \"peak_rss_kb\": %ld, \"allocations\": %llu, "
+         "\"allocated_bytes\": %llu}%s\n", result->peak_rss_kb,
+         (unsigned long long) result->allocs.count,
+         (unsigned long long) result->allocs.bytes, last ? "" : ",");
+}
+
+/* Runs every workload of the corpus and prints the results as JSON */
+static int bench_corpus(unsigned scale)
+{
+  size_t count = sizeof(programs) / sizeof(*programs);
+  size_t engine_count = sizeof(engines) / sizeof(*engines);
+  Result *results = calloc(count * engine_count + 2, sizeof(Result));
+  size_t done = 0;
+  const char *name = "the corpus";
+  int failed = 0;
+  if (results == NULL || scale == 0) {
+    fprintf(stderr, "unable to set up the corpus\n");
+    free(results);
+    return 1;
+  }
+
+  for (size_t i = 0; i < count && !failed; ++i) {
+    uint64_t instructions;
+    unsigned runs;
+    name = programs[i].name;
+    char *source = programs[i].generate(scale, &instructions, &runs);
+    if (source == NULL) {
+      failed = 1;
+      break;
+    }
+    for (size_t engine = 0; engine < engine_count; ++engine) {
+      Result *result = &results[done];
+      *result = (Result) {
+        .name = programs[i].name,
+        .engine = engines[engine],
+        .instructions = instructions,
+      };
+      int status = run_program(source, (int) engine, runs, result);
+      if (status > 0) {
+        failed = 1;
+        break;
+      }
+      done += status == 0;  // the JIT may not be built
+    }
+    free(source);
+  }
+
+  if (!failed) {
+    results[done] = (Result) { .name = name = "parse" };
+    failed = bench_parse_corpus(scale, &results[done++]);
+  }
+  if (!failed) {
+    results[done] = (Result) { .name = name = "disassemble" };
+    failed = bench_disassemble(scale, &results[done++]);
+  }
+  if (failed) {
+    fprintf(stderr, "%s failed\n", name);
+    free(results);
+    return 1;
+  }
+
+  printf("{\n  \"scale\": %u,\n  \"results\": [\n", scale);
+  for (size_t i = 0; i < done; ++i) {
+    print_result(&results[i], i + 1 == done);
+  }
+  printf("  ]\n}\n");
+  free(results);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc > 1 && strcmp(argv[1], "sched") == 0) {
+    unsigned guests = argc > 2 ? (unsigned) strtoul(argv[2], NULL, 10) : 10000;
+    unsigned threads = argc > 3 ? (unsigned) strtoul(argv[3], NULL, 10) : 0;
+    return bench_sched(guests, threads);
+  }
+  if (argc > 1 && strcmp(argv[1], "corpus") == 0) {
+    return bench_corpus(argc > 2 ? (unsigned) strtoul(argv[2], NULL, 10) : 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "vector") == 0) {
+    return bench_vector(argc > 2 ? (unsigned) strtoul(argv[2], NULL, 10) : 16);
+  }
+
+  size_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 10) : 256;
+  size_t len;
+  char *source = generate(megabytes << 20, &len);
+  if (source == NULL) {
+    fprintf(stderr, "unable to allocate %zu MB of source\n", megabytes);
+    return 1;
+  }
+
+  avm_int *code;
+  char *error = NULL;
+  size_t words;
+  double start = seconds();
+  int failed = avm_parse_len(source, len, &code, &error, &words);
+  double whole = seconds() - start;
+  free(code);
+
+  double streamed = 0;
+  if (!failed) {
+    start = seconds();
+    AVM_Parser *parser = avm_parser_new(NULL, NULL);
+    for (size_t done = 0; done < len && parser != NULL; done += 1 << 16) {
+      size_t chunk = len - done < 1 << 16 ? len - done : 1 << 16;
+      avm_parser_feed(parser, source + done, chunk);
+    }
+    failed = parser == NULL ||
+             avm_parser_finish(parser, &code, &error, &words);
+    streamed = seconds() - start;
+    free(code);
+  }
+  free(source);
+
+  if (failed) {
+    fprintf(stderr, "parse error: %s\n",
+            error != NULL ? error : "unable to allocate parser");
+    free(error);
+    return 1;
+  }
+
+  double mb = (double) len / (1 << 20);
+  printf("parse: %.1f MB, %zu words in %.3f s, %.1f MB/s\n", mb, words,
+         whole, mb / whole);
+  printf("stream: %.1f MB, %zu words in %.3f s, %.1f MB/s\n", mb, words,
+         streamed, mb / streamed);
+  return 0;
+}
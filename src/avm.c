@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <ctype.h>
 #include <assert.h>
 #include "avm.h"
 #include "avm_util.h"
@@ -9,99 +11,483 @@
 
 #ifdef AVM_EXECUTABLE
 
-int main(int argc, char **args)
+/* Ends a program in the batch `avm --batch` reads from stdin */
+#define BATCH_DELIMITER "---"
+
+static void usage(const char *name)
 {
-  FILE* fin = stdin;
-  if(argc == 2){
-    fin = fopen(argv[1], "r");
-    if(!fin){
-      fprintf(stderr, "Unable to open file: %s\n", argv[1]);
-      return 1;
+  fprintf(stderr,
+          "usage: %s [--ir | --jit] [--fusions] [--parallel] "
+          "[--profile folded] [--trace trace] [file]\n"
+          "       %s --compile image [--parallel] [file]\n"
+          "       %s --batch [file...]\n"
+          "       %s --disassemble [file]\n"
+          "       %s --decode-trace trace\n", name, name, name, name, name);
+}
+
+/* Whether the file at `path` is a precompiled image rather than source */
+static int is_image_file(const char *path)
+{
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return 0;
+  }
+  char magic[4];
+  size_t len = fread(magic, 1, sizeof(magic), file);
+  fclose(file);
+  return avm_is_image(magic, len);
+}
+
+/* Parses `file` a chunk at a time, without holding on to the source */
+static int parse_stream(FILE *file, avm_int **memory, char **error,
+                        size_t *memlen)
+{
+  AVM_Parser *parser = avm_parser_new(NULL, NULL);
+  if (parser == NULL) {
+    *memory = NULL;
+    *error = afmt("%s", "unable to allocate parser");
+    return 1;
+  }
+
+  char chunk[1 << 16];
+  size_t len;
+  while ((len = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    if (avm_parser_feed(parser, chunk, len)) {
+      break;
+    }
+  }
+  return avm_parser_finish(parser, memory, error, memlen);
+}
+
+/* Whether `source` holds nothing but whitespace */
+static int is_blank(const char *source, size_t len)
+{
+  for (size_t i = 0; i < len; ++i) {
+    if (!isspace((unsigned char) source[i])) {
+      return 0;
     }
   }
-  size_t bytes_read;
-  char *opc = read_file(stdin, &bytes_read);
-  if (opc == NULL) {
-    fprintf(stderr, "unable to read input");
+  return 1;
+}
+
+/* Splits `input` into programs at lines holding only BATCH_DELIMITER */
+static AVM_Job *split_batch(const char *input, size_t len, size_t *count)
+{
+  size_t cap = 16;
+  AVM_Job *jobs = my_malloc(cap * sizeof(AVM_Job));
+  *count = 0;
+
+  const char *start = input, *end = input + len;
+  for (const char *line = input; jobs != NULL && start < end; ) {
+    const char *eol = memchr(line, '\n', (size_t) (end - line));
+    const char *next = eol != NULL ? eol + 1 : end;
+    eol = eol != NULL ? eol : end;
+
+    int delimiter = (size_t) (eol - line) == strlen(BATCH_DELIMITER) &&
+                    memcmp(line, BATCH_DELIMITER, (size_t) (eol - line)) == 0;
+    if (!delimiter && next < end) {
+      line = next;
+      continue;
+    }
+
+    const char *stop = delimiter ? line : end;
+    if (!is_blank(start, (size_t) (stop - start))) {
+      if (*count == cap) {
+        cap *= 2;
+        AVM_Job *grown = my_realloc(jobs, cap * sizeof(AVM_Job));
+        if (grown == NULL) {
+          my_free(jobs);
+          break;
+        }
+        jobs = grown;
+      }
+      jobs[(*count)++] = (AVM_Job) {
+        .source = start,
+        .len = (size_t) (stop - start),
+      };
+    }
+    start = line = next;
+  }
+  return jobs;
+}
+
+/* Runs the programs at `paths`, or the ones on stdin if there are none,
+ * and prints what each of them evaluated to in order
+ */
+static int run_batch(char **paths, size_t path_count)
+{
+  AVM_Job *jobs;
+  size_t count = path_count;
+  char *input = NULL;
+
+  if (path_count > 0) {
+    jobs = my_calloc(path_count, sizeof(AVM_Job));
+    for (size_t i = 0; jobs != NULL && i < path_count; ++i) {
+      jobs[i].path = paths[i];
+    }
+  } else {
+    size_t len;
+    input = read_file(stdin, &len);
+    jobs = input != NULL ? split_batch(input, len, &count) : NULL;
+  }
+  if (jobs == NULL) {
+    fprintf(stderr, "unable to allocate the batch\n");
+    my_free(input);
     return 1;
   }
 
-  avm_int *memory;
-  char* error;
-  size_t memlen;
-  if(avm_parse(opc, &memory, &error, &memlen)) {
-    fprintf(stderr, "parse error: %s\n", error);
-    my_free(opc);
-    my_free(memory);
+  int failed = avm_run_batch(jobs, count, 0);
+
+  for (size_t i = 0; i < count; ++i) {
+    AVM_Job *job = &jobs[i];
+    if (job->path != NULL) {
+      printf("%s: ", job->path);
+    } else {
+      printf("stdin:%zu: ", i + 1);
+    }
+    if (job->failed) {
+      printf("err: %s\n", job->error);
+      my_free(job->error);
+    } else {
+      printf("%" PRIu64 "\n", job->result);
+    }
+  }
+
+  my_free(jobs);
+  my_free(input);
+  return failed;
+}
+
+/* Writes the last AVM_TRACE_CAPACITY instructions `ctx` ran to `path` */
+static int write_trace(AVM_Context *ctx, const char *path)
+{
+  FILE *out = fopen(path, "wb");
+  if (out == NULL) {
+    fprintf(stderr, "unable to open %s\n", path);
+    return 1;
+  }
+  uint64_t lost;
+  int failed = avm_trace_write(ctx, out, &lost);
+  if (fclose(out) != 0 || failed) {
+    fprintf(stderr, "unable to write %s\n", path);
+    return 1;
+  }
+  if (lost > 0) {
+    fprintf(stderr, "trace: the first %" PRIu64 " records were overwritten\n",
+            lost);
+  }
+  return 0;
+}
+
+static int decode_trace(const char *path)
+{
+  FILE *in = fopen(path, "rb");
+  if (in == NULL) {
+    fprintf(stderr, "unable to open %s\n", path);
+    return 1;
+  }
+  char *error;
+  int failed = avm_trace_decode(in, stdout, &error);
+  fclose(in);
+  if (failed) {
+    fprintf(stderr, "%s: %s\n", path, error != NULL ? error : "");
     my_free(error);
+  }
+  return failed;
+}
+
+/* Hot spots `avm --profile` lists */
+#define PROFILE_HOT_SPOTS 20
+
+/* Runs the program in `ctx` like main does, but under the profiler, then
+ * writes the folded stacks to `path` and lists the hot spots on stderr
+ */
+static int run_profiled(AVM_Context *ctx, const char *path)
+{
+  AVM_Profile *profile = avm_profile_new();
+  if (profile == NULL) {
+    fprintf(stderr, "unable to allocate the profile\n");
+    avm_free(ctx);
     return 1;
   }
 
+  avm_int result = 0;
+  int failed = avm_profile(ctx, profile, 0, &result);
+  if (failed) {
+    printf("err: %s\n", ctx->error);
+  }
+
+  FILE *out = fopen(path, "w");
+  if (out == NULL || avm_profile_write_folded(profile, out)) {
+    fprintf(stderr, "unable to write %s\n", path);
+    failed = 1;
+  }
+  if (out != NULL) {
+    fclose(out);
+  }
+  fprintf(stderr, "%" PRIu64 " samples\n", avm_profile_samples(profile));
+  if (avm_profile_write_hot_spots(profile, ctx, PROFILE_HOT_SPOTS, stderr)) {
+    fprintf(stderr, "%s\n", ctx->error);
+    failed = 1;
+  }
+
+  avm_profile_free(profile);
+  avm_free(ctx);
+  return failed ? 1 : (int) result;
+}
+
+int main(int argc, char **argv)
+{
+  const char *path = NULL;
+  const char *compile_to = NULL;
+  const char *profile_to = NULL;
+  const char *trace_to = NULL;
+  int disassemble = 0;
+  int report_fusions = 0;
+  int parallel = 0;
+  int batch = 0;
+  int jit = 0;
+  int ir = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--fusions") == 0) {
+      report_fusions = 1;
+    } else if (strcmp(argv[i], "--parallel") == 0) {
+      parallel = 1;
+    } else if (strcmp(argv[i], "--batch") == 0) {
+      batch = 1;
+    } else if (batch && argv[i][0] != '-') {
+      // the rest are programs
+      return run_batch(&argv[i], (size_t) (argc - i));
+    } else if (strcmp(argv[i], "--jit") == 0) {
+      jit = 1;
+    } else if (strcmp(argv[i], "--ir") == 0) {
+      ir = 1;
+    } else if (strcmp(argv[i], "--compile") == 0 && i + 1 < argc) {
+      compile_to = argv[++i];
+    } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+      profile_to = argv[++i];
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace_to = argv[++i];
+    } else if (strcmp(argv[i], "--disassemble") == 0) {
+      disassemble = 1;
+    } else if (strcmp(argv[i], "--decode-trace") == 0 && i + 1 < argc) {
+      return decode_trace(argv[i + 1]);
+    } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+      usage(argv[0]);
+      return 1;
+    } else if (path == NULL) {
+      path = argv[i];
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (batch) {
+    return run_batch(NULL, 0);
+  }
+
   AVM_Context ctx;
-  int retcode = avm_init(&ctx, (void *) memory, memlen);
-  my_free(opc);
-  my_free(memory);
-  if (retcode) {
-    fprintf(stderr, "failed to initialize vm\n");
-    return 1;
+  size_t memlen;
+  int from_stdin = path == NULL || strcmp(path, "-") == 0;
+
+  if (!from_stdin && compile_to == NULL && is_image_file(path)) {
+    if (avm_init_from_image(&ctx, path)) {
+      fprintf(stderr, "failed to initialize vm: %s\n", ctx.error);
+      return 1;
+    }
+    memlen = ctx.code_size;
+  } else {
+    // files are mapped, stdin and anything that can't be mapped is streamed
+    size_t bytes_read = 0;
+    const char *mapped = from_stdin ? NULL : map_file(path, &bytes_read);
+    avm_int *memory;
+    char* error;
+    int parse_failed;
+
+    if (mapped != NULL && parallel) {
+      parse_failed = avm_parse_parallel(mapped, bytes_read, 0, &memory,
+                                        &error, &memlen);
+      unmap_file(mapped, bytes_read);
+    } else if (mapped != NULL) {
+      parse_failed = avm_parse_len(mapped, bytes_read, &memory, &error,
+                                   &memlen);
+      unmap_file(mapped, bytes_read);
+    } else {
+      FILE* fin = stdin;
+      if (!from_stdin) {
+        fin = fopen(path, "r");
+        if(!fin){
+          fprintf(stderr, "Unable to open file: %s\n", path);
+          return 1;
+        }
+      }
+      parse_failed = parse_stream(fin, &memory, &error, &memlen);
+      if (fin != stdin) {
+        fclose(fin);
+      }
+    }
+    if (parse_failed) {
+      fprintf(stderr, "parse error: %s\n", error);
+      my_free(memory);
+      my_free(error);
+      return 1;
+    }
+
+    if (compile_to != NULL) {
+      int failed = avm_image_write(compile_to, memory, memlen, 0, 0, &error);
+      if (failed) {
+        fprintf(stderr, "%s\n", error);
+        my_free(error);
+      }
+      my_free(memory);
+      return failed;
+    }
+
+    int retcode = avm_init(&ctx, (void *) memory, memlen);
+    my_free(memory);
+    if (retcode) {
+      fprintf(stderr, "failed to initialize vm\n");
+      return 1;
+    }
+  }
+
+  if (disassemble) {
+    int failed = avm_disassemble_file(&ctx, 0, (avm_size_t) memlen,
+                                      AVM_DISASM_LABELS, stdout);
+    if (failed) {
+      fprintf(stderr, "%s\n", ctx.error);
+    }
+    avm_free(&ctx);
+    return failed;
   }
 
 #ifdef AVM_DEBUG
-  char *result;
-  if (avm_stringify_count(&ctx, 0, (avm_size_t) memlen, &result)) {
+  printf("════ code listing ════\n");
+  if (avm_disassemble_file(&ctx, 0, (avm_size_t) memlen, 0, stdout)) {
     printf("err: %s\n", ctx.error);
   }
-  printf("════ code listing ════");
-  printf("%s\n", result);
   printf("══════════════════════\n\n");
-  my_free(result);
+  for (size_t i = 0; i < ctx.block_count; ++i) {
+    AVM_Block *block = &ctx.blocks[i];
+    printf("block %.4x-%.4x: depth %u..", block->start, block->end,
+           block->min_depth);
+    if (block->max_depth == AVM_SIZE_MAX) {
+      printf("∞\n");
+    } else {
+      printf("%u\n", block->max_depth);
+    }
+  }
+  printf("\n");
   my_free(ctx.error);
 #endif
 
+  if ((ir && avm_ir_enable(&ctx, 1)) || (jit && avm_jit_enable(&ctx, 1)) ||
+      (trace_to != NULL && avm_trace_enable(&ctx, AVM_TRACE_CAPACITY)) ||
+      (report_fusions && avm_fusion_count_enable(&ctx, 1))) {
+    fprintf(stderr, "%s\n", ctx.error);
+    avm_free(&ctx);
+    return 1;
+  }
+
+  if (profile_to != NULL) {
+    return run_profiled(&ctx, profile_to);
+  }
+
   avm_int eval_prog_ret = 0;
-  if (avm_eval(&ctx, &eval_prog_ret)) {
+  int failed = avm_eval(&ctx, &eval_prog_ret);
+  if (failed) {
     printf("err: %s\n", ctx.error);
+  }
+  // a trace is most useful when the program failed
+  if (trace_to != NULL && write_trace(&ctx, trace_to)) {
+    failed = 1;
+  }
+  if (failed) {
     avm_free(&ctx);
     return 1;
   }
 
+  if (report_fusions) {
+    char *report;
+    if (avm_fusion_report(&ctx, &report)) {
+      fprintf(stderr, "%s\n", ctx.error);
+    } else {
+      fprintf(stderr, "%s", report);
+      my_free(report);
+    }
+  }
+
   avm_free(&ctx);
   return (int) eval_prog_ret;
 }
 
 #endif  /* AVM_EXECUTABLE */
 
+int avm__load_program(AVM_Context *ctx, const avm_int *initial_mem,
+                        size_t oplen)
+{
+  assert((oplen * sizeof(AVM_Operation)) / sizeof(avm_int) < AVM_SIZE_MAX / 2);
+
+  for (size_t done = 0; done < oplen; ) {
+    avm_int *page = avm__page_write(ctx, (avm_size_t) done);
+    if (page == NULL) {
+      return 1;
+    }
+    size_t count = min(AVM_PAGE_WORDS, oplen - done);
+    memcpy(page, initial_mem + done, count * sizeof(AVM_Operation));
+    done += count;
+  }
+  return 0;
+}
+
+/* Decodes and verifies the program in guest memory, on empty stacks */
+static int start_program(AVM_Context *ctx, avm_size_t code_size,
+                         avm_size_t entry)
+{
+  ctx->proven = 0;
+  memset(ctx->fusion_counts, 0, sizeof(ctx->fusion_counts));
+  ctx->stack_size = 0;
+  ctx->call_stack_size = 0;
+  if (avm__decode_init(ctx, code_size)) {
+    return 1;
+  }
+
+  ctx->ins = entry;
+
+  return avm_verify(ctx);
+}
+
 /**
  * Returns 0 unless there has been an error.
  *
  * Error information can be obtained from `ctx` unless it's
- * an allocation error, in which case `ctx` will be NULL
+ * an allocation error, in which case `ctx` will be NULL.
+ * Either way `ctx` can be passed to avm_free afterwards.
  */
 int avm_init(AVM_Context *ctx, const avm_int *initial_mem, size_t oplen)
 {
-  static const avm_size_t INITIAL_MEMORY_OVERHEAD = 1 << 12;
-  static const size_t INITIAL_CALLSTACK_SIZE = 256;
+  *ctx = (AVM_Context) { .error = NULL };
 
-  ctx->error = NULL;
+  if (avm__memory_init(ctx) || avm__load_program(ctx, initial_mem, oplen)) {
+    return 1;
+  }
 
-  assert((oplen * sizeof(AVM_Operation)) / sizeof(avm_int) < AVM_SIZE_MAX / 2);
-  size_t memory_size = oplen  + INITIAL_MEMORY_OVERHEAD;
+  // decode the program and some slack besides
+  return avm__init_state(ctx, (avm_size_t) (oplen + AVM_CODE_SLACK), 0);
+}
 
-  // allocate enough memory for opcodes and some slack besides
-  ctx->memory_size = (avm_size_t) memory_size;
-  ctx->memory = my_calloc(ctx->memory_size * sizeof(avm_int), 1);
-  if (ctx->memory == NULL) {
-    return avm__error(ctx, "unable to allocate heap (%d avm_int)", memory_size);
-  }
-  memcpy(ctx->memory, initial_mem, oplen * sizeof(AVM_Operation));
+int avm__init_stacks(AVM_Context *ctx)
+{
+  static const size_t INITIAL_CALLSTACK_SIZE = 256;
 
-  ctx->stack_size = 0;
-  ctx->stack_cap = INITIAL_MEMORY_OVERHEAD;
-  // malloc used because stack semantics guarantee
-  // uninitialized data cannot be read
-  ctx->stack = my_malloc(ctx->stack_cap * sizeof(avm_int));
-  if (ctx->stack == NULL) {
-    return avm__error(ctx, "unable to allocate stack (%d bytes)", ctx->stack_cap);
+#ifdef AVM_STACK_GUARD
+  if (avm__stack_init(ctx, AVM_STACK_RESERVE)) {
+#else
+  if (avm__stack_init(ctx, AVM_CODE_SLACK)) {
+#endif
+    return 1;
   }
 
   ctx->call_stack_size = 0;
@@ -110,60 +496,161 @@ int avm_init(AVM_Context *ctx, const avm_int *initial_mem, size_t oplen)
   if (ctx->call_stack == NULL) {
     return avm__error(ctx, "unable to allocate call stack", ctx->call_stack_cap);
   }
+  return 0;
+}
 
-  ctx->ins = 0;
+int avm__init_state(AVM_Context *ctx, avm_size_t code_size, avm_size_t entry)
+{
+  if (avm__init_stacks(ctx)) {
+    return 1;
+  }
+  return start_program(ctx, code_size, entry);
+}
+
+/* Frees the decoded code and blocks, unless they're the program's */
+static void drop_code(AVM_Context *ctx)
+{
+  if (avm__code_shared(ctx)) {
+    ctx->code = NULL;
+    ctx->blocks = NULL;
+  } else {
+    my_free(ctx->code);
+    my_free(ctx->blocks);
+  }
+  ctx->block_count = 0;
+  ctx->code_size = 0;
+  avm__program_release(ctx->program);
+  ctx->program = NULL;
+}
+
+int avm_reset(AVM_Context *ctx, const avm_int *initial_mem, size_t oplen)
+{
+  // everything that depends on the program goes, the stacks stay
+  avm__ir_free(ctx);
+#ifdef AVM_JIT
+  avm__jit_free(ctx);
+#endif
+  my_free(ctx->error);
+  ctx->error = NULL;
+  ctx->trap = AVM_TRAP_NONE;
+  drop_code(ctx);
+  avm__memory_free(ctx);
+  avm__stack_reset(ctx);
+
+  if (avm__memory_init(ctx) || avm__load_program(ctx, initial_mem, oplen)) {
+    return 1;
+  }
+  return start_program(ctx, (avm_size_t) (oplen + AVM_CODE_SLACK), 0);
+}
+
+/* Copies the stacks of `parent` to `child` */
+static int fork_stacks(const AVM_Context *parent, AVM_Context *child)
+{
+  // the stacks are copied up to their size, not their capacity
+  if (avm__stack_init(child, parent->stack_cap)) {
+    return 1;
+  }
+  memcpy(child->stack, parent->stack, parent->stack_size * sizeof(avm_int));
+  child->stack_size = parent->stack_size;
+
+  child->call_stack_size = parent->call_stack_size;
+  child->call_stack_cap = parent->call_stack_cap;
+  child->call_stack = my_malloc(parent->call_stack_cap *
+                                sizeof(AVM_Stack_Frame));
+  if (child->call_stack == NULL) {
+    return avm__error(child, "unable to allocate call stack");
+  }
+  memcpy(child->call_stack, parent->call_stack,
+         parent->call_stack_size * sizeof(AVM_Stack_Frame));
 
   return 0;
 }
 
+int avm_fork(const AVM_Context *parent, AVM_Context *child)
+{
+  // whatever isn't copied below starts out off, empty or NULL
+  *child = (AVM_Context) { .error = NULL };
+  child->limits = parent->limits;
+  avm__memory_share(parent, child);
+
+  child->ins = parent->ins;
+  child->proven = parent->proven;
+  memcpy(child->fusion_counts, parent->fusion_counts,
+         sizeof(child->fusion_counts));
+
+  // the decoded code is the same as long as memory is
+  child->code_size = parent->code_size;
+  if (avm__code_shared(parent)) {
+    __atomic_add_fetch(&parent->program->refs, 1, __ATOMIC_RELAXED);
+    child->program = parent->program;
+    child->code = parent->code;
+    child->blocks = parent->blocks;
+    child->block_count = parent->block_count;
+    return fork_stacks(parent, child);
+  }
+
+  size_t code_bytes = ((size_t) parent->code_size + AVM_DECODE_SPAN) *
+                      sizeof(AVM_Decoded);
+  child->code = my_malloc(code_bytes);
+  if (child->code == NULL) {
+    return avm__error(child, "unable to allocate decoded code (%u ops)",
+                      parent->code_size);
+  }
+  memcpy(child->code, parent->code, code_bytes);
+
+  if (parent->block_count > 0) {
+    child->blocks = my_malloc(parent->block_count * sizeof(AVM_Block));
+    if (child->blocks == NULL) {
+      return avm__error(child, "unable to allocate basic blocks");
+    }
+    memcpy(child->blocks, parent->blocks,
+           parent->block_count * sizeof(AVM_Block));
+    child->block_count = parent->block_count;
+  }
+  // engines aren't shared, the blocks run in the interpreter until enabled
+  avm__mark_blocks(child, 0);
+
+  return fork_stacks(parent, child);
+}
+
 void avm_free(AVM_Context *ctx)
 {
+  avm__ir_free(ctx);
+#ifdef AVM_JIT
+  avm__jit_free(ctx);
+#endif
+  avm__trace_free(ctx);
   my_free(ctx->error);
-  my_free(ctx->memory);
-  my_free(ctx->stack);
+  avm__memory_free(ctx);
+  avm__stack_free(ctx);
   my_free(ctx->call_stack);
+  drop_code(ctx);
 }
 
 
 void avm_heap_get(AVM_Context *ctx, avm_int *data, avm_size_t loc)
 {
-  if (loc >= ctx->memory_size) { // memory never written, it's 0.
-    *data = 0;
-    return;
-  }
-
-  *data = ctx->memory[loc];
+  *data = avm__page(ctx, loc)[loc & (AVM_PAGE_WORDS - 1)];
 }
 
 int avm_heap_set(AVM_Context *ctx, avm_int data, avm_size_t loc)
 {
-  if (data == 0 && loc >= ctx->memory_size) {
-    // This is beyond the bounds of the current memory. Since the memory
-    // defaults to zero, pretend it's been written
+  avm_size_t offset = loc & (AVM_PAGE_WORDS - 1);
+  if (avm__page(ctx, loc)[offset] == data) {
+    // also keeps pages that are only ever written 0 shared
     return 0;
   }
 
-  if (loc >= ctx->memory_size) {
-    avm_size_t new_size = 1;
-    while (new_size < loc && new_size != 0) {
-      new_size *= 2;
-    }
-
-    if (new_size == 0) {
-      return avm__error(ctx, "internal error, tried to resize memory to index at"
-                        " %u, but memory size integer wrapped.", loc);
-    }
-
-    ctx->memory = my_crealloc(ctx->memory, ctx->memory_size * sizeof(avm_int),
-                                new_size * sizeof(avm_int));
-    if (ctx->memory == NULL) {
-      return avm__error(ctx, "unable to allocate more memory (%d avm_ints)",
-                        new_size);
-    }
-    ctx->memory_size = new_size;
+  if (loc < ctx->code_size + AVM_DECODE_SPAN - 1 &&
+      avm__invalidate(ctx, loc)) {
+    return 1;
   }
 
-  ctx->memory[loc] = data;
+  avm_int *page = avm__page_write(ctx, loc);
+  if (page == NULL) {
+    return 1;
+  }
+  page[offset] = data;
   return 0;
 }
 
@@ -171,21 +658,15 @@ int avm_stack_push(AVM_Context *ctx, avm_int data)
 {
   if (ctx->stack_size == AVM_SIZE_MAX) {
     // incrementing it now would jump to 0
-    return avm__error(ctx, "Stack overflow");
+    return avm__trap(ctx, AVM_TRAP_STACK_DEPTH, "Stack overflow");
   }
 
-  ctx->stack_size += 1;
-
-  if (ctx->stack_cap <= ctx->stack_size) {
-    avm_size_t new_cap = (avm_size_t) min(ctx->stack_cap * 2, AVM_SIZE_MAX);
-    ctx->stack = my_realloc(ctx->stack, new_cap * sizeof(avm_int));
-    if (ctx->stack == NULL) {
-      return avm__error(ctx, "unable to increase stack size (%d bytes)", new_cap);
-    }
-
-    ctx->stack_cap = new_cap;
+  if (ctx->stack_cap <= ctx->stack_size + 1 && avm__stack_grow(ctx)) {
+    return 1;
   }
 
+  ctx->stack_size += 1;
+
   assert(ctx->stack_size != 0);  // if it was 0, it'd cause overflow
   ctx->stack[ctx->stack_size - 1] = data;
 
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdio.h>
 
 typedef uint32_t avm_size_t;
 #define AVM_SIZE_MAX UINT32_MAX
@@ -17,8 +18,299 @@ typedef struct AVM_Context_s AVM_Context;
 int  avm_init(AVM_Context *ctx, const avm_int *initial_mem, size_t oplen);
 void avm_free(AVM_Context *ctx);
 
+/* Limits on what a context may grow to, 0 for no limit. They're checked
+ * where stacks and guest memory grow rather than on every instruction, so
+ * they cost nothing while a program runs within them. `bytes` counts guest
+ * memory and the stacks. The operand stack reserved up front with
+ * AVM_STACK_GUARD isn't counted, it's reserved to hold no more than
+ * `bytes` instead, unless `stack_depth` is set.
+ */
+typedef struct {
+  size_t memory_pages;     /* pages of guest memory holding data */
+  avm_size_t stack_depth;  /* items on the operand stack */
+  avm_size_t call_depth;   /* frames on the call stack */
+  size_t bytes;            /* allocated for guest memory and the stacks */
+} AVM_Limits;
+
+/* What made the last failing call on a context fail */
+typedef enum {
+  AVM_TRAP_NONE,
+  AVM_TRAP_ERROR,          /* anything without a code of its own */
+  AVM_TRAP_MEMORY_PAGES,
+  AVM_TRAP_STACK_DEPTH,    /* also an operand stack overflow without limits */
+  AVM_TRAP_CALL_DEPTH,
+  AVM_TRAP_BYTES,
+} AVM_Trap;
+
+/* avm_init, then avm_set_limits. NULL for no limits. */
+int avm_init_limited(AVM_Context *ctx, const avm_int *initial_mem,
+                     size_t oplen, const AVM_Limits *limits);
+
+/* Limits a context however it was set up, before it runs. Stacks holding
+ * more than their limit allows are shrunk. Fails with the trap of the first
+ * limit the context is already beyond. avm_reset keeps the limits, and
+ * avm_fork passes them on.
+ */
+int avm_set_limits(AVM_Context *ctx, const AVM_Limits *limits);
+
+AVM_Trap avm_trap(const AVM_Context *ctx);
+
+/* Replaces the program of a context avm_init or avm_reset set up without
+ * error, like avm_free and avm_init would but keeping the stacks. Clears
+ * the error and turns the JIT compiler and register engine off.
+ */
+int avm_reset(AVM_Context *ctx, const avm_int *initial_mem, size_t oplen);
+
+/* Initializes `ctx` from an image written by avm_image_write. The file is
+ * mapped rather than read, and its code words are only copied once the
+ * program writes over them.
+ */
+int avm_init_from_image(AVM_Context *ctx, const char *path);
+
+/* Writes `len` code words to an image at `path`, with the program starting
+ * at `entry`. `memory_size` is the number of words decoded up front, 0 for
+ * the program and the same slack avm_init decodes.
+ */
+int avm_image_write(const char *path, const avm_int *code, size_t len,
+                    avm_size_t entry, avm_size_t memory_size, char **error);
+
+/* Whether `data` starts like an image */
+int avm_is_image(const char *data, size_t len);
+
+/* A program parsed, decoded and verified once, for any number of contexts
+ * to run. Contexts share its code words and decoded code and only copy the
+ * pages they write to. avm_program_free drops the reference of the caller,
+ * contexts set up from the program hold on to their own until avm_free.
+ * Programs can be shared between threads.
+ */
+typedef struct AVM_Program_s AVM_Program;
+
+AVM_Program *avm_program_new(const avm_int *code, size_t len, char **error);
+void avm_program_free(AVM_Program *program);
+
+/* Sets up `ctx` to run `program` from the start, with empty stacks */
+int avm_init_program(AVM_Context *ctx, AVM_Program *program);
+
+/* Makes `child` a copy of `parent` as it is between evaluations. Guest
+ * memory is shared until either of them writes to it, so forking a context
+ * that already holds its program costs little more than its stacks. The
+ * child starts without the JIT compiler or register engine. On failure the
+ * error is on `child`, which still has to be passed to avm_free.
+ */
+int avm_fork(const AVM_Context *parent, AVM_Context *child);
+
 int avm_eval(AVM_Context *ctx, avm_int *result);
 
+/* What avm_eval_steps returns when it ran out of steps */
+#define AVM_EVAL_BUDGET 2
+
+/* avm_eval for at most `max_steps` jumps, calls and returns, so roughly
+ * that many basic blocks. Code compiled by the JIT only counts the ones
+ * going backwards. Returns AVM_EVAL_BUDGET if the program hasn't finished
+ * by then, and the next avm_eval or avm_eval_steps carries on where it
+ * stopped. Runs one block at least.
+ */
+int avm_eval_steps(AVM_Context *ctx, uint64_t max_steps, avm_int *result);
+
+/* Samples of where programs run by avm_profile spend their time */
+typedef struct AVM_Profile_s AVM_Profile;
+
+/* Instructions between samples of avm_profile, if it's given 0 */
+#define AVM_PROFILE_INTERVAL 1000
+
+AVM_Profile *avm_profile_new(void);
+void avm_profile_free(AVM_Profile *profile);
+
+/* avm_eval on the interpreter, sampling the instruction about to run and
+ * the functions on the call stack every `interval` instructions, give or
+ * take half of that. Instructions that move or work on many words count
+ * once for each, so their share of the samples follows what they cost.
+ * Turns the engines off. Any number of runs can add to one profile.
+ */
+int avm_profile(AVM_Context *ctx, AVM_Profile *profile, uint64_t interval,
+                avm_int *result);
+
+uint64_t avm_profile_samples(const AVM_Profile *profile);
+
+/* Writes a line for every distinct stack sampled, in the folded format of
+ * flamegraph.pl: the targets of the calls from the outermost, and the
+ * instruction, separated by `;`, then the number of samples.
+ */
+int avm_profile_write_folded(const AVM_Profile *profile, FILE *out);
+
+/* Writes the `count` most sampled instructions of the program in `ctx`,
+ * with their share of the samples and their disassembly
+ */
+int avm_profile_write_hot_spots(const AVM_Profile *profile, AVM_Context *ctx,
+                                size_t count, FILE *out);
+
+/* An instruction a traced context ran, as it was about to run it.
+ * Operations fused from two instructions are recorded as the first.
+ */
+typedef struct {
+  avm_int tos;        /* top of the operand stack, 0 if it's empty */
+  avm_size_t pc;
+  avm_size_t depth;   /* items on the operand stack */
+  uint8_t op;         /* the opcode at `pc` */
+  uint8_t pad[7];
+} AVM_Trace_Record;
+
+/* Records `avm --trace` keeps */
+#define AVM_TRACE_CAPACITY (1u << 20)
+
+/* Records every instruction the interpreter runs in `ctx` into a ring of
+ * at least `capacity` records, where the oldest are overwritten. 0 turns
+ * tracing off, which costs nothing while it is. Turns the JIT compiler and
+ * register engine off, as blocks they run aren't traced. avm_reset keeps
+ * tracing on.
+ */
+int avm_trace_enable(AVM_Context *ctx, size_t capacity);
+
+/* Moves up to `max` records out of the ring of `ctx` into `records`, the
+ * oldest first, and returns how many. Can be called on one other thread
+ * while the context runs. `lost` is set to the number of records that
+ * were overwritten before they could be read, if it isn't NULL.
+ */
+size_t avm_trace_read(AVM_Context *ctx, AVM_Trace_Record *records,
+                      size_t max, uint64_t *lost);
+
+/* Moves the records of the ring to `out` as a binary trace file, which is
+ * only read on machines with the same byte order
+ */
+int avm_trace_write(AVM_Context *ctx, FILE *out, uint64_t *lost);
+
+/* Writes the records of a trace file as text, a line per instruction */
+int avm_trace_decode(FILE *in, FILE *out, char **error);
+
+/* A program for avm_run_batch, the source or image at `path`, or `len`
+ * bytes of source at `source` if that isn't NULL. Once it has run, either
+ * `result` holds what it evaluated to or `failed` is set and `error` says
+ * why. The error is the caller's to free.
+ */
+typedef struct {
+  const char *path;
+  const char *source;
+  size_t len;
+  int failed;
+  avm_int result;
+  char *error;
+} AVM_Job;
+
+/* Parses and evaluates `count` independent programs on `threads` threads,
+ * all cores if 0. Each thread reuses one context for the jobs it runs and
+ * takes jobs off the others once it runs out. Returns 1 if any job failed.
+ */
+int avm_run_batch(AVM_Job *jobs, size_t count, unsigned threads);
+
+/* A guest for a scheduler, `ctx` set up by the caller and run a slice of
+ * avm_eval_steps at a time. A worker runs a task of priority p p + 1 times
+ * as often as one of priority 0, so it waits less for its slices and gets
+ * p + 1 times the CPU. Priorities from AVM_SCHED_PRIORITIES - 1 up are all
+ * the same. Once the guest has finished, either `result` holds what it
+ * evaluated to or `failed` is set, and `error` and `trap` say why. The
+ * error is the caller's to free.
+ */
+#define AVM_SCHED_PRIORITIES 8
+
+typedef struct {
+  AVM_Context *ctx;
+  unsigned priority;
+  int failed;
+  avm_int result;
+  char *error;
+  AVM_Trap trap;
+} AVM_Task;
+
+/* Runs many guests on a fixed set of threads. Each thread has a run queue
+ * and takes tasks off the others once its own is empty.
+ */
+typedef struct AVM_Scheduler_s AVM_Scheduler;
+
+/* What the workers of a scheduler have done so far, in total or for one
+ * worker. Only settled once avm_sched_run has returned.
+ */
+#define AVM_SCHED_WAIT_BUCKETS 32
+
+typedef struct {
+  uint64_t slices;        /* calls to avm_eval_steps */
+  uint64_t finished;      /* tasks that ran to the end or failed */
+  uint64_t steals;        /* times an idle worker took tasks off another */
+  uint64_t stolen;        /* tasks it took */
+  size_t queued;          /* tasks waiting on the run queue now */
+  size_t longest;         /* the most tasks the run queue has held */
+  uint64_t wait_ns;       /* time queued tasks waited for their slices */
+  uint64_t max_wait_ns;
+  /* slices that waited less than 2^(i + 1) microseconds, and at least 2^i
+   * for all but the first
+   */
+  uint64_t waits[AVM_SCHED_WAIT_BUCKETS];
+} AVM_Sched_Stats;
+
+/* A scheduler with `threads` workers, one per core if 0, and slices of
+ * `slice` steps, AVM_SCHED_SLICE if 0. NULL if it can't be allocated.
+ */
+#define AVM_SCHED_SLICE 10000
+
+AVM_Scheduler *avm_sched_new(unsigned threads, uint64_t slice);
+
+/* Queues `task` to run. Tasks may be added from any thread, also while
+ * the scheduler runs, and are run by avm_sched_run if they're added before
+ * it returns or by the next one otherwise.
+ */
+int avm_sched_add(AVM_Scheduler *sched, AVM_Task *task);
+
+/* Runs queued tasks until all of them have finished. The calling thread
+ * is the first worker. Returns 1 if any task failed.
+ */
+int avm_sched_run(AVM_Scheduler *sched);
+
+unsigned avm_sched_workers(const AVM_Scheduler *sched);
+
+/* Stats of worker `worker`, or of all of them if it's avm_sched_workers */
+void avm_sched_stats(AVM_Scheduler *sched, unsigned worker,
+                     AVM_Sched_Stats *stats);
+
+/* Frees the scheduler, tasks still queued are never run */
+void avm_sched_free(AVM_Scheduler *sched);
+
+/* Allocations the library has made since the process started, for
+ * benchmarks. A reallocation counts as an allocation of its new size.
+ */
+typedef struct {
+  uint64_t count;
+  uint64_t bytes;
+} AVM_Alloc_Stats;
+
+void avm_alloc_stats(AVM_Alloc_Stats *stats);
+
+/* Proves minimum stack depths over the decoded code, reachable from the
+ * current instruction, so that avm_eval can skip underrun checks. Called
+ * by avm_init.
+ */
+int avm_verify(AVM_Context *ctx);
+
+/* Counts how many times each fused pair of instructions runs, from now
+ * until it's turned off. Costs nothing while it's off. Turns the JIT
+ * compiler and register engine off, as blocks they run aren't counted.
+ * avm_reset sets the counts back to 0.
+ */
+int avm_fusion_count_enable(AVM_Context *ctx, int enabled);
+
+/* Lists how many times each fused pair of instructions ran while counting
+ * was on, one line per pair.
+ */
+int avm_fusion_report(AVM_Context *ctx, char **output);
+
+/* Turns the JIT compiler on or off. Fails if it isn't available in this
+ * build, or for this platform. Turns the register engine off.
+ */
+int avm_jit_enable(AVM_Context *ctx, int enabled);
+
+/* Turns the register engine on or off. It runs blocks translated to a
+ * register based IR instead of the stack code. Turns the JIT compiler off.
+ */
+int avm_ir_enable(AVM_Context *ctx, int enabled);
+
 void avm_heap_get(AVM_Context *ctx, avm_int *data, avm_size_t loc);
 int avm_heap_set(AVM_Context *ctx, avm_int data, avm_size_t loc);
 
@@ -30,6 +322,57 @@ int avm_stringify(AVM_Context *ctx, avm_size_t *ins, char **output);
 int avm_stringify_count(AVM_Context *ctx, avm_size_t ins, avm_size_t len,
                         char **output);
 
+/* Gets a listing a chunk of text at a time, returns nonzero to stop it */
+typedef int (*AVM_Disasm_Sink)(void *user, const char *text, size_t len);
+
+/* Puts `L_xxxx:` before jmpez targets and `fn_xxxx:` before calli targets */
+#define AVM_DISASM_LABELS 1
+
+/* Lists the instructions of the `len` words from `ins`, a line each, in
+ * time linear in `len`. Text goes to `sink` in chunks, it isn't kept.
+ */
+int avm_disassemble(AVM_Context *ctx, avm_size_t ins, avm_size_t len,
+                    unsigned flags, AVM_Disasm_Sink sink, void *user);
+int avm_disassemble_file(AVM_Context *ctx, avm_size_t ins, avm_size_t len,
+                         unsigned flags, FILE *out);
+
+/* avm_disassemble into a string, `length` bytes long if it isn't NULL */
+int avm_disassemble_string(AVM_Context *ctx, avm_size_t ins, avm_size_t len,
+                           unsigned flags, char **output, size_t *length);
+
 int avm_parse(const char *input, avm_int **output, char **error, size_t *outputlen);
 
+/* avm_parse for `len` bytes of input that don't need to end in a NUL */
+int avm_parse_len(const char *input, size_t len, avm_int **output,
+                  char **error, size_t *outputlen);
+
+/* avm_parse_len on `threads` threads, all cores if 0. The input is split
+ * at lines starting with a label, and the parts are parsed on their own.
+ * Unlike avm_parse, code written over other code is an error.
+ */
+int avm_parse_parallel(const char *input, size_t len, unsigned threads,
+                       avm_int **output, char **error, size_t *outputlen);
+
+/* Parses input fed in chunks of any size, tokens may be split between
+ * them. Only the statement a chunk cut off is kept around, so memory use
+ * follows the output rather than the input.
+ *
+ * Words go into an image that avm_parser_finish hands over, or to `sink`
+ * if it isn't NULL, in which case `output` of avm_parser_finish is NULL.
+ * A sink gets the words of each instruction with the address they go to,
+ * and returns nonzero to stop parsing. Words it isn't given are 0.
+ */
+typedef struct AVM_Parser_s AVM_Parser;
+typedef int (*AVM_Parse_Sink)(void *user, avm_size_t loc,
+                              const avm_int *words, size_t count);
+
+AVM_Parser *avm_parser_new(AVM_Parse_Sink sink, void *user);
+int avm_parser_feed(AVM_Parser *parser, const char *chunk, size_t len);
+
+/* Parses what's left, hands over the result like avm_parse does and frees
+ * `parser`. Errors of earlier calls to avm_parser_feed are reported here.
+ */
+int avm_parser_finish(AVM_Parser *parser, avm_int **output, char **error,
+                      size_t *outputlen);
+
 #endif /* _AVM_H */
@@ -0,0 +1,259 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "avm.h"
+#include "avm_util.h"
+#include "avm_def.h"
+
+/* avm_run_batch hands every worker a contiguous share of the jobs. A worker
+ * takes jobs off the front of its share, and once that's empty steals the
+ * back half of the first other share that isn't. Both ends of a share are
+ * packed into one word, so taking and stealing are single compare and
+ * swaps on it.
+ *
+ * A worker keeps its context between jobs and only resets it, so a batch
+ * of small programs doesn't pay for setting up stacks every time.
+ */
+
+typedef struct Pool_s Pool;
+
+typedef struct {
+  uint64_t share;  /* the next job in the low half, the end in the high */
+  Pool *pool;
+  unsigned index;
+} Worker;
+
+struct Pool_s {
+  AVM_Job *jobs;
+  Worker *workers;
+  unsigned count;
+};
+
+static uint64_t share(uint32_t next, uint32_t end)
+{
+  return (uint64_t) end << 32 | next;
+}
+
+/* Takes the next job of the worker's own share */
+static int take(Worker *worker, uint32_t *job)
+{
+  uint64_t old = __atomic_load_n(&worker->share, __ATOMIC_ACQUIRE);
+  while (1) {
+    uint32_t next = (uint32_t) old, end = (uint32_t) (old >> 32);
+    if (next >= end) {
+      return 0;
+    }
+    if (__atomic_compare_exchange_n(&worker->share, &old,
+                                    share(next + 1, end), 1,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      *job = next;
+      return 1;
+    }
+  }
+}
+
+/* Moves the back half of another worker's share into the empty share of
+ * `thief`. 0 if every other share is empty.
+ */
+static int steal(Worker *thief)
+{
+  Pool *pool = thief->pool;
+  for (unsigned k = 1; k < pool->count; ++k) {
+    Worker *victim = &pool->workers[(thief->index + k) % pool->count];
+    uint64_t old = __atomic_load_n(&victim->share, __ATOMIC_ACQUIRE);
+
+    while (1) {
+      uint32_t next = (uint32_t) old, end = (uint32_t) (old >> 32);
+      if (next >= end) {
+        break;
+      }
+      uint32_t split = end - (end - next + 1) / 2;
+      if (__atomic_compare_exchange_n(&victim->share, &old,
+                                      share(next, split), 1,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&thief->share, share(split, end), __ATOMIC_RELEASE);
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+static void fail(AVM_Job *job, char *error)
+{
+  job->failed = 1;
+  job->error = error != NULL ? error : afmt("%s", "unknown error");
+}
+
+/* Loads the job's program into `ctx`, which is set up if `ready` is */
+static int load_job(AVM_Context *ctx, int *ready, AVM_Job *job)
+{
+  size_t len = job->len;
+  const char *source = job->source;
+  const char *mapped = NULL;
+
+  if (source == NULL) {
+    mapped = map_file(job->path, &len);
+    if (mapped == NULL) {
+      fail(job, afmt("unable to open %s", job->path));
+      return 1;
+    }
+    if (avm_is_image(mapped, len)) {
+      unmap_file(mapped, len);
+      if (*ready) {
+        avm_free(ctx);
+      }
+      *ready = avm_init_from_image(ctx, job->path) == 0;
+      return !*ready;
+    }
+    source = mapped;
+  }
+
+  avm_int *code;
+  char *error;
+  size_t code_len;
+  int failed = avm_parse_len(source, len, &code, &error, &code_len);
+  if (mapped != NULL) {
+    unmap_file(mapped, len);
+  }
+  if (failed) {
+    size_t end = error != NULL ? strlen(error) : 0;
+    if (end > 0 && error[end - 1] == '\n') {
+      error[end - 1] = '\0';
+    }
+    fail(job, error != NULL ? afmt("parse error: %s", error) : NULL);
+    my_free(code);
+    my_free(error);
+    return 1;
+  }
+
+  if (*ready) {
+    failed = avm_reset(ctx, code, code_len);
+  } else {
+    failed = avm_init(ctx, code, code_len);
+  }
+  my_free(code);
+  *ready = !failed;
+  return failed;
+}
+
+static void run_job(AVM_Context *ctx, int *ready, AVM_Job *job)
+{
+  job->failed = 0;
+  job->result = 0;
+  job->error = NULL;
+
+  if (load_job(ctx, ready, job) == 0 && avm_eval(ctx, &job->result) == 0) {
+    return;
+  }
+  if (job->failed) {
+    return;  // it never got a context
+  }
+
+  // the context keeps its state for the next job, but not the error
+  fail(job, ctx->error);
+  ctx->error = NULL;
+  if (!*ready) {
+    avm_free(ctx);
+  }
+}
+
+static void *work(void *data)
+{
+  Worker *worker = data;
+  AVM_Context ctx;
+  int ready = 0;
+  uint32_t job;
+
+  while (1) {
+    if (take(worker, &job)) {
+      run_job(&ctx, &ready, &worker->pool->jobs[job]);
+    } else if (!steal(worker)) {
+      break;
+    }
+  }
+
+  if (ready) {
+    avm_free(&ctx);
+  }
+  return NULL;
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+
+static void run_workers(Pool *pool)
+{
+  pthread_t *threads = my_malloc(pool->count * sizeof(pthread_t));
+  unsigned started = 1;
+
+  // the calling thread is the first worker, the others are only started
+  // if they can be
+  while (threads != NULL && started < pool->count &&
+         pthread_create(&threads[started], NULL, work,
+                        &pool->workers[started]) == 0) {
+    started += 1;
+  }
+  work(&pool->workers[0]);
+
+  for (unsigned i = 1; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  my_free(threads);
+}
+
+#else
+
+static void run_workers(Pool *pool)
+{
+  // the first worker steals everything the others were handed
+  work(&pool->workers[0]);
+}
+
+#endif
+
+/* Runs at most UINT32_MAX jobs, what a share can index */
+static void run_slice(AVM_Job *jobs, uint32_t count, unsigned threads)
+{
+  Worker alone;
+  Worker *workers = threads > 1 ? my_malloc(threads * sizeof(Worker)) : NULL;
+  if (workers == NULL) {
+    threads = 1;
+    workers = &alone;
+  }
+  Pool pool = { .jobs = jobs, .workers = workers, .count = threads };
+
+  for (unsigned i = 0; i < threads; ++i) {
+    workers[i] = (Worker) {
+      .share = share((uint32_t) ((uint64_t) count * i / threads),
+                     (uint32_t) ((uint64_t) count * (i + 1) / threads)),
+      .pool = &pool,
+      .index = i,
+    };
+  }
+  run_workers(&pool);
+
+  if (workers != &alone) {
+    my_free(workers);
+  }
+}
+
+int avm_run_batch(AVM_Job *jobs, size_t count, unsigned threads)
+{
+  if (threads == 0) {
+    threads = avm__core_count();
+  }
+
+  for (size_t done = 0; done < count; ) {
+    uint32_t slice = (uint32_t) min(count - done, UINT32_MAX);
+    run_slice(jobs + done, slice, threads < slice ? threads : slice);
+    done += slice;
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    if (jobs[i].failed) {
+      return 1;
+    }
+  }
+  return 0;
+}
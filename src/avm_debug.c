@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include "avm.h"
 #include "avm_util.h"
 #include "avm_def.h"
@@ -24,7 +25,8 @@ static void dump_stack(AVM_Context *ctx)
   while (1) {
     if (i == 0) { break; }
     i -= 1;
-    printf("│%d.\t%.16lx (dec. %lu)\n", i, ctx->stack[i], ctx->stack[i]);
+    printf("│%d.\t%.16" PRIx64 " (dec. %" PRIu64 ")\n", i, ctx->stack[i],
+           ctx->stack[i]);
   }
   printf("└───── end stack dump ─────\n");
 }
@@ -0,0 +1,244 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include "avm.h"
+#include "avm_util.h"
+#include "avm_def.h"
+
+/* Variants without underrun checks and the stack depth they need */
+static const struct {
+  uint8_t op;
+  uint8_t need;
+} unchecked[decoded_op_count] = {
+  [avm_opc_add  ] = { avm_dop_add_nc,   2 },
+  [avm_opc_sub  ] = { avm_dop_sub_nc,   2 },
+  [avm_opc_mul  ] = { avm_dop_mul_nc,   2 },
+  [avm_opc_div  ] = { avm_dop_div_nc,   2 },
+  [avm_opc_and  ] = { avm_dop_and_nc,   2 },
+  [avm_opc_or   ] = { avm_dop_or_nc,    2 },
+  [avm_opc_xor  ] = { avm_dop_xor_nc,   2 },
+  [avm_opc_shr  ] = { avm_dop_shr_nc,   2 },
+  [avm_opc_shl  ] = { avm_dop_shl_nc,   2 },
+  [avm_opc_call ] = { avm_dop_call_nc,  1 },
+  [avm_opc_jmpez] = { avm_dop_jmpez_nc, 1 },
+  [avm_opc_quit ] = { avm_dop_quit_nc,  1 },
+  [avm_opc_dup  ] = { avm_dop_dup_nc,   1 },
+  [avm_dop_push_add ] = { avm_dop_push_add_nc,  1 },
+  [avm_dop_push_sub ] = { avm_dop_push_sub_nc,  1 },
+  [avm_dop_dup_jmpez] = { avm_dop_dup_jmpez_nc, 1 },
+};
+
+void avm__refine(AVM_Decoded *op)
+{
+  if (unchecked[op->op].op && op->lo >= unchecked[op->op].need) {
+    op->op = unchecked[op->op].op;
+  }
+}
+
+/* Instruction pairs that run as a single operation. Adding a pair takes a
+ * row here and a handler in avm_eval.c that behaves exactly like the two
+ * instructions would, including the errors they raise. Instrumented
+ * evaluation runs the two one at a time instead, see avm__unfuse.
+ */
+typedef struct {
+  const char *name;
+  AVM_Opcode first;
+  AVM_Opcode second;
+  int needs_zero;   /* only fuse if the push is of 0 */
+  uint8_t op;
+} AVM_Fusion;
+
+static const AVM_Fusion fusions[] = {
+  { "push+add",     avm_opc_push, avm_opc_add,   0, avm_dop_push_add  },
+  { "push+sub",     avm_opc_push, avm_opc_sub,   0, avm_dop_push_sub  },
+  { "dup+jmpez",    avm_opc_dup,  avm_opc_jmpez, 0, avm_dop_dup_jmpez },
+  { "push 0+jmpez", avm_opc_push, avm_opc_jmpez, 1, avm_dop_jump      },
+  { "push+call",    avm_opc_push, avm_opc_call,  0, avm_dop_push_call },
+};
+
+#define FUSION_COUNT (sizeof(fusions) / sizeof(fusions[0]))
+
+_Static_assert(FUSION_COUNT <= AVM_MAX_FUSIONS, "raise AVM_MAX_FUSIONS");
+
+/* Turns the decoded `out` into a fused pair if the instruction after it
+ * completes one.
+ */
+static void fuse(AVM_Context *ctx, avm_size_t loc, AVM_Decoded *out)
+{
+  AVM_Opcode first = out->op;
+  avm_size_t next_loc = loc + (first == avm_opc_push ? 2 : 1);
+  AVM_Operation next;
+  int next_read = 0;
+
+  for (size_t i = 0; i < FUSION_COUNT; ++i) {
+    const AVM_Fusion *fusion = &fusions[i];
+    if (fusion->first != first || (fusion->needs_zero && out->imm != 0)) {
+      continue;
+    }
+
+    if (!next_read) {
+      avm_heap_get(ctx, (avm_int *) &next, next_loc);
+      next_read = 1;
+    }
+
+    if (next.kind == fusion->second) {
+      out->op = fusion->op;
+      out->arg = next.address;
+      return;
+    }
+  }
+}
+
+/* `lo` and `flags` of `out` are kept */
+void avm__decode(AVM_Context *ctx, avm_size_t loc, AVM_Decoded *out)
+{
+  AVM_Operation op;
+  avm_heap_get(ctx, (avm_int *) &op, loc);
+
+  out->op = op.kind;
+  out->arg = op.address;
+  out->imm = 0;
+
+  switch (op.kind) {
+  case avm_opc_push:
+    avm_heap_get(ctx, &out->imm, loc + 1);
+    fuse(ctx, loc, out);
+    break;
+  case avm_opc_load:
+  case avm_opc_store:
+    out->imm = op.size;
+    break;
+  case avm_opc_vadd:
+  case avm_opc_vsub:
+  case avm_opc_vmul:
+  case avm_opc_vand:
+  case avm_opc_vor:
+  case avm_opc_vxor:
+  case avm_opc_vshr:
+  case avm_opc_vshl:
+    out->imm = op.size;
+    break;
+  default:
+    if (op.kind >= opcode_count || op.kind == avm_opc_error) {
+      out->op = avm_opc_error;
+      out->imm = op.value;
+    } else if (op.kind == avm_opc_dup) {
+      fuse(ctx, loc, out);
+    }
+    break;
+  }
+
+  avm__refine(out);
+}
+
+int avm_fusion_count_enable(AVM_Context *ctx, int enabled)
+{
+  if (enabled) {
+    // the engines run whole blocks, not an operation at a time
+    avm_ir_enable(ctx, 0);
+  }
+  ctx->count_fusions = enabled;
+  return 0;
+}
+
+void avm__count_fusion(AVM_Context *ctx, uint8_t op)
+{
+  // the fused operations come last
+  if (op < avm_dop_push_add) {
+    return;
+  }
+  for (size_t i = 0; i < FUSION_COUNT; ++i) {
+    if (fusions[i].op == op || unchecked[fusions[i].op].op == op) {
+      ctx->fusion_counts[i] += 1;
+      return;
+    }
+  }
+}
+
+uint8_t avm__unfuse(uint8_t op)
+{
+  for (size_t i = 0; i < FUSION_COUNT && op >= avm_dop_push_add; ++i) {
+    if (fusions[i].op == op || unchecked[fusions[i].op].op == op) {
+      return fusions[i].first;
+    }
+  }
+  return op;
+}
+
+int avm_fusion_report(AVM_Context *ctx, char **output)
+{
+  *output = afmt("%s", "");
+
+  for (size_t i = 0; i < FUSION_COUNT && *output != NULL; ++i) {
+    char *previous = *output;
+    *output = afmt("%s%-14s %zu\n", previous, fusions[i].name,
+                   ctx->fusion_counts[i]);
+    my_free(previous);
+  }
+
+  if (*output == NULL) {
+    return avm__error(ctx, "Unable to format the fusion report");
+  }
+  return 0;
+}
+
+AVM_Decoded *avm__decode_table(AVM_Context *ctx, avm_size_t size)
+{
+  AVM_Decoded *code = my_malloc(((size_t) size + AVM_DECODE_SPAN) *
+                                sizeof(AVM_Decoded));
+  if (code == NULL) {
+    return NULL;
+  }
+
+  for (avm_size_t i = 0; i < size; ++i) {
+    code[i] = (AVM_Decoded) { .lo = 0 };
+    avm__decode(ctx, i, &code[i]);
+  }
+
+  // sequential execution off the end of the table lands on these
+  for (avm_size_t i = size; i < size + AVM_DECODE_SPAN; ++i) {
+    code[i] = (AVM_Decoded) { .op = avm_dop_resync };
+  }
+  return code;
+}
+
+/* Decodes everything up front. Code can live anywhere in memory, so the
+ * slack after the program is decoded as well, as runtime generated code
+ * is most likely to end up there.
+ */
+int avm__decode_init(AVM_Context *ctx, avm_size_t size)
+{
+  ctx->code_size = size;
+  ctx->code = avm__decode_table(ctx, size);
+  if (ctx->code == NULL) {
+    return avm__error(ctx, "unable to allocate decoded code (%u ops)", size);
+  }
+  return 0;
+}
+
+int avm__invalidate(AVM_Context *ctx, avm_size_t loc)
+{
+  if (avm__code_own(ctx)) {
+    return 1;
+  }
+
+  if (loc < ctx->code_size && (ctx->code[loc].flags & AVM_DEC_VERIFIED)) {
+    // the stack effect of verified code may have changed
+    avm__unverify(ctx);
+  }
+
+  if (ctx->ir != NULL) {
+    avm__ir_invalidate(ctx, loc);
+  }
+#ifdef AVM_JIT
+  if (ctx->jit != NULL) {
+    avm__jit_invalidate(ctx, loc);
+  }
+#endif
+
+  avm_size_t first = loc < AVM_DECODE_SPAN ? 0 : loc - AVM_DECODE_SPAN + 1;
+
+  for (avm_size_t i = first; i <= loc && i < ctx->code_size; ++i) {
+    ctx->code[i].op = avm_dop_stale;
+  }
+  return 0;
+}
@@ -21,6 +21,19 @@ enum {
   avm_opc_jmpez,  /* Jumps to the `target` if the top of the stack is `1` */
   avm_opc_quit,
   avm_opc_dup,
+  avm_opc_copy,   /* pops `count`, `from` and `to`, memmove of `count` words */
+  avm_opc_fill,   /* pops `count`, `value` and `to`, sets the words to `value` */
+
+  /* pop two groups of `size` words and push the results lane by lane, in
+   * the order of the scalar operations from avm_opc_add */
+  avm_opc_vadd,
+  avm_opc_vsub,
+  avm_opc_vmul,
+  avm_opc_vand,
+  avm_opc_vor,
+  avm_opc_vxor,
+  avm_opc_vshr,
+  avm_opc_vshl,
 
   opcode_count
 };
@@ -47,8 +60,139 @@ typedef struct {
   avm_size_t caller;
 } AVM_Stack_Frame;
 
+/* Operations that only exist in decoded form, numbered after the real
+ * opcodes so that a decoded `op` can index the same dispatch tables.
+ */
+enum {
+  avm_dop_stale = opcode_count,  /* memory under it changed, decode again */
+  avm_dop_resync,                /* outside of the decoded table */
+
+  /* variants without underrun checks, for code proven by avm_verify */
+  avm_dop_add_nc,
+  avm_dop_sub_nc,
+  avm_dop_mul_nc,
+  avm_dop_div_nc,
+  avm_dop_and_nc,
+  avm_dop_or_nc,
+  avm_dop_xor_nc,
+  avm_dop_shr_nc,
+  avm_dop_shl_nc,
+  avm_dop_call_nc,
+  avm_dop_jmpez_nc,
+  avm_dop_quit_nc,
+  avm_dop_dup_nc,
+
+  /* pairs fused into one operation, see `fusions` in avm_decode.c */
+  avm_dop_push_add,
+  avm_dop_push_add_nc,
+  avm_dop_push_sub,
+  avm_dop_push_sub_nc,
+  avm_dop_dup_jmpez,
+  avm_dop_dup_jmpez_nc,
+  avm_dop_jump,        /* push 0; jmpez */
+  avm_dop_push_call,
+
+  decoded_op_count
+};
+
+/* Operand stack slots reserved up front when the stack is guarded */
+#ifndef AVM_STACK_RESERVE
+#define AVM_STACK_RESERVE (1u << 27)
+#endif
+
+/* Guest memory is split into pages of AVM_PAGE_WORDS words, found through
+ * a directory of tables of AVM_TABLE_SIZE pages each, see avm_memory.c.
+ */
+#define AVM_PAGE_BITS  12
+#define AVM_TABLE_BITS 10
+#define AVM_PAGE_WORDS (1u << AVM_PAGE_BITS)
+#define AVM_TABLE_SIZE (1u << AVM_TABLE_BITS)
+#define AVM_DIR_SIZE   (1u << (32 - AVM_PAGE_BITS - AVM_TABLE_BITS))
+
+/* Words decoded after the program, where runtime generated code is most
+ * likely to end up */
+#define AVM_CODE_SLACK (1u << 12)
+
+/* The most words a single decoded instruction reads */
+#define AVM_DECODE_SPAN 3
+
+/* Times a block is entered before the JIT compiles it */
+#ifndef AVM_JIT_THRESHOLD
+#define AVM_JIT_THRESHOLD 8
+#endif
+
+/* Room for the fused pairs in `fusions`, see avm_decode.c */
+#define AVM_MAX_FUSIONS 16
+
+/* An instruction decoded once by avm__decode, so that the evaluator doesn't
+ * pick the bitfields of an AVM_Operation apart on every execution.
+ */
+typedef struct {
+  uint8_t op;
+  uint8_t lo;      /* proven minimum stack depth, saturates at 255 */
+  uint8_t flags;
+  uint8_t _pad;
+  avm_size_t arg;  /* `address` of load, store, calli and jmpez */
+  avm_int imm;     /* push value, load/store size, vector lanes, raw word of
+                    * an error */
+  /* fused pairs keep `imm` of their push and `arg` of their jmpez */
+} AVM_Decoded;
+
+_Static_assert(decoded_op_count <= 256, "decoded ops must fit in a byte");
+
+/* AVM_Decoded flags */
+#define AVM_DEC_VERIFIED 0x01  /* reached by avm_verify, `lo` is valid */
+#define AVM_DEC_LEADER   0x02  /* starts a basic block */
+#define AVM_DEC_ENGINE   0x04  /* starts a block avm_ir.c or avm_jit.c runs */
+
+/* A basic block found by avm_verify and the stack depths it's entered with.
+ * `max_depth` is AVM_SIZE_MAX if the depth isn't bounded.
+ */
+typedef struct {
+  avm_size_t start;
+  avm_size_t end;
+  avm_size_t min_depth;
+  avm_size_t max_depth;
+} AVM_Block;
+
+/* A program image mapped by avm_init_from_image, shared by the contexts
+ * forked from the one it was loaded into. The full pages of code words
+ * between `words` and `end` are used as guest memory until written to, see
+ * avm_image.c.
+ */
+typedef struct {
+  size_t refs;
+  const avm_int *words;
+  const avm_int *end;
+  const char *map;
+  size_t map_len;
+} AVM_Image;
+
+/* State of the JIT compiler, see avm_jit.c */
+typedef struct AVM_Jit_s AVM_Jit;
+
+/* State of the register engine, see avm_ir.c */
+typedef struct AVM_Ir_s AVM_Ir;
+
+/* Ring of trace records, see avm_trace.c */
+typedef struct AVM_Trace_s AVM_Trace;
+
 typedef struct AVM_Context_s {
-  avm_int *memory;
+  /**
+   * Guest memory, `memory[dir][table][offset]`. Tables and pages nothing
+   * was written to are a zero table and page shared by every context, the
+   * others may be shared with forks, see avm_memory.c.
+   */
+  avm_int **memory[AVM_DIR_SIZE];
+  /* NULL unless memory starts out as the pages of an image */
+  AVM_Image *image;
+  /**
+   * NULL unless set up by avm_init_program. Until the context writes to
+   * its code or turns an engine on, `code` and `blocks` are the program's,
+   * see avm_program.c.
+   */
+  AVM_Program *program;
+
   avm_int *stack;
   /**
    * each `call` execution pushes the given address to this
@@ -57,7 +201,6 @@ typedef struct AVM_Context_s {
    */
   AVM_Stack_Frame *call_stack;
 
-  avm_size_t memory_size;
   avm_size_t stack_size;
   avm_size_t stack_cap;
 
@@ -67,8 +210,65 @@ typedef struct AVM_Context_s {
   /* The instruction pointer */
   avm_size_t ins;
 
+  /**
+   * `code[i]` caches the decoded form of the instruction at `memory[i]`
+   * for the first `code_size` words, followed by AVM_DECODE_SPAN resync
+   * entries. Writes to memory mark the entries they affect stale.
+   */
+  AVM_Decoded *code;
+  avm_size_t code_size;
+
+  /**
+   * Set while `lo` of verified instructions holds. Entering verified code
+   * with less on the stack, running code outside of the decoded table or
+   * writing over a verified instruction drops every proof.
+   */
+  int proven;
+  AVM_Block *blocks;
+  size_t block_count;
+
+  /* How many times each of the fused pairs has run, while `count_fusions`
+   * is set
+   */
+  size_t fusion_counts[AVM_MAX_FUSIONS];
+  int count_fusions;
+
+  /* The steps of avm_eval_steps left while an engine runs */
+  uint64_t budget;
+
+  AVM_Limits limits;
+  /* Pages and tables of guest memory `memory` points at that aren't the
+   * zero page or table or borrowed from an image, and their size
+   */
+  size_t pages;
+  size_t tables;
+  size_t memory_bytes;
+
+  /* NULL unless avm_jit_enable turned the JIT compiler on */
+  AVM_Jit *jit;
+  /* NULL unless avm_ir_enable turned the register engine on */
+  AVM_Ir *ir;
+  /* NULL unless avm_trace_enable turned tracing on */
+  AVM_Trace *trace;
+  /* The profile avm_profile adds samples to while it runs, and what is
+   * left to run before the next one
+   */
+  AVM_Profile *profile;
+  uint64_t sample_in;
 
   char *error;
+  AVM_Trap trap;
 } AVM_Context;
 
+/* Code decoded and verified once by avm_program_new, for the contexts set
+ * up by avm_init_program. `proto` holds the code words, decoded forms and
+ * blocks, and never runs. `plain` is its code decoded without the proofs,
+ * what contexts switch to once they drop them.
+ */
+struct AVM_Program_s {
+  size_t refs;
+  AVM_Context proto;
+  AVM_Decoded *plain;
+};
+
 #endif
@@ -1,21 +1,33 @@
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <inttypes.h>
 #include "avm.h"
 #include "avm_util.h"
 #include "avm_def.h"
 
 
-typedef int (*Evaluator)(const AVM_Operation, AVM_Context *);
-
-static int push_call(AVM_Context *ctx, AVM_Stack_Frame frame)
+int avm__push_call(AVM_Context *ctx, AVM_Stack_Frame frame)
 {
   if (ctx->call_stack_size + 1 == AVM_SIZE_MAX) {
-    return avm__error(ctx, "Call stack overflow");
+    return avm__trap(ctx, AVM_TRAP_CALL_DEPTH, "Call stack overflow");
   }
 
   if (ctx->call_stack_cap <= ctx->call_stack_size + 1) { // overflowing? resize
     size_t new_size = min(ctx->call_stack_cap * 2, AVM_SIZE_MAX);
+    avm_size_t depth = ctx->limits.call_depth;
+    if (depth != 0 && ctx->call_stack_cap > depth) {
+      return avm__trap(ctx, AVM_TRAP_CALL_DEPTH, "Call stack overflow: "
+                       "limit of %u calls reached", depth);
+    }
+    if (depth != 0) {
+      new_size = min(new_size, (size_t) depth + 1);
+    }
+    if (avm__limit_bytes(ctx, (new_size - ctx->call_stack_cap) *
+                         sizeof(AVM_Stack_Frame))) {
+      return 1;
+    }
     ctx->call_stack = my_crealloc(ctx->call_stack,
                                   ctx->call_stack_cap * sizeof(AVM_Stack_Frame),
                                   new_size * sizeof(AVM_Stack_Frame));
@@ -36,213 +48,896 @@ static int push_call(AVM_Context *ctx, AVM_Stack_Frame frame)
   return 0;
 }
 
-static int eval_error ( const AVM_Operation op, AVM_Context *ctx )
+static int eval_error ( const AVM_Decoded *op, AVM_Context *ctx )
 {
-  return avm__error(ctx, "Invalid opcode 0x%.16x", op.value);
+  return avm__error(ctx, "Invalid opcode 0x%.16" PRIx64, op->imm);
 }
 
 /* Extract the amount of memory specified in `size` and push it to
- * the stack, lowest byte first.
+ * the stack, lowest byte first. Copies a page at a time.
  */
-static int eval_load ( const AVM_Operation op, AVM_Context *ctx )
+int avm__eval_load ( const AVM_Decoded *op, AVM_Context *ctx )
 {
-  avm_size_t size = op.size;
-  avm_size_t address = op.address;
+  avm_size_t size = (avm_size_t) op->imm;
+  avm_size_t address = op->arg;
 
   if (asizet_add_bounds_check(address, size))
     return avm__error(ctx, "Unable to execute load from %x, size %x: out of bounds",
                       address, size);
 
-  for (avm_size_t idx = address; idx < size + address; ++idx) {
-    avm_int data;
+  if (avm__stack_reserve(ctx, size)) {
+    return 1;
+  }
+
+  avm_int *out = ctx->stack + ctx->stack_size;
+  for (avm_size_t done = 0; done < size; ) {
+    avm_size_t loc = address + done;
+    avm_size_t offset = loc & (AVM_PAGE_WORDS - 1);
+    avm_size_t count = AVM_PAGE_WORDS - offset;
+    if (count > size - done) {
+      count = size - done;
+    }
 
-    avm_heap_get(ctx, &data, idx);
-    if (avm_stack_push(ctx, data)) { return 1; }
+    memcpy(out + done, avm__page(ctx, loc) + offset, count * sizeof(avm_int));
+    done += count;
   }
+  ctx->stack_size += size;
 
   return 0;
 }
 
+#if defined(__GNUC__)
+/* Two words in one vector register */
+typedef avm_int Pair __attribute__((vector_size(2 * sizeof(avm_int))));
+#endif
+
+/* Copies `count` words to `to` from `from` downwards, the order store pops
+ * them in. Pairs of words are swapped in vector registers where the
+ * compiler has them.
+ */
+static void copy_reversed(avm_int *to, const avm_int *from, avm_size_t count)
+{
+  avm_size_t i = 0;
+#if defined(__GNUC__)
+  for (; i + 2 <= count; i += 2) {
+    Pair pair;
+    memcpy(&pair, from - i - 1, sizeof(pair));
+#if defined(__clang__)
+    pair = __builtin_shufflevector(pair, pair, 1, 0);
+#else
+    pair = __builtin_shuffle(pair, (Pair) { 1, 0 });
+#endif
+    memcpy(to + i, &pair, sizeof(pair));
+  }
+#endif
+  for (; i < count; ++i) {
+    to[i] = from[-(ptrdiff_t) i];
+  }
+}
+
 /* Pops `size` items off the stack and places them on the heap
- * at the given location.
+ * at the given location, a page at a time.
  */
-static int eval_store ( const AVM_Operation op, AVM_Context *ctx )
+int avm__eval_store ( const AVM_Decoded *op, AVM_Context *ctx )
 {
-  avm_size_t size = op.size;
-  avm_size_t address = op.address;
+  avm_size_t size = (avm_size_t) op->imm;
+  avm_size_t address = op->arg;
 
   if (asizet_add_bounds_check(address, size))
     return avm__error(ctx, "Unable to execute store to %x, size %x: out of bounds",
                       address, size);
 
-  for (avm_size_t idx = address; idx < size + address; ++idx) {
-    avm_int data;
+  // everything that's there is stored before an underrun is reported
+  avm_size_t available = size < ctx->stack_size ? size : ctx->stack_size;
+  const avm_int *top = ctx->stack + ctx->stack_size - 1;
+  avm_size_t code_end = ctx->code_size + AVM_DECODE_SPAN - 1;
+
+  for (avm_size_t done = 0; done < available; ) {
+    avm_size_t loc = address + done;
+    avm_size_t offset = loc & (AVM_PAGE_WORDS - 1);
+    avm_size_t count = AVM_PAGE_WORDS - offset;
+    if (count > available - done) {
+      count = available - done;
+    }
+    const avm_int *from = top - done;
+    const avm_int *page = avm__page(ctx, loc) + offset;
 
-    if (avm_stack_pop(ctx, &data)) { return 1; }
-    if (avm_heap_set(ctx, data, idx)) { return 1; }
+    // pages are only written, and copied, once a word changes
+    avm_size_t same = 0;
+    while (same < count && page[same] == from[-(ptrdiff_t) same]) {
+      same += 1;
+    }
+    if (same < count && loc + same >= code_end) {
+      avm_int *writable = avm__page_write(ctx, loc);
+      if (writable == NULL) {
+        ctx->stack_size -= done;
+        return 1;
+      }
+      copy_reversed(writable + offset + same, from - same, count - same);
+      done += count;
+      continue;
+    }
+
+    // words that may be decoded code are written one at a time
+    avm_int *writable = NULL;
+    for (avm_size_t i = same; i < count; ++i) {
+      avm_int data = from[-(ptrdiff_t) i];
+      if (page[i] == data) {
+        continue;
+      }
+      if (loc + i < code_end && avm__invalidate(ctx, loc + i)) {
+        ctx->stack_size -= done;
+        return 1;
+      }
+      if (writable == NULL) {
+        writable = avm__page_write(ctx, loc);
+        if (writable == NULL) {
+          ctx->stack_size -= done;
+          return 1;
+        }
+        writable += offset;
+        page = writable;
+      }
+      writable[i] = data;
+    }
+    done += count;
   }
+  ctx->stack_size -= available;
 
+  if (available < size) {
+    return avm__error(ctx, "unable to pop item off stack: stack underrun");
+  }
   return 0;
 }
 
-/* Places the immediate value at the top of the sack
+/* Pops the three operands of `copy` or `fill`, the last pushed into
+ * `args[2]`, and checks that `count` words from `args[0]` are in memory
  */
-static int eval_push ( const AVM_Operation op, AVM_Context *ctx )
+static int pop_bulk_args(AVM_Context *ctx, const char *name, avm_int *args)
 {
-  avm_int data = ctx->memory[ctx->ins + 1];
-  ctx->ins += 1;
-  return avm_stack_push(ctx, data);
+  if (ctx->stack_size < 3) {
+    // like NEED, as if they had been popped one at a time
+    ctx->stack_size = 0;
+    return avm__error(ctx, "unable to pop item off stack: stack underrun");
+  }
+  ctx->stack_size -= 3;
+  memcpy(args, ctx->stack + ctx->stack_size, 3 * sizeof(avm_int));
+
+  if (args[0] > AVM_SIZE_MAX || args[2] > AVM_SIZE_MAX ||
+      (args[2] > 0 && asizet_add_bounds_check((avm_size_t) args[0],
+                                              (avm_size_t) args[2]))) {
+    return avm__error(ctx, "Unable to execute %s to %" PRIx64 ", size %"
+                      PRIx64 ": out of bounds", name, args[0], args[2]);
+  }
+  return 0;
 }
 
-#define SIMPLE_BINOP(NAME, OP) \
-static int eval_ ## NAME ( const AVM_Operation op, AVM_Context* ctx ) { \
-  avm_int a, b; \
-  if(avm_stack_pop(ctx, &b)) return 1; \
-  if(avm_stack_pop(ctx, &a)) return 1; \
-  if(avm_stack_push(ctx, OP)) return 1; \
-  return 0; \
+/* The words past the decoded code, which nothing needs to be told about
+ * when they change
+ */
+static avm_size_t data_start(const AVM_Context *ctx)
+{
+  return ctx->code_size + AVM_DECODE_SPAN - 1;
 }
 
-// *INDENT-OFF*
+/* Copies `count` words between two runs that don't cross a page */
+static int copy_run(AVM_Context *ctx, avm_size_t to, avm_size_t from,
+                    avm_size_t count, int downwards)
+{
+  avm_size_t mask = AVM_PAGE_WORDS - 1;
+
+  if (to < data_start(ctx)) {
+    // may be decoded code, a word at a time in the order memmove would
+    for (avm_size_t i = 0; i < count; ++i) {
+      avm_size_t k = downwards ? count - 1 - i : i;
+      if (avm_heap_set(ctx, avm__page(ctx, from + k)[(from + k) & mask],
+                       to + k)) {
+        return 1;
+      }
+    }
+    return 0;
+  }
+
+  if (count == AVM_PAGE_WORDS) {
+    return avm__page_alias(ctx, to, from);
+  }
+  if (avm__page_is_zero(ctx, from) && avm__page_is_zero(ctx, to)) {
+    return 0;
+  }
+  avm_int *page = avm__page_write(ctx, to);
+  if (page == NULL) {
+    return 1;
+  }
+  memmove(page + (to & mask), avm__page(ctx, from) + (from & mask),
+          count * sizeof(avm_int));
+  return 0;
+}
 
-/* push(pop() + pop()) */
-SIMPLE_BINOP(add, a + b)
+/* Pops `count`, `from` and `to` and copies `count` words from `from` to
+ * `to` as memmove would, a run within a page of either at a time. Whole
+ * pages are shared rather than copied, and zero pages left alone.
+ */
+int avm__eval_copy(AVM_Context *ctx)
+{
+  avm_int args[3];
+  if (pop_bulk_args(ctx, "copy", args)) {
+    return 1;
+  }
+  uint64_t to = args[0], from = args[1], count = args[2];
+  if (from > AVM_SIZE_MAX || (args[2] > 0 &&
+      asizet_add_bounds_check((avm_size_t) from, (avm_size_t) args[2]))) {
+    return avm__error(ctx, "Unable to execute copy from %" PRIx64 ", size %"
+                      PRIx64 ": out of bounds", from, count);
+  }
 
-/* push(pop() - pop()) */
-SIMPLE_BINOP(sub, a - b)
+  avm_size_t mask = AVM_PAGE_WORDS - 1;
+  // overlapping with `to` after `from`, so it goes from the end
+  int downwards = to > from && to - from < count;
+
+  for (uint64_t done = 0; done < count; ) {
+    uint64_t left = count - done;
+    uint64_t run_from, run_to, run;
+    if (downwards) {
+      uint64_t from_end = from + left, to_end = to + left;
+      run = min(left, min(((from_end - 1) & mask) + 1,
+                          ((to_end - 1) & mask) + 1));
+      run_from = from_end - run;
+      run_to = to_end - run;
+    } else {
+      run_from = from + done;
+      run_to = to + done;
+      run = min(left, min(AVM_PAGE_WORDS - (run_from & mask),
+                          AVM_PAGE_WORDS - (run_to & mask)));
+    }
+    if (copy_run(ctx, (avm_size_t) run_to, (avm_size_t) run_from,
+                 (avm_size_t) run, downwards)) {
+      return 1;
+    }
+    done += run;
+  }
+  return 0;
+}
 
-/* push(pop() * pop()) */
-SIMPLE_BINOP(mul, a * b)
+/* Sets `count` words at `to` to `value` */
+static void fill_words(avm_int *to, avm_int value, avm_size_t count)
+{
+  avm_size_t i = 0;
+  if (value == 0) {
+    memset(to, 0, count * sizeof(avm_int));
+    return;
+  }
+#if defined(__GNUC__)
+  Pair pair = { value, value };
+  for (; i + 2 <= count; i += 2) {
+    memcpy(to + i, &pair, sizeof(pair));
+  }
+#endif
+  for (; i < count; ++i) {
+    to[i] = value;
+  }
+}
 
-/* push(pop() / pop()), n/0 = n */
-SIMPLE_BINOP(div, a / (b + (b == 0)))
+/* Pops `count`, `value` and `to` and sets `count` words at `to` to
+ * `value`, a page at a time. Whole pages filled with 0 go back to being
+ * the zero page.
+ */
+int avm__eval_fill(AVM_Context *ctx)
+{
+  avm_int args[3];
+  if (pop_bulk_args(ctx, "fill", args)) {
+    return 1;
+  }
 
-/* push(pop() & pop()) */
-SIMPLE_BINOP(and, a & b)
+  avm_size_t to = (avm_size_t) args[0], count = (avm_size_t) args[2];
+  avm_int value = args[1];
+  avm_size_t mask = AVM_PAGE_WORDS - 1;
 
-/* push(pop() | pop()) */
-SIMPLE_BINOP(or, a | b)
+  for (avm_size_t done = 0; done < count; ) {
+    avm_size_t loc = to + done;
+    avm_size_t run = AVM_PAGE_WORDS - (loc & mask);
+    if (run > count - done) {
+      run = count - done;
+    }
+    done += run;
+
+    if (loc < data_start(ctx)) {
+      for (avm_size_t i = 0; i < run; ++i) {
+        if (avm_heap_set(ctx, value, loc + i)) {
+          return 1;
+        }
+      }
+    } else if (value == 0 && run == AVM_PAGE_WORDS) {
+      if (avm__page_clear(ctx, loc)) {
+        return 1;
+      }
+    } else if (value != 0 || !avm__page_is_zero(ctx, loc)) {
+      avm_int *page = avm__page_write(ctx, loc);
+      if (page == NULL) {
+        return 1;
+      }
+      fill_words(page + (loc & mask), value, run);
+    }
+  }
+  return 0;
+}
 
-/* push(pop() ^ pop()) */
-SIMPLE_BINOP(xor, a ^ b)
+#ifdef AVM_DEBUG
+#include "avm_debug.c"
+#endif
 
-/* push(pop() >> pop()), rhs > 63 is defined as 0 */
-SIMPLE_BINOP(shr, a >> (b & 0x3F))
+#ifdef AVM_DEBUG
+#define DEBUG_BEFORE() { ctx->ins = pc; dump_ins(ctx); }
+#define DEBUG_AFTER() { SYNC_STACK(); dump_stack(ctx); }
+#else
+#define DEBUG_BEFORE()
+#define DEBUG_AFTER()
+#endif
 
-/* push(pop() << pop()), rhs > 63 is defined as 0 */
-SIMPLE_BINOP(shl, a << (b & 0x3F))
+#if AVM_THREADED
+#define TARGET(NAME) case avm_opc_ ## NAME: op_ ## NAME
+#define DTARGET(NAME) case avm_dop_ ## NAME: op_ ## NAME
+#define DISPATCH() { DEBUG_AFTER(); DEBUG_BEFORE(); goto *dispatch[d->op]; }
+#else
+#define TARGET(NAME) case avm_opc_ ## NAME
+#define DTARGET(NAME) case avm_dop_ ## NAME
+#define DISPATCH() { DEBUG_AFTER(); goto dispatch; }
+#endif
 
-// *INDENT-ON*
+/* Checked handlers carry on into their unchecked versions */
+#if defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 7)
+#define FALLTHROUGH __attribute__((fallthrough))
+#else
+#define FALLTHROUGH
+#endif
 
-/* call(0xF00BA4) */
-static int eval_calli ( const AVM_Operation op, AVM_Context *ctx )
-{
-  avm_size_t caller = ctx->ins;
-  ctx->ins = op.address;
-  ctx->ins -= 1;  // exec() increments it 1 later, compensate
-  // Underflow is OK - it will overflow back immediately
-  return push_call(ctx, (AVM_Stack_Frame) { .target = op.address,
-      .caller = caller });
+/* Falls through to the instruction `N` words further along */
+#define NEXT(N) { pc += (N); d += (N); DISPATCH(); }
+
+/* Blocks run by another engine are handed to it when jumped to */
+#define ENGINE_CHECK() { if (d->flags & AVM_DEC_ENGINE) { goto engine; } }
+
+/* Every transfer of control uses up a step of the budget, and stops the
+ * evaluation before the target runs once there's none left
+ */
+#define CHARGE() { if (budget-- == 0) { goto exhausted; } }
+
+/* Transfers control to `TARGET`, anything beyond the decoded table is
+ * decoded on the fly by the resync handler
+ */
+#define JUMP(TARGET) { \
+  pc = (TARGET); \
+  CHARGE(); \
+  d = pc < ctx->code_size ? ctx->code + pc : &resync; \
+  ENGINE_CHECK(); \
+  DISPATCH(); \
 }
 
-/* call(pop()) */
-static int eval_call ( const AVM_Operation op, AVM_Context *ctx )
-{
-  avm_int target;
-  avm_size_t caller = ctx->ins;
-  if (avm_stack_pop(ctx, &target)) { return 1; }
-  ctx->ins = (avm_size_t) target;
-  ctx->ins -= 1;  // see eval_calli
-  return push_call(ctx, (AVM_Stack_Frame) { .target = (avm_size_t) target,
-      .caller = caller });
+/* Like JUMP, for targets avm_verify couldn't know about. Landing anywhere
+ * but in verified code with at least the proven stack depth drops the
+ * proofs.
+ */
+#define ENTER(TARGET) { \
+  pc = (TARGET); \
+  CHARGE(); \
+  LAND(); \
 }
 
-static int eval_ret ( const AVM_Operation op, AVM_Context *ctx )
-{
-  if (ctx->call_stack_size == 0) {
-    return avm__error(ctx, "Unable to return with no functions in the call stack");
-  }
+#define LAND() { \
+  d = pc < ctx->code_size ? ctx->code + pc : &resync; \
+  CHECK_PROOF(); \
+  ENGINE_CHECK(); \
+  DISPATCH(); \
+}
 
-  ctx->ins = ctx->call_stack[ctx->call_stack_size - 1].caller;
-  ctx->call_stack_size -= 1;
+#define CHECK_PROOF() { \
+  if (ctx->proven && (!(d->flags & AVM_DEC_VERIFIED) || \
+                      sp + 1 - base < d->lo)) { \
+    avm__unverify(ctx); \
+    REBASE(); \
+  } \
+}
 
-  return 0;
+/* Points `d` back into `ctx->code`, which contexts sharing the code of an
+ * AVM_Program swap for another table instead of changing it
+ */
+#define REBASE() { \
+  if (pc < ctx->code_size) { \
+    d = ctx->code + pc; \
+  } \
 }
 
-/* if(pop() == 0) goto 0xF00BA4 */
-static int eval_jmpez ( const AVM_Operation op, AVM_Context *ctx )
-{
-  avm_int test;
-  if (avm_stack_pop(ctx, &test)) { return 1; }
-  if (test == 0) {
-    ctx->ins = op.address;
-    ctx->ins -= 1;  // see eval_calli
-  }
-  return 0;
+/* The top of the operand stack is cached in `tos`, and `sp` points at the
+ * slot it belongs in, so the rest of the stack lives in `base[0]` up to
+ * `sp[-1]`. With an empty stack `sp` is `base - 1`, a spare slot that
+ * pushes can spill into without checking for it.
+ */
+#define SYNC_STACK() { \
+  *sp = tos; \
+  ctx->stack_size = (avm_size_t) (sp + 1 - base); \
 }
 
-static int eval_dup ( const AVM_Operation op, AVM_Context *ctx )
-{
-  avm_int value;
-  if (avm_stack_pop(ctx, &value)) { return 1; }
-  if (avm_stack_push(ctx, value)) { return 1; }
-  if (avm_stack_push(ctx, value)) { return 1; }
-  return 0;
+#define LOAD_STACK() { \
+  base = ctx->stack; \
+  sp = base + ctx->stack_size - 1; \
+  tos = *sp; \
+  limit = base + ctx->stack_cap - 2; \
 }
 
-static const Evaluator opcode_evalutators[opcode_count] = {
-  [avm_opc_error] = &eval_error,
-  [avm_opc_load ] = &eval_load,
-  [avm_opc_store] = &eval_store,
-  [avm_opc_push ] = &eval_push,
-  [avm_opc_add  ] = &eval_add,
-  [avm_opc_sub  ] = &eval_sub,
-  [avm_opc_and  ] = &eval_and,
-  [avm_opc_mul  ] = &eval_mul,
-  [avm_opc_div  ] = &eval_div,
-  [avm_opc_or   ] = &eval_or,
-  [avm_opc_xor  ] = &eval_xor,
-  [avm_opc_shr  ] = &eval_shr,
-  [avm_opc_shl  ] = &eval_shl,
-  [avm_opc_calli] = &eval_calli,
-  [avm_opc_call ] = &eval_call,
-  [avm_opc_ret  ] = &eval_ret,
-  [avm_opc_jmpez] = &eval_jmpez,
-  [avm_opc_dup  ] = &eval_dup,
-};
+/* Fails with an underrun unless the stack holds at least N items. Popping
+ * one item at a time would have emptied the stack before failing, so the
+ * stack is left empty as well.
+ */
+#define NEED(N) { \
+  if (sp < base + (N) - 1) { goto underrun; } \
+}
 
-#ifdef AVM_DEBUG
-#include "avm_debug.c"
+#define DROP() { tos = *--sp; }
+
+/* A guarded stack faults on overflow, otherwise avm_stack_push is called to
+ * grow it once the capacity runs out.
+ */
+#ifdef AVM_STACK_GUARD
+#define PUSH(VAL) { \
+  avm_int pushed_ = (VAL); \
+  *sp++ = tos; \
+  tos = pushed_; \
+}
+#else
+#define PUSH(VAL) { \
+  avm_int pushed_ = (VAL); \
+  if (sp >= limit) { \
+    SYNC_STACK(); \
+    if (avm_stack_push(ctx, pushed_)) goto fail; \
+    LOAD_STACK(); \
+  } else { \
+    *sp++ = tos; \
+    tos = pushed_; \
+  } \
+}
 #endif
 
-int avm_eval(AVM_Context *ctx, avm_int *result)
-{
-  assert(ctx != NULL);
-  assert(result != NULL);
+/* Fused pairs push an item and pop it again, or jump, without holding it.
+ * The stack still has to have room for it, to fail where the push of the
+ * pair on its own would.
+ */
+#ifdef AVM_STACK_GUARD
+#define ROOM() { *sp = tos; }
+#else
+#define ROOM() { \
+  if (sp >= limit) { \
+    SYNC_STACK(); \
+    if (avm__stack_grow(ctx)) goto fail; \
+    LOAD_STACK(); \
+  } \
+}
+#endif
 
-  while (1) {
-    AVM_Operation op;
-    avm_heap_get(ctx, (avm_int *) &op, ctx->ins);
-#ifdef AVM_DEBUG
-    dump_ins(ctx);
+/* Records the instruction at `pc`, counts the fused pairs that run and
+ * profiles, whichever is on. Stale and resync operations only find the
+ * instruction to run, and aren't recorded. A fused pair then runs as its
+ * first instruction alone, so that the second is recorded on its own.
+ */
+#define INSTRUMENT() { \
+  if (ctx->trace != NULL) { \
+    avm__trace_record(ctx, pc, tos, (avm_size_t) (sp + 1 - base)); \
+  } \
+  if (ctx->count_fusions) { \
+    avm__count_fusion(ctx, d->op); \
+  } \
+  if (ctx->profile != NULL && \
+      avm__profile_step(ctx, d, pc, tos, (avm_size_t) (sp + 1 - base))) { \
+    goto fail; \
+  } \
+}
+
+/* Every operation that pops has an unchecked variant after its checked
+ * one, for verified code.
+ */
+#define BINOP(NAME, EXPR) \
+  TARGET(NAME): \
+    NEED(2); FALLTHROUGH; \
+  DTARGET(NAME ## _nc): { \
+    avm_int a = sp[-1], b = tos; \
+    sp -= 1; \
+    tos = (EXPR); \
+    NEXT(1); \
+  }
+
+static int eval_loop(AVM_Context *ctx, avm_int *result, uint64_t budget)
+{
+#if AVM_THREADED
+  static const void *const dispatch_table[256] = {
+    [0 ... 255] = &&op_error,
+    [avm_opc_load ] = &&op_load,
+    [avm_opc_store] = &&op_store,
+    [avm_opc_push ] = &&op_push,
+    [avm_opc_add  ] = &&op_add,
+    [avm_opc_sub  ] = &&op_sub,
+    [avm_opc_mul  ] = &&op_mul,
+    [avm_opc_div  ] = &&op_div,
+    [avm_opc_and  ] = &&op_and,
+    [avm_opc_or   ] = &&op_or,
+    [avm_opc_xor  ] = &&op_xor,
+    [avm_opc_shr  ] = &&op_shr,
+    [avm_opc_shl  ] = &&op_shl,
+    [avm_opc_calli] = &&op_calli,
+    [avm_opc_call ] = &&op_call,
+    [avm_opc_ret  ] = &&op_ret,
+    [avm_opc_jmpez] = &&op_jmpez,
+    [avm_opc_quit ] = &&op_quit,
+    [avm_opc_dup  ] = &&op_dup,
+    [avm_opc_copy ] = &&op_copy,
+    [avm_opc_fill ] = &&op_fill,
+    [avm_opc_vadd ] = &&op_vadd,
+    [avm_opc_vsub ] = &&op_vsub,
+    [avm_opc_vmul ] = &&op_vmul,
+    [avm_opc_vand ] = &&op_vand,
+    [avm_opc_vor  ] = &&op_vor,
+    [avm_opc_vxor ] = &&op_vxor,
+    [avm_opc_vshr ] = &&op_vshr,
+    [avm_opc_vshl ] = &&op_vshl,
+    [avm_dop_stale] = &&op_stale,
+    [avm_dop_resync] = &&op_resync,
+    [avm_dop_add_nc] = &&op_add_nc,
+    [avm_dop_sub_nc] = &&op_sub_nc,
+    [avm_dop_mul_nc] = &&op_mul_nc,
+    [avm_dop_div_nc] = &&op_div_nc,
+    [avm_dop_and_nc] = &&op_and_nc,
+    [avm_dop_or_nc ] = &&op_or_nc,
+    [avm_dop_xor_nc] = &&op_xor_nc,
+    [avm_dop_shr_nc] = &&op_shr_nc,
+    [avm_dop_shl_nc] = &&op_shl_nc,
+    [avm_dop_call_nc] = &&op_call_nc,
+    [avm_dop_jmpez_nc] = &&op_jmpez_nc,
+    [avm_dop_quit_nc] = &&op_quit_nc,
+    [avm_dop_dup_nc] = &&op_dup_nc,
+    [avm_dop_push_add] = &&op_push_add,
+    [avm_dop_push_add_nc] = &&op_push_add_nc,
+    [avm_dop_push_sub] = &&op_push_sub,
+    [avm_dop_push_sub_nc] = &&op_push_sub_nc,
+    [avm_dop_dup_jmpez] = &&op_dup_jmpez,
+    [avm_dop_dup_jmpez_nc] = &&op_dup_jmpez_nc,
+    [avm_dop_jump] = &&op_jump,
+    [avm_dop_push_call] = &&op_push_call,
+  };
+  // the same, but tracing, counting or profiling every operation before it
+  // runs
+  static const void *const instrumented_table[256] = {
+    [0 ... 255] = &&op_instrument,
+    [avm_dop_stale] = &&op_stale,
+    [avm_dop_resync] = &&op_resync,
+  };
+  const void *const *dispatch = ctx->trace != NULL || ctx->count_fusions ||
+                                ctx->profile != NULL ?
+                                instrumented_table : dispatch_table;
+#else
+  const int instrumented = ctx->trace != NULL || ctx->count_fusions ||
+                           ctx->profile != NULL;
 #endif
 
-    if (op.kind == avm_opc_quit) {
-      return avm_stack_pop(ctx, result);
-    }
+  static const AVM_Decoded resync = { .op = avm_dop_resync };
+
+  /* Instructions outside of `ctx->code` are decoded into window[0], the
+   * entries after it bring execution back to the table when possible.
+   */
+  AVM_Decoded window[1 + AVM_DECODE_SPAN];
+  for (int i = 0; i < 1 + AVM_DECODE_SPAN; ++i) {
+    window[i] = resync;
+  }
 
-    if (op.kind >= opcode_count) {
-      op.kind = avm_opc_error;
+  avm_int *base, *sp, *limit, tos;
+  LOAD_STACK();
+  (void) limit;
+
+  // carrying on where the last evaluation stopped isn't a transfer
+  avm_size_t pc = ctx->ins;
+  const AVM_Decoded *d;
+  // the operation run, `d->op` unless instrumented
+  uint8_t op = avm_dop_resync;
+  LAND();
+
+#if AVM_THREADED
+op_instrument:
+  INSTRUMENT();
+  op = avm__unfuse(d->op);
+  goto *dispatch_table[op];
+#else
+dispatch:
+  op = d->op;
+  if (instrumented && op != avm_dop_stale && op != avm_dop_resync) {
+    INSTRUMENT();
+    op = avm__unfuse(op);
+  }
+#endif
+  DEBUG_BEFORE();
+  switch (op) {
+    // *INDENT-OFF*
+
+    /* push(pop() + pop()) */
+    BINOP(add, a + b)
+
+    /* push(pop() - pop()) */
+    BINOP(sub, a - b)
+
+    /* push(pop() * pop()) */
+    BINOP(mul, a * b)
+
+    /* push(pop() / pop()), n/0 = n */
+    BINOP(div, a / (b + (b == 0)))
+
+    /* push(pop() & pop()) */
+    BINOP(and, a & b)
+
+    /* push(pop() | pop()) */
+    BINOP(or, a | b)
+
+    /* push(pop() ^ pop()) */
+    BINOP(xor, a ^ b)
+
+    /* push(pop() >> pop()), rhs > 63 is defined as 0 */
+    BINOP(shr, a >> (b & 0x3F))
+
+    /* push(pop() << pop()), rhs > 63 is defined as 0 */
+    BINOP(shl, a << (b & 0x3F))
+
+    // *INDENT-ON*
+
+    /* Places the immediate value at the top of the stack */
+    TARGET(push):
+      PUSH(d->imm);
+      NEXT(2);
+
+    TARGET(dup):
+      NEED(1);
+      FALLTHROUGH;
+    DTARGET(dup_nc):
+      PUSH(tos);
+      NEXT(1);
+
+    TARGET(load):
+      SYNC_STACK();
+      if (avm__eval_load(d, ctx)) { goto fail_synced; }
+      LOAD_STACK();
+      NEXT(1);
+
+    TARGET(store):
+      SYNC_STACK();
+      if (avm__eval_store(d, ctx)) { goto fail_synced; }
+      LOAD_STACK();
+      REBASE();
+      NEXT(1);
+
+    TARGET(copy):
+      SYNC_STACK();
+      if (avm__eval_copy(ctx)) { goto fail_synced; }
+      LOAD_STACK();
+      REBASE();
+      NEXT(1);
+
+    TARGET(fill):
+      SYNC_STACK();
+      if (avm__eval_fill(ctx)) { goto fail_synced; }
+      LOAD_STACK();
+      REBASE();
+      NEXT(1);
+
+    /* Lane by lane over the two groups of `size` words on top, see
+     * avm_vector.c
+     */
+    TARGET(vadd):
+    TARGET(vsub):
+    TARGET(vmul):
+    TARGET(vand):
+    TARGET(vor):
+    TARGET(vxor):
+    TARGET(vshr):
+    TARGET(vshl):
+      SYNC_STACK();
+      if (avm__eval_vector(d, ctx)) { goto fail_synced; }
+      LOAD_STACK();
+      NEXT(1);
+
+    /* call(0xF00BA4) */
+    TARGET(calli):
+      if (avm__push_call(ctx, (AVM_Stack_Frame) { .target = d->arg,
+      .caller = pc })) {
+        goto fail;
+      }
+      JUMP(d->arg);
+
+    /* call(pop()) */
+    TARGET(call):
+      NEED(1);
+      FALLTHROUGH;
+    DTARGET(call_nc): {
+      avm_int target = tos;
+      DROP();
+      if (avm__push_call(ctx, (AVM_Stack_Frame) { .target = (avm_size_t) target,
+      .caller = pc })) {
+        goto fail;
+      }
+      ENTER((avm_size_t) target);
     }
 
-    if (opcode_evalutators[op.kind](op, ctx)) {
-      return 1;
+    TARGET(ret):
+      if (ctx->call_stack_size == 0) {
+        avm__error(ctx, "Unable to return with no functions in the call stack");
+        goto fail;
+      }
+
+      ctx->call_stack_size -= 1;
+      ENTER(ctx->call_stack[ctx->call_stack_size].caller + 1);
+
+    /* if(pop() == 0) goto 0xF00BA4 */
+    TARGET(jmpez):
+      NEED(1);
+      FALLTHROUGH;
+    DTARGET(jmpez_nc): {
+      avm_int test = tos;
+      DROP();
+      if (test == 0) {
+        JUMP(d->arg);
+      }
+      NEXT(1);
     }
 
-#ifdef AVM_DEBUG
-    dump_stack(ctx);
+    TARGET(quit):
+      NEED(1);
+      FALLTHROUGH;
+    DTARGET(quit_nc):
+      *result = tos;
+      DROP();
+      SYNC_STACK();
+      ctx->ins = pc;
+      return 0;
+
+    /* Fused pairs, see avm_decode.c. A failure is reported at the
+     * instruction of the pair that raised it.
+     */
+
+    /* push K; add */
+    DTARGET(push_add):
+      if (sp < base) { pc += 2; goto underrun; }
+      FALLTHROUGH;
+    DTARGET(push_add_nc):
+      ROOM();
+      tos += d->imm;
+      NEXT(3);
+
+    /* push K; sub */
+    DTARGET(push_sub):
+      if (sp < base) { pc += 2; goto underrun; }
+      FALLTHROUGH;
+    DTARGET(push_sub_nc):
+      ROOM();
+      tos -= d->imm;
+      NEXT(3);
+
+    /* dup; jmpez 0xF00BA4, the duplicate is what gets tested */
+    DTARGET(dup_jmpez):
+      NEED(1);
+      FALLTHROUGH;
+    DTARGET(dup_jmpez_nc):
+      ROOM();
+      if (tos == 0) {
+        JUMP(d->arg);
+      }
+      NEXT(2);
+
+    /* push 0; jmpez 0xF00BA4 */
+    DTARGET(jump):
+      ROOM();
+      JUMP(d->arg);
+
+    /* push 0xF00BA4; call */
+    DTARGET(push_call):
+      ROOM();
+      if (avm__push_call(ctx, (AVM_Stack_Frame) { .target = (avm_size_t) d->imm,
+      .caller = pc + 2 })) {
+        pc += 2;
+        goto fail;
+      }
+      ENTER((avm_size_t) d->imm);
+
+    /* The memory under this instruction was written to since it was
+     * decoded.
+     */
+    DTARGET(stale):
+      avm__decode(ctx, pc, (AVM_Decoded *) d);
+      DISPATCH();
+
+    DTARGET(resync):
+      if (ctx->proven) {
+        // nothing stops this code from falling back into verified code
+        avm__unverify(ctx);
+      }
+
+      if (pc < ctx->code_size) {
+        d = ctx->code + pc;
+      } else {
+        avm__decode(ctx, pc, &window[0]);
+        d = window;
+      }
+      DISPATCH();
+
+    TARGET(error):
+    default:
+      eval_error(d, ctx);
+      goto fail;
+  }
+
+engine: {
+  SYNC_STACK();
+  ctx->budget = budget;
+#ifdef AVM_JIT
+  int status = ctx->jit != NULL ? avm__jit_run(ctx, &pc) : avm__ir_run(ctx, &pc);
+#else
+  int status = avm__ir_run(ctx, &pc);
 #endif
+  budget = ctx->budget;
+  if (status == AVM_RUN_ERROR) {
+    goto fail_synced;
+  }
+  LOAD_STACK();
+  if (status == AVM_RUN_BUDGET) {
+    goto exhausted;
+  }
+  // the engine may have taken paths avm_verify didn't know about
+  d = pc < ctx->code_size ? ctx->code + pc : &resync;
+  CHECK_PROOF();
+  if (status == AVM_RUN_EXITED) {
+    ENGINE_CHECK();
+  }
+  DISPATCH();
+}
 
-    ctx->ins += 1;
+exhausted:
+  // the stacks and `ins` are all a later evaluation needs to carry on
+  SYNC_STACK();
+  ctx->ins = pc;
+  return AVM_EVAL_BUDGET;
+
+underrun:
+  sp = base - 1;
+  avm__error(ctx, "unable to pop item off stack: stack underrun");
+fail:
+  SYNC_STACK();
+fail_synced:
+  ctx->ins = pc;
+  return 1;
+}
+
+/* Runs eval_loop with `budget` steps, recovering from stack overflows */
+static int eval_guarded(AVM_Context *ctx, avm_int *result, uint64_t budget)
+{
+  assert(ctx != NULL);
+  assert(result != NULL);
+
+#ifdef AVM_STACK_GUARD
+  AVM_Guard guard;
+  if (sigsetjmp(guard.env, 0)) {
+    // pushed into the guard page, the registers of eval_loop are lost
+    avm__guard_leave(&guard);
+    ctx->stack_size = ctx->stack_cap - 1;
+    return avm__stack_overflow(ctx);
   }
+
+  avm__guard_enter(ctx, &guard);
+  int retcode = eval_loop(ctx, result, budget);
+  avm__guard_leave(&guard);
+  return retcode;
+#else
+  return eval_loop(ctx, result, budget);
+#endif
+}
+
+int avm_eval(AVM_Context *ctx, avm_int *result)
+{
+  // more steps than there's time to take
+  return eval_guarded(ctx, result, UINT64_MAX);
+}
+
+int avm_eval_steps(AVM_Context *ctx, uint64_t max_steps, avm_int *result)
+{
+  return eval_guarded(ctx, result, max_steps);
 }
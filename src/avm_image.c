@@ -0,0 +1,176 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "avm.h"
+#include "avm_util.h"
+#include "avm_def.h"
+
+/* A precompiled image is a header followed by the code words, as avm_parse
+ * produced them, in the byte order of the machine that compiled it:
+ *
+ *     magic "AVMI", version, entry point, memory size, word count, checksum
+ *     word_count code words
+ *
+ * avm_init_from_image maps the file and uses the full pages of code words
+ * as guest memory directly, until they are written to. Only the last,
+ * partial page is copied.
+ */
+
+#define IMAGE_MAGIC   "AVMI"
+#define IMAGE_VERSION 1
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  avm_size_t entry;
+  avm_size_t memory_size;  /* words decoded, the program and its slack */
+  uint64_t word_count;
+  uint64_t checksum;       /* FNV-1a over the code words */
+} Image_Header;
+
+_Static_assert(sizeof(Image_Header) % sizeof(avm_int) == 0,
+               "code words must stay aligned after the header");
+
+static uint64_t checksum(const avm_int *words, size_t count)
+{
+  uint64_t hash = 0xcbf29ce484222325u;
+  for (size_t i = 0; i < count; ++i) {
+    hash = (hash ^ words[i]) * 0x100000001b3u;
+  }
+  return hash;
+}
+
+int avm_image_write(const char *path, const avm_int *code, size_t len,
+                    avm_size_t entry, avm_size_t memory_size, char **error)
+{
+  *error = NULL;
+  if (memory_size == 0 && len < AVM_SIZE_MAX / 2) {
+    memory_size = (avm_size_t) len + AVM_CODE_SLACK;
+  }
+  if (memory_size < len || memory_size >= AVM_SIZE_MAX / 2) {
+    *error = afmt("%zu code words don't fit the memory size %u", len,
+                  memory_size);
+    return 1;
+  }
+
+  Image_Header header = {
+    .magic = IMAGE_MAGIC,
+    .version = IMAGE_VERSION,
+    .entry = entry,
+    .memory_size = memory_size,
+    .word_count = len,
+    .checksum = checksum(code, len),
+  };
+
+  FILE *out = fopen(path, "wb");
+  if (out == NULL) {
+    *error = afmt("unable to open %s", path);
+    return 1;
+  }
+
+  int failed = fwrite(&header, sizeof(header), 1, out) != 1 ||
+               fwrite(code, sizeof(avm_int), len, out) != len;
+  failed |= fclose(out) != 0;
+  if (failed) {
+    *error = afmt("unable to write %s", path);
+    return 1;
+  }
+  return 0;
+}
+
+int avm_is_image(const char *data, size_t len)
+{
+  return len >= sizeof(IMAGE_MAGIC) - 1 &&
+         memcmp(data, IMAGE_MAGIC, sizeof(IMAGE_MAGIC) - 1) == 0;
+}
+
+/* Checks the header and the code words against it */
+static int check_image(AVM_Context *ctx, const char *path, const void *map,
+                       size_t len)
+{
+  const Image_Header *header = map;
+
+  if (len < sizeof(Image_Header)) {
+    return avm__error(ctx, "%s is too short to be an image", path);
+  }
+  if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0) {
+    return avm__error(ctx, "%s is not an image", path);
+  }
+  if (header->version != IMAGE_VERSION) {
+    return avm__error(ctx, "%s has unsupported image version %u", path,
+                      header->version);
+  }
+  if (header->word_count > (len - sizeof(Image_Header)) / sizeof(avm_int)) {
+    return avm__error(ctx, "%s is truncated", path);
+  }
+  if (header->word_count > header->memory_size ||
+      header->memory_size >= AVM_SIZE_MAX / 2) {
+    return avm__error(ctx, "%s declares an invalid memory size", path);
+  }
+
+  const avm_int *words = (const avm_int *) (header + 1);
+  if (checksum(words, (size_t) header->word_count) != header->checksum) {
+    return avm__error(ctx, "%s has a bad checksum", path);
+  }
+  return 0;
+}
+
+int avm_init_from_image(AVM_Context *ctx, const char *path)
+{
+  *ctx = (AVM_Context) { .error = NULL };
+  if (avm__memory_init(ctx)) {
+    return 1;
+  }
+
+  size_t len = 0;
+  const char *map = map_file(path, &len);
+  if (map == NULL) {
+    return avm__error(ctx, "unable to map image %s", path);
+  }
+  if (check_image(ctx, path, map, len)) {
+    unmap_file(map, len);
+    return 1;
+  }
+
+  const Image_Header *header = (const Image_Header *) map;
+  size_t count = (size_t) header->word_count;
+  size_t full = count / AVM_PAGE_WORDS * AVM_PAGE_WORDS;
+
+  AVM_Image *image = my_malloc(sizeof(AVM_Image));
+  if (image == NULL) {
+    unmap_file(map, len);
+    return avm__error(ctx, "unable to allocate image");
+  }
+  *image = (AVM_Image) {
+    .refs = 1,
+    .words = (const avm_int *) (header + 1),
+    .end = (const avm_int *) (header + 1) + full,
+    .map = map,
+    .map_len = len,
+  };
+
+  if (avm__memory_map(ctx, image)) {
+    return 1;
+  }
+
+  // the rest of the last page would read past the end of the file
+  if (full < count) {
+    avm_int *page = avm__page_write(ctx, (avm_size_t) full);
+    if (page == NULL) {
+      return 1;
+    }
+    memcpy(page, image->words + full, (count - full) * sizeof(avm_int));
+  }
+
+  return avm__init_state(ctx, header->memory_size, header->entry);
+}
+
+void avm__image_release(AVM_Image *image)
+{
+  if (image != NULL &&
+      __atomic_sub_fetch(&image->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    unmap_file(image->map, image->map_len);
+    free(image);
+  }
+}
@@ -0,0 +1,978 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "avm.h"
+#include "avm_util.h"
+#include "avm_def.h"
+
+/* The register engine translates each basic block found by avm_verify into
+ * three address code over virtual registers the first time it's entered,
+ * and runs that instead of the stack code.
+ *
+ * Within a block `push`, `dup` and arithmetic only move values between
+ * registers, constants are folded and chains of the same operation with
+ * constants are combined. Single words are loaded into and stored from
+ * registers, and the operand stack is only written at the end of the
+ * block and before other memory and vector operations and calls. Like in
+ * avm_jit.c, a block checks up front that the stack holds everything it
+ * pops and has room for what it pushes. `calli` and `ret` stay in the
+ * engine, `quit` and `call` with a runtime target go back to the
+ * interpreter, and a block goes straight on into the blocks it falls or
+ * jumps to, through blocks that do nothing but jump on. Writing over a
+ * block drops its translation for good.
+ *
+ * Registers live in memory, so every operation producing a value also
+ * leaves it in an accumulator that the next operation can read instead,
+ * which keeps the chains of dependent operations stack code is made of
+ * out of memory.
+ */
+
+#define MAX_REGS  255   /* virtual registers before writing the stack back */
+#define MAX_ITEMS 64    /* stack items kept in registers */
+#define MAX_DEPTH_DIFF 4096
+#define MAX_HOPS  8     /* blocks that only jump on, followed at a time */
+#define MAX_TAKEN 8     /* blocks one translation runs through */
+
+/* Binary operations, in the order of their opcodes from avm_opc_add */
+enum { K_add, K_sub, K_mul, K_div, K_and, K_or, K_xor, K_shr, K_shl, BINOPS };
+
+/* IR operations. Binary operations come in one of each form for every
+ * kind, `IR_RK + K_mul` is `dst = a * imm`. Everything that sets `dst` also
+ * sets `acc`.
+ */
+enum {
+  IR_RR = 0,            /* dst = a OP b */
+  IR_RK = BINOPS,       /* dst = a OP imm */
+  IR_AR = BINOPS * 2,   /* dst = acc OP b */
+  IR_AK = BINOPS * 3,   /* dst = acc OP imm */
+  IR_RA = BINOPS * 4,   /* dst = a OP acc */
+  IR_SK = BINOPS * 5,   /* dst = sp[off] OP imm */
+  IR_CONST = BINOPS * 6,  /* dst = imm */
+  IR_PEEK,    /* dst = sp[off] */
+  IR_PUT,     /* sp[off] = a */
+  IR_PUTA,    /* sp[off] = acc */
+  IR_PUTK,    /* sp[off] = imm */
+  IR_ADJ,     /* sp += off */
+  IR_LOAD,    /* dst = the word at `address` */
+  IR_STORE,   /* the word at `address` = a, see translate_store */
+  IR_STOREA,  /* the word at `address` = acc */
+  IR_HELPER,  /* run the memory or vector operation at `pc` out of line */
+  IR_CALL,    /* push a call frame from `pc` to `imm` */
+  IR_RET,     /* return to the caller, from `pc` */
+  IR_BRZ,     /* if a == 0, exit to `pc` */
+  IR_BRZA,    /* if acc == 0, exit to `pc` */
+  IR_EXIT,    /* exit to `pc`, taking a step of the budget if `b` is set */
+              /* exits with `dst` set loop back with the stack as on entry */
+  IR_BAIL,    /* leave the instruction at `pc` to the interpreter */
+};
+
+typedef struct {
+  uint8_t op;
+  uint8_t dst;
+  uint8_t a;
+  uint8_t b;
+  union {
+    int32_t off;      /* stack slot relative to `sp` */
+    avm_size_t pc;
+    avm_size_t address;
+  };
+  avm_int imm;        /* for exits, the block at `pc` plus one, or 0 */
+} Ir_Op;
+
+enum { BLOCK_COLD, BLOCK_READY, BLOCK_DROPPED };
+
+typedef struct {
+  uint8_t state;
+  uint8_t threaded;   /* taken into or jumped through by other blocks */
+  avm_size_t need;    /* items the block pops, AVM_SIZE_MAX unless ready */
+  avm_size_t grow;    /* items it pushes, at most */
+  Ir_Op *ops;
+} Ir_Block;
+
+struct AVM_Ir_s {
+  Ir_Block *blocks;
+  unsigned epoch;     /* bumped whenever a block is dropped */
+};
+
+/* A stack item the translation hasn't written back yet */
+typedef struct {
+  int is_const;
+  int peeked;         /* still as it is in `slot` */
+  int32_t slot;
+  uint8_t reg;
+  avm_int value;
+} Item;
+
+/* Operations as they're emitted */
+typedef struct {
+  Ir_Op *ops;
+  size_t len;
+  size_t cap;
+} Ops;
+
+typedef struct {
+  AVM_Context *ctx;
+  avm_size_t start;   /* of the block */
+  avm_size_t taken[MAX_TAKEN];  /* starts of the blocks translated */
+  size_t taken_count;
+  Ops code;
+  Ops stubs;          /* write the stack back when a store fails */
+  Item items[MAX_ITEMS];
+  size_t count;
+  int32_t consumed;   /* slots popped below `sp` */
+  unsigned regs;      /* registers in use */
+  int acc;            /* register `acc` holds, or -1 */
+  int64_t depth;
+  int64_t lowest;
+  int64_t highest;
+} Translation;
+
+static int append(Ops *out, Ir_Op op)
+{
+  if (out->len == out->cap) {
+    size_t cap = out->cap > 0 ? out->cap * 2 : 16;
+    Ir_Op *ops = my_realloc(out->ops, cap * sizeof(Ir_Op));
+    if (ops == NULL) {
+      return 1;
+    }
+    out->ops = ops;
+    out->cap = cap;
+  }
+  out->ops[out->len++] = op;
+  return 0;
+}
+
+static int emit(Translation *t, Ir_Op op)
+{
+  return append(&t->code, op);
+}
+
+/* Emits an operation setting `dst`, and with it `acc` */
+static int emit_value(Translation *t, Ir_Op op)
+{
+  t->acc = op.dst;
+  return emit(t, op);
+}
+
+/* Emits the operations writing every item back to the stack to `out` */
+static int spill(Translation *t, Ops *out)
+{
+  for (size_t i = 0; i < t->count; ++i) {
+    Item item = t->items[i];
+    Ir_Op op = {
+      .op = item.is_const ? IR_PUTK : item.reg == t->acc ? IR_PUTA : IR_PUT,
+      .a = item.reg,
+      .off = (int32_t) i - t->consumed,
+      .imm = item.value,
+    };
+    // its slot is only written along with the items, so it still holds it
+    if (item.peeked && item.slot == op.off) {
+      continue;
+    }
+    if (append(out, op)) {
+      return 1;
+    }
+  }
+
+  int32_t moved = (int32_t) t->count - t->consumed;
+  return moved != 0 && append(out, (Ir_Op) { .op = IR_ADJ, .off = moved });
+}
+
+/* Writes every item back to the stack, freeing all registers */
+static int write_back(Translation *t)
+{
+  if (spill(t, &t->code)) {
+    return 1;
+  }
+
+  t->count = 0;
+  t->consumed = 0;
+  t->regs = 0;
+  t->acc = -1;
+  return 0;
+}
+
+/* Makes sure `n` more registers can be taken */
+static int reserve(Translation *t, unsigned n)
+{
+  return t->regs + n > MAX_REGS ? write_back(t) : 0;
+}
+
+static int push_item(Translation *t, Item item)
+{
+  if (t->count == MAX_ITEMS) {
+    // the new item isn't on the list yet, so its value survives this
+    int in_acc = !item.is_const && item.reg == t->acc;
+    if (write_back(t)) {
+      return 1;
+    }
+    if (!item.is_const) {
+      if (emit_value(t, (Ir_Op) { .op = in_acc ? IR_AK + K_add :
+                                        IR_RK + K_add, .a = item.reg })) {
+        return 1;
+      }
+      item.reg = 0;
+      item.peeked = 0;
+      t->regs = 1;
+    }
+  }
+  t->items[t->count++] = item;
+  return 0;
+}
+
+/* Pops an item, reading it off the stack into a register if needed */
+static int pop_item(Translation *t, Item *out)
+{
+  if (t->count > 0) {
+    *out = t->items[--t->count];
+    return 0;
+  }
+
+  t->consumed += 1;
+  *out = (Item) { .reg = (uint8_t) t->regs++, .peeked = 1,
+                  .slot = -t->consumed };
+  return emit_value(t, (Ir_Op) { .op = IR_PEEK, .dst = out->reg,
+                                 .off = -t->consumed });
+}
+
+static void track(Translation *t, int64_t pops, int64_t pushes)
+{
+  t->depth -= pops;
+  if (t->depth < t->lowest) {
+    t->lowest = t->depth;
+  }
+  t->depth += pushes;
+  if (t->depth > t->highest) {
+    t->highest = t->depth;
+  }
+}
+
+static avm_int fold(int kind, avm_int a, avm_int b)
+{
+  switch (kind) {
+  case K_add: return a + b;
+  case K_sub: return a - b;
+  case K_mul: return a * b;
+  case K_div: return a / (b + (b == 0));
+  case K_and: return a & b;
+  case K_or:  return a | b;
+  case K_xor: return a ^ b;
+  case K_shr: return a >> (b & 0x3F);
+  default:    return a << (b & 0x3F);
+  }
+}
+
+static int is_item(Translation *t, uint8_t reg)
+{
+  for (size_t i = 0; i < t->count; ++i) {
+    if (!t->items[i].is_const && t->items[i].reg == reg) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Folds `a OP imm` into the operation that just computed `a` if nothing
+ * else needs `a`, making `sp[off] OP imm` of a read off the stack and
+ * `x OP c2` of `x OP c`.
+ */
+static int combine(Translation *t, int kind, uint8_t a, avm_int imm,
+                   uint8_t dst)
+{
+  int chains = kind == K_add || kind == K_mul || kind == K_and ||
+               kind == K_or || kind == K_xor;
+
+  Ir_Op *last = t->code.len > 0 ? &t->code.ops[t->code.len - 1] : NULL;
+  if (last == NULL || last->dst != a || a != t->acc || is_item(t, a)) {
+    return 0;
+  }
+
+  if (last->op == IR_PEEK) {
+    last->op = (uint8_t) (IR_SK + kind);
+    last->imm = imm;
+  } else if (chains && (last->op == IR_RK + kind || last->op == IR_AK + kind)) {
+    last->imm = fold(kind, last->imm, imm);
+  } else {
+    return 0;
+  }
+  last->dst = dst;
+  t->acc = dst;
+  return 1;
+}
+
+static int translate_binop(Translation *t, int kind)
+{
+  Item a, b;
+  track(t, 2, 1);
+  if (reserve(t, 3) || pop_item(t, &b) || pop_item(t, &a)) {
+    return 1;
+  }
+
+  if (a.is_const && b.is_const) {
+    return push_item(t, (Item) { .is_const = 1,
+                                 .value = fold(kind, a.value, b.value) });
+  }
+
+  if (a.is_const) {
+    a.reg = (uint8_t) t->regs++;
+    if (emit_value(t, (Ir_Op) { .op = IR_CONST, .dst = a.reg,
+                                .imm = a.value })) {
+      return 1;
+    }
+  }
+
+  Item result = { .reg = (uint8_t) t->regs++ };
+  if (b.is_const && kind == K_sub) {
+    // turned into an addition, so that it can be combined with others
+    kind = K_add;
+    b.value = 0 - b.value;
+  }
+  if (b.is_const && combine(t, kind, a.reg, b.value, result.reg)) {
+    return push_item(t, result);
+  }
+
+  Ir_Op ir = { .dst = result.reg, .a = a.reg, .b = b.reg, .imm = b.value };
+  if (b.is_const) {
+    ir.op = (uint8_t) ((a.reg == t->acc ? IR_AK : IR_RK) + kind);
+  } else if (a.reg == t->acc) {
+    ir.op = (uint8_t) (IR_AR + kind);
+  } else if (b.reg == t->acc) {
+    ir.op = (uint8_t) (IR_RA + kind);
+  } else {
+    ir.op = (uint8_t) (IR_RR + kind);
+  }
+  return emit_value(t, ir) || push_item(t, result);
+}
+
+static int translate_dup(Translation *t)
+{
+  Item a;
+  track(t, 1, 2);
+  return reserve(t, 1) || pop_item(t, &a) ||
+         push_item(t, a) || push_item(t, a);
+}
+
+/* Goes on translating the block at `pc`, unless it was already, setting
+ * `end` to where it ends
+ */
+static int take_in(Translation *t, avm_size_t pc, avm_size_t *end)
+{
+  AVM_Context *ctx = t->ctx;
+  int index = avm__find_block(ctx, pc, 0);
+  if (index < 0 || t->taken_count == MAX_TAKEN ||
+      ctx->ir->blocks[index].state == BLOCK_DROPPED) {
+    return 0;
+  }
+  for (size_t i = 0; i < t->taken_count; ++i) {
+    if (t->taken[i] == pc) {
+      return 0;
+    }
+  }
+
+  t->taken[t->taken_count++] = pc;
+  ctx->ir->blocks[index].threaded = 1;
+  *end = ctx->blocks[index].end;
+  return 1;
+}
+
+static int translate_load(Translation *t, avm_size_t address)
+{
+  track(t, 0, 1);
+  if (reserve(t, 1)) {
+    return 1;
+  }
+  Item item = { .reg = (uint8_t) t->regs++ };
+  return emit_value(t, (Ir_Op) { .op = IR_LOAD, .dst = item.reg,
+                                 .address = address }) ||
+         push_item(t, item);
+}
+
+/* Stores the top item from its register, dropping what was decoded from
+ * the word first if `decoded` is set. Should either fail, the store jumps
+ * `imm` ahead to a stub that puts the item back, writes the stack back and
+ * leaves the store to the interpreter.
+ */
+static int translate_store(Translation *t, avm_size_t pc, avm_size_t address,
+                           int decoded)
+{
+  Item item;
+  track(t, 1, 0);
+  if (reserve(t, 2) || pop_item(t, &item)) {
+    return 1;
+  }
+  if (item.is_const) {
+    Ir_Op value = { .op = IR_CONST, .dst = (uint8_t) t->regs++,
+                    .imm = item.value };
+    item = (Item) { .reg = value.dst };
+    if (emit_value(t, value)) {
+      return 1;
+    }
+  }
+
+  // writing the stack back leaves `acc` alone
+  int in_acc = item.reg == t->acc;
+  if (t->count == MAX_ITEMS && write_back(t)) {
+    return 1;
+  }
+  size_t stub = t->stubs.len;
+  t->items[t->count++] = item;
+  int failed = spill(t, &t->stubs) ||
+               append(&t->stubs, (Ir_Op) { .op = IR_BAIL, .pc = pc });
+  t->count -= 1;
+  return failed ||
+         emit(t, (Ir_Op) { .op = in_acc ? IR_STOREA : IR_STORE, .a = item.reg,
+                           .b = (uint8_t) decoded, .address = address,
+                           .imm = stub });
+}
+
+/* Where a jump to `pc` ends up, skipping blocks that only jump on with
+ * `push 0` and `jmpez`. Those are marked, writing over them drops every
+ * translation.
+ */
+static avm_size_t follow(Translation *t, avm_size_t pc)
+{
+  AVM_Context *ctx = t->ctx;
+  for (int hops = 0; hops < MAX_HOPS; ++hops) {
+    int index = avm__find_block(ctx, pc, 0);
+    if (index < 0 || ctx->blocks[index].end - pc != 3 ||
+        ctx->ir->blocks[index].state == BLOCK_DROPPED) {
+      break;
+    }
+
+    AVM_Operation push, jump;
+    avm_int value;
+    avm_heap_get(ctx, (avm_int *) &push, pc);
+    avm_heap_get(ctx, &value, pc + 1);
+    avm_heap_get(ctx, (avm_int *) &jump, pc + 2);
+    if (push.kind != avm_opc_push || value != 0 ||
+        jump.kind != avm_opc_jmpez) {
+      break;
+    }
+    ctx->ir->blocks[index].threaded = 1;
+    pc = jump.address;
+  }
+  return pc;
+}
+
+/* An exit to `pc`, remembering the block that starts there. Like in
+ * avm_jit.c, only going back to an earlier block takes a step of the
+ * budget.
+ */
+static int exit_to(Translation *t, int op, uint8_t reg, avm_size_t pc)
+{
+  pc = follow(t, pc);
+  int block = avm__find_block(t->ctx, pc, 0);
+  // a block that passed its checks passes them again as deep as it was
+  uint8_t loop = pc == t->start && t->depth == 0;
+  return emit(t, (Ir_Op) { .op = (uint8_t) op, .dst = loop, .a = reg,
+                           .b = pc <= t->start, .pc = pc,
+                           .imm = (avm_int) (block + 1) });
+}
+
+/* Translates block `index`, and the blocks it falls through, jumps or
+ * calls into from there on. Returns 1 if it can't be translated.
+ */
+static int translate(AVM_Context *ctx, Ir_Block *out, size_t index)
+{
+  AVM_Block *block = &ctx->blocks[index];
+  Translation t = { .ctx = ctx, .start = block->start, .taken_count = 1,
+                    .taken = { block->start }, .acc = -1 };
+  avm_size_t code_end = ctx->code_size + AVM_DECODE_SPAN - 1;
+  avm_size_t pc = block->start, end = block->end;
+  int failed = 0, done = 0;
+
+  while (!done && !failed) {
+    if (pc >= end && !take_in(&t, pc, &end)) {
+      failed = write_back(&t) || exit_to(&t, IR_EXIT, 0, pc);
+      break;
+    }
+
+    AVM_Operation op;
+    avm_heap_get(ctx, (avm_int *) &op, pc);
+    Item item;
+    int in_acc;
+
+    if (op.kind == avm_opc_load && op.size == 1) {
+      failed = translate_load(&t, op.address);
+      pc += 1;
+      continue;
+    }
+    // stores that may write over a block have to check if it was this one
+    if (op.kind == avm_opc_store && op.size == 1 &&
+        avm__find_block(ctx, op.address, 1) < 0) {
+      failed = translate_store(&t, pc, op.address, op.address < code_end);
+      pc += 1;
+      continue;
+    }
+
+    switch (op.kind) {
+    case avm_opc_push:
+      track(&t, 0, 1);
+      item = (Item) { .is_const = 1 };
+      avm_heap_get(ctx, &item.value, pc + 1);
+      failed = push_item(&t, item);
+      pc += 2;
+      break;
+    case avm_opc_add:
+    case avm_opc_sub:
+    case avm_opc_mul:
+    case avm_opc_div:
+    case avm_opc_and:
+    case avm_opc_or:
+    case avm_opc_xor:
+    case avm_opc_shr:
+    case avm_opc_shl:
+      failed = translate_binop(&t, K_add + (op.kind - avm_opc_add));
+      pc += 1;
+      break;
+    case avm_opc_dup:
+      failed = translate_dup(&t);
+      pc += 1;
+      break;
+    case avm_opc_load:
+    case avm_opc_store:
+    case avm_opc_copy:
+    case avm_opc_fill:
+    case avm_opc_vadd:
+    case avm_opc_vsub:
+    case avm_opc_vmul:
+    case avm_opc_vand:
+    case avm_opc_vor:
+    case avm_opc_vxor:
+    case avm_opc_vshr:
+    case avm_opc_vshl:
+      if (op.kind == avm_opc_load) {
+        track(&t, 0, op.size);
+      } else if (op.kind == avm_opc_store) {
+        track(&t, op.size, 0);
+      } else if (op.kind == avm_opc_copy || op.kind == avm_opc_fill) {
+        track(&t, 3, 0);
+      } else {
+        track(&t, 2 * (int64_t) op.size, op.size);
+      }
+      failed = write_back(&t) ||
+               emit(&t, (Ir_Op) { .op = IR_HELPER, .pc = pc });
+      pc += 1;
+      break;
+    case avm_opc_jmpez:
+      track(&t, 1, 0);
+      if (reserve(&t, 1) || pop_item(&t, &item)) {
+        failed = 1;
+        break;
+      }
+      if (item.is_const) {
+        // jumps on, or falls through, at the end of the block
+        if (item.value == 0) {
+          pc = op.address;
+          end = pc;
+        } else {
+          pc += 1;
+        }
+        break;
+      }
+      // writing the stack back leaves `acc` alone
+      in_acc = item.reg == t.acc;
+      failed = write_back(&t) ||
+               exit_to(&t, in_acc ? IR_BRZA : IR_BRZ, item.reg, op.address);
+      pc += 1;
+      break;
+    case avm_opc_calli:
+      failed = write_back(&t) ||
+               emit(&t, (Ir_Op) { .op = IR_CALL, .pc = pc,
+                                  .imm = op.address });
+      pc = op.address;
+      end = pc;
+      break;
+    case avm_opc_ret:
+      failed = write_back(&t) ||
+               emit(&t, (Ir_Op) { .op = IR_RET, .pc = pc });
+      done = 1;
+      break;
+    case avm_opc_call:
+      if (t.count > 0 && t.items[t.count - 1].is_const) {
+        track(&t, 1, 0);
+        item = t.items[--t.count];
+        failed = write_back(&t) ||
+                 emit(&t, (Ir_Op) { .op = IR_CALL, .pc = pc,
+                                    .imm = item.value });
+        pc = (avm_size_t) item.value;
+        end = pc;
+        break;
+      }
+      // the target is only known at runtime
+      // fall through
+    default:
+      // quit and errors
+      if (pc == block->start) {
+        failed = 1;
+        break;
+      }
+      failed = write_back(&t) ||
+               emit(&t, (Ir_Op) { .op = IR_BAIL, .pc = pc });
+      done = 1;
+      break;
+    }
+  }
+
+  // stubs go after the code, stores jump that far ahead to them
+  size_t length = t.code.len;
+  for (size_t i = 0; i < length; ++i) {
+    Ir_Op *ir = &t.code.ops[i];
+    if (ir->op == IR_STORE || ir->op == IR_STOREA) {
+      ir->imm += length - i;
+    }
+  }
+  for (size_t i = 0; i < t.stubs.len && !failed; ++i) {
+    failed = emit(&t, t.stubs.ops[i]);
+  }
+  my_free(t.stubs.ops);
+
+  if (failed || -t.lowest > MAX_DEPTH_DIFF || t.highest > MAX_DEPTH_DIFF) {
+    my_free(t.code.ops);
+    return 1;
+  }
+
+  out->ops = t.code.ops;
+  out->need = (avm_size_t) -t.lowest;
+  out->grow = (avm_size_t) t.highest;
+  out->state = BLOCK_READY;
+  return 0;
+}
+
+/* Sends every translated block back to be translated again */
+static void forget(AVM_Ir *ir, size_t count)
+{
+  for (size_t i = 0; i < count; ++i) {
+    if (ir->blocks[i].state == BLOCK_READY) {
+      my_free(ir->blocks[i].ops);
+      ir->blocks[i].ops = NULL;
+      ir->blocks[i].state = BLOCK_COLD;
+      ir->blocks[i].need = AVM_SIZE_MAX;
+    }
+  }
+}
+
+static void drop(AVM_Context *ctx, size_t index)
+{
+  Ir_Block *block = &ctx->ir->blocks[index];
+  if (block->threaded) {
+    // translations jump straight past it
+    forget(ctx->ir, ctx->block_count);
+  }
+  block->state = BLOCK_DROPPED;
+  block->need = AVM_SIZE_MAX;
+  my_free(block->ops);
+  block->ops = NULL;
+  ctx->code[ctx->blocks[index].start].flags &= (uint8_t) ~AVM_DEC_ENGINE;
+  ctx->ir->epoch += 1;
+}
+
+/* Runs the `load`, `store`, `copy`, `fill` or vector operation at `pc` */
+static int run_helper(AVM_Context *ctx, avm_size_t pc)
+{
+  AVM_Operation op;
+  avm_heap_get(ctx, (avm_int *) &op, pc);
+  AVM_Decoded decoded = { .op = op.kind, .arg = op.address, .imm = op.size };
+
+  switch (op.kind) {
+  case avm_opc_load:
+    return avm__eval_load(&decoded, ctx);
+  case avm_opc_store:
+    return avm__eval_store(&decoded, ctx);
+  case avm_opc_copy:
+    return avm__eval_copy(ctx);
+  case avm_opc_fill:
+    return avm__eval_fill(ctx);
+  default:
+    return avm__eval_vector(&decoded, ctx);
+  }
+}
+
+#if AVM_THREADED
+#define OP(NAME) case NAME: op_ ## NAME
+#define BINOP_CASE(FORM, KIND) case IR_ ## FORM + K_ ## KIND: op_ ## FORM ## _ ## KIND
+#define DISPATCH() goto *handlers[op->op]
+#else
+#define OP(NAME) case NAME
+#define BINOP_CASE(FORM, KIND) case IR_ ## FORM + K_ ## KIND
+#define DISPATCH() goto dispatch
+#endif
+
+#define NEXT_OP() { ++op; DISPATCH(); }
+
+#define BINOP(FORM, KIND, LHS, RHS, EXPR) \
+  BINOP_CASE(FORM, KIND): { \
+    avm_int a = LHS, b = RHS; \
+    acc = regs[op->dst] = EXPR; \
+    NEXT_OP(); \
+  }
+
+#define BINOPS_FOR(FORM, LHS, RHS) \
+  BINOP(FORM, add, LHS, RHS, a + b) \
+  BINOP(FORM, sub, LHS, RHS, a - b) \
+  BINOP(FORM, mul, LHS, RHS, a * b) \
+  BINOP(FORM, div, LHS, RHS, a / (b + (b == 0))) \
+  BINOP(FORM, and, LHS, RHS, a & b) \
+  BINOP(FORM, or,  LHS, RHS, a | b) \
+  BINOP(FORM, xor, LHS, RHS, a ^ b) \
+  BINOP(FORM, shr, LHS, RHS, a >> (b & 0x3F)) \
+  BINOP(FORM, shl, LHS, RHS, a << (b & 0x3F))
+
+#define HANDLERS_FOR(FORM) \
+  &&op_ ## FORM ## _add, &&op_ ## FORM ## _sub, &&op_ ## FORM ## _mul, \
+  &&op_ ## FORM ## _div, &&op_ ## FORM ## _and, &&op_ ## FORM ## _or, \
+  &&op_ ## FORM ## _xor, &&op_ ## FORM ## _shr, &&op_ ## FORM ## _shl
+
+/* Runs translated blocks from block `index` on, until one of them leaves
+ * for the interpreter or a block that isn't translated yet
+ */
+static int run(AVM_Context *ctx, int index, avm_size_t *pc)
+{
+#if AVM_THREADED
+  static const void *const handlers[] = {
+    HANDLERS_FOR(RR), HANDLERS_FOR(RK), HANDLERS_FOR(AR), HANDLERS_FOR(AK),
+    HANDLERS_FOR(RA), HANDLERS_FOR(SK),
+    &&op_IR_CONST, &&op_IR_PEEK, &&op_IR_PUT, &&op_IR_PUTA, &&op_IR_PUTK,
+    &&op_IR_ADJ, &&op_IR_LOAD, &&op_IR_STORE, &&op_IR_STOREA,
+    &&op_IR_HELPER, &&op_IR_CALL, &&op_IR_RET, &&op_IR_BRZ, &&op_IR_BRZA,
+    &&op_IR_EXIT, &&op_IR_BAIL,
+  };
+#endif
+
+  AVM_Ir *ir = ctx->ir;
+  avm_int regs[MAX_REGS];
+  avm_int acc = 0, value;
+  avm_int *sp = ctx->stack + ctx->stack_size;
+  uint64_t budget = ctx->budget;
+  avm_size_t at = *pc, returned_to = AVM_SIZE_MAX;
+  int returned_index = -1;
+  const Ir_Op *op;
+  int status = AVM_RUN_EXITED;
+  unsigned epoch;
+
+enter:
+  if (index < 0) {
+    goto leave;
+  }
+
+  Ir_Block *block = &ir->blocks[index];
+  avm_size_t depth = (avm_size_t) (sp - ctx->stack);
+  if (depth < block->need || ctx->stack_cap - depth <= block->grow) {
+    // blocks that aren't ready fail this as well, and the interpreter
+    // brings cold ones back to be translated
+    if (block->state == BLOCK_READY) {
+      status = AVM_RUN_BAILED;
+    }
+    goto leave;
+  }
+
+  op = block->ops;
+#if AVM_THREADED
+  DISPATCH();
+#else
+dispatch:
+#endif
+  switch (op->op) {
+    BINOPS_FOR(RR, regs[op->a], regs[op->b])
+    BINOPS_FOR(RK, regs[op->a], op->imm)
+    BINOPS_FOR(AR, acc, regs[op->b])
+    BINOPS_FOR(AK, acc, op->imm)
+    BINOPS_FOR(RA, regs[op->a], acc)
+    BINOPS_FOR(SK, sp[op->off], op->imm)
+
+    OP(IR_CONST):
+      acc = regs[op->dst] = op->imm;
+      NEXT_OP();
+    OP(IR_PEEK):
+      acc = regs[op->dst] = sp[op->off];
+      NEXT_OP();
+    OP(IR_PUT):
+      sp[op->off] = regs[op->a];
+      NEXT_OP();
+    OP(IR_PUTA):
+      sp[op->off] = acc;
+      NEXT_OP();
+    OP(IR_PUTK):
+      sp[op->off] = op->imm;
+      NEXT_OP();
+    OP(IR_ADJ):
+      sp += op->off;
+      NEXT_OP();
+
+    OP(IR_LOAD):
+      acc = regs[op->dst] = avm__page(ctx, op->address)
+                            [op->address & (AVM_PAGE_WORDS - 1)];
+      NEXT_OP();
+    OP(IR_STORE):
+      value = regs[op->a];
+      goto store;
+    OP(IR_STOREA):
+      value = acc;
+    store: {
+      avm_size_t offset = op->address & (AVM_PAGE_WORDS - 1);
+      // pages are only written, and copied, once a word changes
+      if (avm__page(ctx, op->address)[offset] != value) {
+        avm_int *page;
+        if ((op->b && avm__invalidate(ctx, op->address)) ||
+            (page = avm__page_write(ctx, op->address)) == NULL) {
+          op += op->imm;
+          DISPATCH();
+        }
+        page[offset] = value;
+      }
+      NEXT_OP();
+    }
+
+    OP(IR_HELPER):
+      at = op->pc;
+      ctx->stack_size = (avm_size_t) (sp - ctx->stack);
+      epoch = ir->epoch;
+      status = run_helper(ctx, op->pc);
+      // the stack may have moved
+      sp = ctx->stack + ctx->stack_size;
+      if (status) {
+        status = AVM_RUN_ERROR;
+        goto leave;
+      }
+      if (ir->epoch != epoch) {
+        // possibly wrote over this block
+        at += 1;
+        status = AVM_RUN_BAILED;
+        goto leave;
+      }
+      NEXT_OP();
+
+    OP(IR_CALL):
+      at = op->pc;
+      if (avm__push_call(ctx, (AVM_Stack_Frame) {
+      .target = (avm_size_t) op->imm, .caller = op->pc
+    })) {
+        status = AVM_RUN_ERROR;
+        goto leave;
+      }
+      NEXT_OP();
+
+    OP(IR_RET):
+      at = op->pc;
+      if (ctx->call_stack_size == 0) {
+        // for the interpreter to report
+        status = AVM_RUN_BAILED;
+        goto leave;
+      }
+      ctx->call_stack_size -= 1;
+      at = ctx->call_stack[ctx->call_stack_size].caller + 1;
+      if (budget == 0) {
+        status = AVM_RUN_BUDGET;
+        goto leave;
+      }
+      budget -= 1;
+      // recursion returns to the same place over and over
+      if (at != returned_to) {
+        returned_to = at;
+        returned_index = avm__find_block(ctx, at, 0);
+      }
+      index = returned_index;
+      goto enter;
+
+    OP(IR_BRZ):
+      if (regs[op->a] != 0) {
+        NEXT_OP();
+      }
+      goto taken;
+    OP(IR_BRZA):
+      if (acc != 0) {
+        NEXT_OP();
+      }
+      goto taken;
+    OP(IR_EXIT):
+    taken:
+      at = op->pc;
+      if (op->b) {
+        if (budget == 0) {
+          status = AVM_RUN_BUDGET;
+          goto leave;
+        }
+        budget -= 1;
+      }
+      if (op->dst) {
+        op = block->ops;
+        DISPATCH();
+      }
+      index = (int) op->imm - 1;
+      goto enter;
+    OP(IR_BAIL):
+      at = op->pc;
+      status = AVM_RUN_BAILED;
+      goto leave;
+  }
+
+leave:
+  ctx->stack_size = (avm_size_t) (sp - ctx->stack);
+  ctx->budget = budget;
+  *pc = at;
+  return status;
+}
+
+int avm__ir_run(AVM_Context *ctx, avm_size_t *pc)
+{
+  int index = avm__find_block(ctx, *pc, 0);
+  if (index >= 0 && ctx->ir->blocks[index].state == BLOCK_COLD &&
+      translate(ctx, &ctx->ir->blocks[index], (size_t) index)) {
+    drop(ctx, (size_t) index);
+  }
+  return run(ctx, index, pc);
+}
+
+int avm_ir_enable(AVM_Context *ctx, int enabled)
+{
+  avm__ir_free(ctx);
+#ifdef AVM_JIT
+  avm__jit_free(ctx);
+#endif
+  if (!enabled) {
+    return 0;
+  }
+  if (avm__code_own(ctx)) {
+    return 1;
+  }
+
+  AVM_Ir *ir = my_calloc(1, sizeof(AVM_Ir));
+  if (ir != NULL) {
+    ir->blocks = my_calloc(ctx->block_count + 1, sizeof(Ir_Block));
+  }
+  if (ir == NULL || ir->blocks == NULL) {
+    my_free(ir);
+    return avm__error(ctx, "unable to allocate register engine");
+  }
+
+  for (size_t i = 0; i < ctx->block_count; ++i) {
+    ir->blocks[i].need = AVM_SIZE_MAX;
+  }
+
+  ctx->ir = ir;
+  avm__mark_blocks(ctx, 1);
+  return 0;
+}
+
+void avm__ir_invalidate(AVM_Context *ctx, avm_size_t loc)
+{
+  int index = avm__find_block(ctx, loc, 1);
+  if (index >= 0 && ctx->ir->blocks[index].state != BLOCK_DROPPED) {
+    drop(ctx, (size_t) index);
+  }
+}
+
+void avm__ir_free(AVM_Context *ctx)
+{
+  AVM_Ir *ir = ctx->ir;
+  if (ir == NULL) {
+    return;
+  }
+
+  avm__mark_blocks(ctx, 0);
+  for (size_t i = 0; i < ctx->block_count; ++i) {
+    my_free(ir->blocks[i].ops);
+  }
+  my_free(ir->blocks);
+  my_free(ctx->ir);
+}
@@ -0,0 +1,949 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include "avm.h"
+#include "avm_util.h"
+#include "avm_def.h"
+
+#ifdef AVM_JIT
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* A JIT compiler for x86-64, translating the basic blocks avm_verify found
+ * into native code once they've been entered AVM_JIT_THRESHOLD times.
+ *
+ * Native code keeps the top of the operand stack in registers and only
+ * writes it back at the end of a block, before calling back into C and when
+ * it runs out of registers. A block checks up front that the stack holds
+ * everything it pops and has room for everything it pushes, and leaves it
+ * to the interpreter otherwise. `ret`, `quit`, `call` with a target that
+ * isn't a constant and invalid instructions are left to the interpreter as
+ * well. Blocks jump straight into each other through `entries`, which
+ * points back to the interpreter until the block is compiled.
+ *
+ * Every jump or call back to an earlier block takes a step off the budget
+ * of avm_eval_steps. Anything that loops has to take one of those, and
+ * forward transfers stay as cheap as they were.
+ *
+ * Code pages are never writable and executable at the same time. Writing
+ * over a block drops its native code for good.
+ */
+
+#define CODE_RESERVE   (16u << 20)
+#define MAX_ITEMS      32     /* virtual stack items before spilling */
+#define MAX_DEPTH_DIFF 4096   /* stack a block may pop or push in total */
+
+enum {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+/* rbx holds the frame, r12 the stack pointer and r15 `entries`. rax, rcx
+ * and rdx are scratch registers. Everything else holds stack items.
+ */
+static const uint8_t pool[] = { RSI, RDI, R8, R9, R10, R11, R13, R14 };
+#define POOL_SIZE (sizeof(pool) / sizeof(pool[0]))
+
+/* condition codes */
+enum { CC_B = 0x2, CC_Z = 0x4, CC_A = 0x7 };
+
+typedef struct {
+  avm_int *sp;        /* one past the top of the stack */
+  avm_int *base;
+  avm_int *limit;     /* the furthest `sp` may go */
+  void *const *entries;
+  AVM_Context *ctx;
+  uint64_t budget;    /* `ctx->budget` while native code runs */
+  avm_size_t pc;
+} Frame;
+
+enum { BLOCK_COLD, BLOCK_NATIVE, BLOCK_REJECTED };
+
+typedef struct {
+  uint8_t state;
+  uint32_t count;
+  void *code;
+} Jit_Block;
+
+struct AVM_Jit_s {
+  uint8_t *region;
+  size_t used;
+  size_t page_size;
+  int (*enter)(Frame *frame, const void *code);
+  size_t exit_continue;   /* offsets of the shared exits in `region` */
+  size_t exit_bail;
+  size_t exit_budget;
+  size_t exit_common;
+  void **entries;
+  Jit_Block *blocks;
+  unsigned epoch;         /* bumped whenever a block is dropped */
+};
+
+typedef struct {
+  uint8_t *buf;
+  size_t len;
+  size_t cap;
+} Emitter;
+
+static void byte(Emitter *e, uint8_t b)
+{
+  if (e->len < e->cap) {
+    e->buf[e->len] = b;
+  }
+  e->len += 1;
+}
+
+static void u32(Emitter *e, uint32_t v)
+{
+  for (int i = 0; i < 4; ++i) {
+    byte(e, (uint8_t) (v >> (8 * i)));
+  }
+}
+
+static void u64(Emitter *e, uint64_t v)
+{
+  u32(e, (uint32_t) v);
+  u32(e, (uint32_t) (v >> 32));
+}
+
+static void patch32(Emitter *e, size_t at, uint32_t v)
+{
+  if (at + 4 <= e->cap) {
+    for (int i = 0; i < 4; ++i) {
+      e->buf[at + i] = (uint8_t) (v >> (8 * i));
+    }
+  }
+}
+
+/* Whether `v` is a sign extended imm32 */
+static int fits32(avm_int v)
+{
+  return (int64_t) v >= INT32_MIN && (int64_t) v <= INT32_MAX;
+}
+
+/* `op` is one byte, or two for 0x0F xx */
+static void opcode(Emitter *e, int w, unsigned op, int reg, int rm)
+{
+  uint8_t rex = (uint8_t) (0x40 | (w << 3) | ((reg & 8) >> 1) | ((rm & 8) >> 3));
+  if (rex != 0x40) {
+    byte(e, rex);
+  }
+  if (op > 0xFF) {
+    byte(e, (uint8_t) (op >> 8));
+  }
+  byte(e, (uint8_t) op);
+}
+
+/* op reg, rm */
+static void op_rr(Emitter *e, int w, unsigned op, int reg, int rm)
+{
+  opcode(e, w, op, reg, rm);
+  byte(e, (uint8_t) (0xC0 | (reg & 7) << 3 | (rm & 7)));
+}
+
+/* op reg, [base + disp] */
+static void op_rm(Emitter *e, int w, unsigned op, int reg, int base,
+                  int32_t disp)
+{
+  opcode(e, w, op, reg, base);
+  byte(e, (uint8_t) (0x80 | (reg & 7) << 3 | (base & 7)));
+  if ((base & 7) == RSP) {
+    byte(e, 0x24);
+  }
+  u32(e, (uint32_t) disp);
+}
+
+static void mov_ri(Emitter *e, int dst, avm_int v)
+{
+  if (v <= UINT32_MAX) {
+    opcode(e, 0, 0xB8 + (dst & 7), 0, dst);
+    u32(e, (uint32_t) v);
+  } else if (fits32(v)) {
+    op_rr(e, 1, 0xC7, 0, dst);
+    u32(e, (uint32_t) v);
+  } else {
+    opcode(e, 1, 0xB8 + (dst & 7), 0, dst);
+    u64(e, (uint64_t) v);
+  }
+}
+
+static void push_reg(Emitter *e, int r)
+{
+  opcode(e, 0, 0x50 + (r & 7), 0, r);
+}
+
+static void pop_reg(Emitter *e, int r)
+{
+  opcode(e, 0, 0x58 + (r & 7), 0, r);
+}
+
+/* A rel32 jump or call to `target`, relative to the emitter's buffer */
+static void rel32(Emitter *e, size_t target)
+{
+  u32(e, (uint32_t) (target - (e->len + 4)));
+}
+
+static void jmp(Emitter *e, size_t target)
+{
+  byte(e, 0xE9);
+  rel32(e, target);
+}
+
+/* Emits a jcc with a blank target, returns where to patch it */
+static size_t jcc(Emitter *e, int cc)
+{
+  byte(e, 0x0F);
+  byte(e, (uint8_t) (0x80 | cc));
+  u32(e, 0);
+  return e->len - 4;
+}
+
+static void land(Emitter *e, size_t at)
+{
+  patch32(e, at, (uint32_t) (e->len - (at + 4)));
+}
+
+static void set_pc(Emitter *e, avm_size_t pc)
+{
+  op_rm(e, 0, 0xC7, 0, RBX, offsetof(Frame, pc));
+  u32(e, pc);
+}
+
+/* A stack item the compiler hasn't written to memory yet. Items popped
+ * off the memory stack are MEM, at `disp` bytes from r12.
+ */
+enum { ITEM_CONST, ITEM_REG, ITEM_MEM };
+
+typedef struct {
+  uint8_t kind;
+  uint8_t reg;
+  int32_t disp;
+  avm_int value;
+} Item;
+
+typedef struct {
+  AVM_Context *ctx;
+  AVM_Jit *jit;
+  Emitter e;
+  avm_size_t start;       /* the first instruction of the block */
+  Item items[MAX_ITEMS];
+  size_t count;
+  int32_t consumed;       /* memory slots popped below r12 */
+  uint8_t refs[16];       /* references to each register */
+  int64_t depth;          /* stack depth relative to the block entry */
+  int64_t lowest;
+  int64_t highest;
+} Compiler;
+
+static int have_free_reg(Compiler *c)
+{
+  for (size_t i = 0; i < POOL_SIZE; ++i) {
+    if (c->refs[pool[i]] == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Takes a free register, there has to be one */
+static int claim(Compiler *c)
+{
+  size_t i = 0;
+  while (i + 1 < POOL_SIZE && c->refs[pool[i]] != 0) {
+    ++i;
+  }
+  c->refs[pool[i]] = 1;
+  return pool[i];
+}
+
+static void release(Compiler *c, Item item)
+{
+  if (item.kind == ITEM_REG) {
+    c->refs[item.reg] -= 1;
+  }
+}
+
+/* Writes every item to the memory stack and moves r12 past them */
+static void flush(Compiler *c)
+{
+  Emitter *e = &c->e;
+
+  for (size_t i = 0; i < c->count; ++i) {
+    Item item = c->items[i];
+    int32_t disp = (int32_t) (8 * ((int32_t) i - c->consumed));
+
+    if (item.kind == ITEM_REG) {
+      op_rm(e, 1, 0x89, item.reg, R12, disp);
+    } else if (fits32(item.value)) {
+      op_rm(e, 1, 0xC7, 0, R12, disp);
+      u32(e, (uint32_t) item.value);
+    } else {
+      mov_ri(e, RAX, item.value);
+      op_rm(e, 1, 0x89, RAX, R12, disp);
+    }
+    release(c, item);
+  }
+
+  int32_t moved = (int32_t) c->count - c->consumed;
+  if (moved != 0) {
+    op_rm(e, 1, 0x8D, R12, R12, 8 * moved);
+  }
+  c->count = 0;
+  c->consumed = 0;
+}
+
+static void push_item(Compiler *c, Item item)
+{
+  if (c->count == MAX_ITEMS) {
+    flush(c);
+  }
+  c->items[c->count++] = item;
+}
+
+static Item pop_item(Compiler *c)
+{
+  if (c->count > 0) {
+    return c->items[--c->count];
+  }
+  c->consumed += 1;
+  return (Item) { .kind = ITEM_MEM, .disp = -8 * c->consumed };
+}
+
+/* Loads `item` into `reg` */
+static void load_item(Compiler *c, int reg, Item item)
+{
+  if (item.kind == ITEM_CONST) {
+    mov_ri(&c->e, reg, item.value);
+  } else if (item.kind == ITEM_MEM) {
+    op_rm(&c->e, 1, 0x8B, reg, R12, item.disp);
+  } else if (item.reg != reg) {
+    op_rr(&c->e, 1, 0x89, item.reg, reg);
+  }
+}
+
+static void track(Compiler *c, int64_t pops, int64_t pushes)
+{
+  c->depth -= pops;
+  if (c->depth < c->lowest) {
+    c->lowest = c->depth;
+  }
+  c->depth += pushes;
+  if (c->depth > c->highest) {
+    c->highest = c->depth;
+  }
+}
+
+/* Jumps to `pc`, straight into its block if it starts one */
+static void exit_to(Compiler *c, avm_size_t pc)
+{
+  set_pc(&c->e, pc);
+  if (pc <= c->start) {
+    // sub qword [rbx + budget], 1, borrowing once there are no steps left
+    op_rm(&c->e, 1, 0x83, 5, RBX, offsetof(Frame, budget));
+    byte(&c->e, 1);
+    size_t exhausted = jcc(&c->e, CC_B);
+    patch32(&c->e, exhausted,
+            (uint32_t) (c->jit->exit_budget - (exhausted + 4)));
+  }
+  int block = avm__find_block(c->ctx, pc, 0);
+  if (block >= 0) {
+    op_rm(&c->e, 0, 0xFF, 4, R15, (int32_t) (8 * block));
+  } else {
+    jmp(&c->e, c->jit->exit_continue);
+  }
+}
+
+/* Leaves the instruction at `pc` to the interpreter */
+static void bail(Compiler *c, avm_size_t pc)
+{
+  set_pc(&c->e, pc);
+  jmp(&c->e, c->jit->exit_bail);
+}
+
+static int fold(AVM_Opcode kind, avm_int a, avm_int b, avm_int *out)
+{
+  switch (kind) {
+  case avm_opc_add: *out = a + b; return 1;
+  case avm_opc_sub: *out = a - b; return 1;
+  case avm_opc_mul: *out = a * b; return 1;
+  case avm_opc_div: *out = a / (b + (b == 0)); return 1;
+  case avm_opc_and: *out = a & b; return 1;
+  case avm_opc_or:  *out = a | b; return 1;
+  case avm_opc_xor: *out = a ^ b; return 1;
+  case avm_opc_shr: *out = a >> (b & 0x3F); return 1;
+  case avm_opc_shl: *out = a << (b & 0x3F); return 1;
+  default: return 0;
+  }
+}
+
+static void compile_binop(Compiler *c, AVM_Opcode kind)
+{
+  static const uint8_t alu[opcode_count] = {
+    [avm_opc_add] = 0x01, [avm_opc_or ] = 0x09, [avm_opc_and] = 0x21,
+    [avm_opc_sub] = 0x29, [avm_opc_xor] = 0x31,
+  };
+  Emitter *e = &c->e;
+
+  track(c, 2, 1);
+  if (!have_free_reg(c)) {
+    flush(c);
+  }
+
+  Item b = pop_item(c);
+  Item a = pop_item(c);
+  avm_int folded;
+
+  if (a.kind == ITEM_CONST && b.kind == ITEM_CONST &&
+      fold(kind, a.value, b.value, &folded)) {
+    push_item(c, (Item) { .kind = ITEM_CONST, .value = folded });
+    return;
+  }
+
+  int dst;
+  if (a.kind == ITEM_REG && c->refs[a.reg] == 1) {
+    dst = a.reg;
+  } else {
+    dst = claim(c);
+    load_item(c, dst, a);
+    release(c, a);
+  }
+
+  switch (kind) {
+  case avm_opc_add:
+  case avm_opc_sub:
+  case avm_opc_and:
+  case avm_opc_or:
+  case avm_opc_xor:
+    if (b.kind == ITEM_CONST && fits32(b.value)) {
+      // 0x81 /n with n the same as bits 3-5 of the opcode
+      op_rr(e, 1, 0x81, alu[kind] >> 3, dst);
+      u32(e, (uint32_t) b.value);
+    } else if (b.kind == ITEM_MEM) {
+      op_rm(e, 1, alu[kind] + 2u, dst, R12, b.disp);
+    } else {
+      int src = b.kind == ITEM_REG ? b.reg : RAX;
+      load_item(c, src, b);
+      op_rr(e, 1, alu[kind], src, dst);
+    }
+    break;
+  case avm_opc_mul:
+    if (b.kind == ITEM_CONST && fits32(b.value)) {
+      op_rr(e, 1, 0x69, dst, dst);
+      u32(e, (uint32_t) b.value);
+    } else if (b.kind == ITEM_MEM) {
+      op_rm(e, 1, 0x0FAF, dst, R12, b.disp);
+    } else {
+      int src = b.kind == ITEM_REG ? b.reg : RAX;
+      load_item(c, src, b);
+      op_rr(e, 1, 0x0FAF, dst, src);
+    }
+    break;
+  case avm_opc_shr:
+  case avm_opc_shl: {
+    int ext = kind == avm_opc_shl ? 4 : 5;
+    if (b.kind == ITEM_CONST) {
+      op_rr(e, 1, 0xC1, ext, dst);
+      byte(e, (uint8_t) (b.value & 0x3F));
+    } else {
+      // the count is masked to 6 bits by the CPU
+      load_item(c, RCX, b);
+      op_rr(e, 1, 0xD3, ext, dst);
+    }
+    break;
+  }
+  case avm_opc_div:
+    if (b.kind == ITEM_CONST) {
+      mov_ri(e, RCX, b.value == 0 ? 1 : b.value);
+    } else {
+      load_item(c, RCX, b);
+      op_rr(e, 1, 0x85, RCX, RCX);    // test rcx, rcx
+      byte(e, 0x75);                  // jnz +5
+      byte(e, 5);
+      mov_ri(e, RCX, 1);
+    }
+    op_rr(e, 1, 0x89, dst, RAX);
+    op_rr(e, 0, 0x31, RDX, RDX);      // xor edx, edx
+    op_rr(e, 1, 0xF7, 6, RCX);        // div rcx
+    op_rr(e, 1, 0x89, RAX, dst);
+    break;
+  default:
+    break;
+  }
+
+  release(c, b);
+  push_item(c, (Item) { .kind = ITEM_REG, .reg = (uint8_t) dst });
+}
+
+static void compile_dup(Compiler *c)
+{
+  track(c, 1, 2);
+  if (!have_free_reg(c)) {
+    flush(c);
+  }
+
+  Item a = pop_item(c);
+  if (a.kind == ITEM_MEM) {
+    int reg = claim(c);
+    load_item(c, reg, a);
+    a = (Item) { .kind = ITEM_REG, .reg = (uint8_t) reg };
+  }
+  if (a.kind == ITEM_REG) {
+    c->refs[a.reg] += 1;
+  }
+  push_item(c, a);
+  push_item(c, a);
+}
+
+/* Calls `helper(frame, a1, a2)` with the stack written back, leaving
+ * through the exits if it doesn't return AVM_RUN_EXITED.
+ */
+static void call_helper(Compiler *c, avm_size_t pc, const void *helper,
+                        avm_size_t a1, avm_size_t a2)
+{
+  Emitter *e = &c->e;
+
+  flush(c);
+  op_rm(e, 1, 0x89, R12, RBX, offsetof(Frame, sp));
+  set_pc(e, pc);
+  op_rr(e, 1, 0x89, RBX, RDI);
+  mov_ri(e, RSI, a1);
+  mov_ri(e, RDX, a2);
+  opcode(e, 1, 0xB8, 0, RAX);
+  u64(e, (uint64_t) (uintptr_t) helper);
+  op_rr(e, 0, 0xFF, 2, RAX);                  // call rax
+  op_rm(e, 1, 0x8B, R12, RBX, offsetof(Frame, sp));
+  op_rr(e, 0, 0x85, RAX, RAX);                // test eax, eax
+  size_t ok = jcc(e, CC_Z);
+  jmp(e, c->jit->exit_common);
+  land(e, ok);
+}
+
+/* The stack lives in `ctx` while C code runs */
+static void frame_to_ctx(Frame *f)
+{
+  f->ctx->stack_size = (avm_size_t) (f->sp - f->base);
+}
+
+static void ctx_to_frame(Frame *f)
+{
+  AVM_Context *ctx = f->ctx;
+  f->base = ctx->stack;
+  f->sp = ctx->stack + ctx->stack_size;
+  f->limit = ctx->stack + ctx->stack_cap - 1;
+}
+
+static int helper_load(Frame *f, avm_size_t size, avm_size_t address)
+{
+  AVM_Decoded op = { .arg = address, .imm = size };
+  frame_to_ctx(f);
+  int retcode = avm__eval_load(&op, f->ctx);
+  ctx_to_frame(f);
+  return retcode ? AVM_RUN_ERROR : AVM_RUN_EXITED;
+}
+
+static int helper_store(Frame *f, avm_size_t size, avm_size_t address)
+{
+  AVM_Decoded op = { .arg = address, .imm = size };
+  unsigned epoch = f->ctx->jit->epoch;
+  frame_to_ctx(f);
+  int retcode = avm__eval_store(&op, f->ctx);
+  ctx_to_frame(f);
+
+  if (retcode) {
+    return AVM_RUN_ERROR;
+  }
+  if (f->ctx->jit->epoch != epoch) {
+    // possibly wrote over the running block
+    f->pc += 1;
+    return AVM_RUN_BAILED;
+  }
+  return AVM_RUN_EXITED;
+}
+
+/* `copy` or `fill`, whichever `kind` is */
+static int helper_bulk(Frame *f, avm_size_t kind, avm_size_t unused)
+{
+  unsigned epoch = f->ctx->jit->epoch;
+  frame_to_ctx(f);
+  int retcode = kind == avm_opc_copy ? avm__eval_copy(f->ctx) :
+                avm__eval_fill(f->ctx);
+  ctx_to_frame(f);
+  (void) unused;
+
+  if (retcode) {
+    return AVM_RUN_ERROR;
+  }
+  if (f->ctx->jit->epoch != epoch) {
+    // possibly wrote over the running block
+    f->pc += 1;
+    return AVM_RUN_BAILED;
+  }
+  return AVM_RUN_EXITED;
+}
+
+/* The vector operation `kind` over `lanes` words */
+static int helper_vector(Frame *f, avm_size_t kind, avm_size_t lanes)
+{
+  AVM_Decoded op = { .op = (uint8_t) kind, .imm = lanes };
+  frame_to_ctx(f);
+  int retcode = avm__eval_vector(&op, f->ctx);
+  ctx_to_frame(f);
+  return retcode ? AVM_RUN_ERROR : AVM_RUN_EXITED;
+}
+
+static int helper_call(Frame *f, avm_size_t target, avm_size_t caller)
+{
+  AVM_Stack_Frame frame = { .target = target, .caller = caller };
+  return avm__push_call(f->ctx, frame) ? AVM_RUN_ERROR : AVM_RUN_EXITED;
+}
+
+/* Compiles block `index`, returns 0 if the block can't be compiled */
+static int compile(AVM_Context *ctx, AVM_Jit *jit, size_t index)
+{
+  AVM_Block *block = &ctx->blocks[index];
+  Compiler c = {
+    .ctx = ctx,
+    .jit = jit,
+    .e = { .buf = jit->region, .len = jit->used, .cap = CODE_RESERVE },
+    .start = block->start,
+  };
+  Emitter *e = &c.e;
+
+  // the stack checks get their displacements once the block is done
+  op_rm(e, 1, 0x8D, RAX, R12, 0);
+  size_t need_at = e->len - 4;
+  op_rm(e, 1, 0x3B, RAX, RBX, offsetof(Frame, base));
+  size_t underrun = jcc(e, CC_B);
+  op_rm(e, 1, 0x8D, RAX, R12, 0);
+  size_t grow_at = e->len - 4;
+  op_rm(e, 1, 0x3B, RAX, RBX, offsetof(Frame, limit));
+  size_t overflow = jcc(e, CC_A);
+
+  avm_size_t pc = block->start;
+  size_t compiled = 0;
+  int done = 0;
+
+  while (!done) {
+    if (pc >= block->end) {
+      flush(&c);
+      exit_to(&c, pc);
+      break;
+    }
+
+    AVM_Operation op;
+    avm_heap_get(ctx, (avm_int *) &op, pc);
+
+    switch (op.kind) {
+    case avm_opc_push: {
+      avm_int value;
+      avm_heap_get(ctx, &value, pc + 1);
+      track(&c, 0, 1);
+      push_item(&c, (Item) { .kind = ITEM_CONST, .value = value });
+      pc += 2;
+      break;
+    }
+    case avm_opc_add:
+    case avm_opc_sub:
+    case avm_opc_mul:
+    case avm_opc_div:
+    case avm_opc_and:
+    case avm_opc_or:
+    case avm_opc_xor:
+    case avm_opc_shr:
+    case avm_opc_shl:
+      compile_binop(&c, op.kind);
+      pc += 1;
+      break;
+    case avm_opc_dup:
+      compile_dup(&c);
+      pc += 1;
+      break;
+    case avm_opc_load:
+      track(&c, 0, op.size);
+      call_helper(&c, pc, (const void *) helper_load, op.size, op.address);
+      pc += 1;
+      break;
+    case avm_opc_store:
+      track(&c, op.size, 0);
+      call_helper(&c, pc, (const void *) helper_store, op.size, op.address);
+      pc += 1;
+      break;
+    case avm_opc_copy:
+    case avm_opc_fill:
+      track(&c, 3, 0);
+      call_helper(&c, pc, (const void *) helper_bulk, op.kind, 0);
+      pc += 1;
+      break;
+    case avm_opc_vadd:
+    case avm_opc_vsub:
+    case avm_opc_vmul:
+    case avm_opc_vand:
+    case avm_opc_vor:
+    case avm_opc_vxor:
+    case avm_opc_vshr:
+    case avm_opc_vshl:
+      track(&c, 2 * (int64_t) op.size, op.size);
+      call_helper(&c, pc, (const void *) helper_vector, op.kind, op.size);
+      pc += 1;
+      break;
+    case avm_opc_jmpez: {
+      track(&c, 1, 0);
+      Item test = pop_item(&c);
+      if (test.kind == ITEM_CONST) {
+        flush(&c);
+        exit_to(&c, test.value == 0 ? op.address : pc + 1);
+      } else {
+        int reg = test.kind == ITEM_REG ? test.reg : RDX;
+        load_item(&c, reg, test);
+        release(&c, test);
+        flush(&c);
+        op_rr(e, 1, 0x85, reg, reg);
+        size_t taken = jcc(e, CC_Z);
+        exit_to(&c, pc + 1);
+        land(e, taken);
+        exit_to(&c, op.address);
+      }
+      done = 1;
+      break;
+    }
+    case avm_opc_calli:
+      call_helper(&c, pc, (const void *) helper_call, op.address, pc);
+      exit_to(&c, op.address);
+      done = 1;
+      break;
+    case avm_opc_call:
+      if (c.count > 0 && c.items[c.count - 1].kind == ITEM_CONST) {
+        avm_size_t target = (avm_size_t) pop_item(&c).value;
+        track(&c, 1, 0);
+        call_helper(&c, pc, (const void *) helper_call, target, pc);
+        exit_to(&c, target);
+        done = 1;
+        break;
+      }
+      // the target is only known at runtime
+      // fall through
+    default:
+      // ret, quit and errors
+      if (compiled == 0) {
+        return 0;
+      }
+      flush(&c);
+      bail(&c, pc);
+      done = 1;
+      break;
+    }
+    compiled += 1;
+  }
+
+  if (-c.lowest > MAX_DEPTH_DIFF || c.highest > MAX_DEPTH_DIFF) {
+    return 0;
+  }
+  patch32(e, need_at, (uint32_t) (int32_t) (8 * c.lowest));
+  patch32(e, grow_at, (uint32_t) (int32_t) (8 * c.highest));
+  land(e, underrun);
+  land(e, overflow);
+  bail(&c, block->start);
+
+  if (e->len > e->cap) {
+    return 0;
+  }
+
+  jit->blocks[index].code = jit->region + jit->used;
+  jit->used = (e->len + 15) & ~(size_t) 15;
+  return 1;
+}
+
+/* The code between `from` and the end of the region becomes writable while
+ * `writable` is set, and executable otherwise.
+ */
+static int protect(AVM_Jit *jit, size_t from, int writable)
+{
+  size_t start = from / jit->page_size * jit->page_size;
+  return mprotect(jit->region + start, CODE_RESERVE - start,
+                  writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC);
+}
+
+/* The entry and exits shared by all blocks */
+static void emit_stubs(AVM_Jit *jit)
+{
+  Emitter e = { .buf = jit->region, .len = 0, .cap = CODE_RESERVE };
+
+  // int enter(Frame *frame, const void *code)
+  push_reg(&e, RBX);
+  push_reg(&e, R12);
+  push_reg(&e, R13);
+  push_reg(&e, R14);
+  push_reg(&e, R15);
+  op_rr(&e, 1, 0x89, RDI, RBX);
+  op_rm(&e, 1, 0x8B, R12, RBX, offsetof(Frame, sp));
+  op_rm(&e, 1, 0x8B, R15, RBX, offsetof(Frame, entries));
+  op_rr(&e, 0, 0xFF, 4, RSI);                 // jmp rsi
+
+  jit->exit_bail = e.len;
+  mov_ri(&e, RAX, AVM_RUN_BAILED);
+  size_t to_common = e.len + 1;
+  jmp(&e, 0);
+
+  // the check borrowed from a budget of 0
+  jit->exit_budget = e.len;
+  op_rm(&e, 1, 0xC7, 0, RBX, offsetof(Frame, budget));
+  u32(&e, 0);
+  mov_ri(&e, RAX, AVM_RUN_BUDGET);
+  size_t budget_to_common = e.len + 1;
+  jmp(&e, 0);
+
+  jit->exit_continue = e.len;
+  mov_ri(&e, RAX, AVM_RUN_EXITED);
+
+  jit->exit_common = e.len;
+  patch32(&e, to_common, (uint32_t) (e.len - (to_common + 4)));
+  patch32(&e, budget_to_common,
+          (uint32_t) (e.len - (budget_to_common + 4)));
+  op_rm(&e, 1, 0x89, R12, RBX, offsetof(Frame, sp));
+  pop_reg(&e, R15);
+  pop_reg(&e, R14);
+  pop_reg(&e, R13);
+  pop_reg(&e, R12);
+  pop_reg(&e, RBX);
+  byte(&e, 0xC3);
+
+  jit->enter = (int (*)(Frame *, const void *)) (void *) jit->region;
+  jit->used = (e.len + 15) & ~(size_t) 15;
+}
+
+static void reject(AVM_Context *ctx, size_t index)
+{
+  AVM_Jit *jit = ctx->jit;
+  jit->blocks[index].state = BLOCK_REJECTED;
+  jit->entries[index] = jit->region + jit->exit_continue;
+  ctx->code[ctx->blocks[index].start].flags &= (uint8_t) ~AVM_DEC_ENGINE;
+  jit->epoch += 1;
+}
+
+int avm_jit_enable(AVM_Context *ctx, int enabled)
+{
+  avm__jit_free(ctx);
+  avm__ir_free(ctx);
+  if (!enabled) {
+    return 0;
+  }
+  if (avm__code_own(ctx)) {
+    return 1;
+  }
+
+  AVM_Jit *jit = my_calloc(1, sizeof(AVM_Jit));
+  if (jit == NULL) {
+    return avm__error(ctx, "unable to allocate JIT compiler");
+  }
+
+  jit->page_size = (size_t) sysconf(_SC_PAGESIZE);
+  jit->region = mmap(NULL, CODE_RESERVE, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  jit->entries = my_malloc((ctx->block_count + 1) * sizeof(void *));
+  jit->blocks = my_calloc(ctx->block_count + 1, sizeof(Jit_Block));
+
+  if (jit->region == MAP_FAILED || jit->entries == NULL ||
+      jit->blocks == NULL || protect(jit, 0, 1)) {
+    if (jit->region != MAP_FAILED) {
+      munmap(jit->region, CODE_RESERVE);
+    }
+    my_free(jit->entries);
+    my_free(jit->blocks);
+    my_free(jit);
+    return avm__error(ctx, "unable to allocate JIT code memory");
+  }
+
+  emit_stubs(jit);
+  protect(jit, 0, 0);
+
+  for (size_t i = 0; i < ctx->block_count; ++i) {
+    jit->entries[i] = jit->region + jit->exit_continue;
+  }
+
+  ctx->jit = jit;
+  avm__mark_blocks(ctx, 1);
+  return 0;
+}
+
+int avm__jit_run(AVM_Context *ctx, avm_size_t *pc)
+{
+  AVM_Jit *jit = ctx->jit;
+  int index = avm__find_block(ctx, *pc, 0);
+  if (index < 0) {
+    return AVM_RUN_BAILED;
+  }
+
+  Jit_Block *block = &jit->blocks[index];
+  if (block->state == BLOCK_COLD) {
+    if (++block->count < AVM_JIT_THRESHOLD) {
+      return AVM_RUN_BAILED;
+    }
+
+    // compile() moves `used` past the new code
+    size_t from = jit->used;
+    int compiled = 0;
+    if (protect(jit, from, 1) == 0) {
+      compiled = compile(ctx, jit, (size_t) index);
+      protect(jit, from, 0);
+    }
+    if (!compiled) {
+      reject(ctx, (size_t) index);
+      return AVM_RUN_BAILED;
+    }
+
+    block->state = BLOCK_NATIVE;
+    jit->entries[index] = block->code;
+  }
+
+  if (block->state != BLOCK_NATIVE) {
+    return AVM_RUN_BAILED;
+  }
+
+  Frame frame = {
+    .ctx = ctx,
+    .entries = (void *const *) jit->entries,
+    .budget = ctx->budget,
+  };
+  ctx_to_frame(&frame);
+  int status = jit->enter(&frame, block->code);
+  frame_to_ctx(&frame);
+  ctx->budget = frame.budget;
+  *pc = frame.pc;
+  return status;
+}
+
+void avm__jit_invalidate(AVM_Context *ctx, avm_size_t loc)
+{
+  int index = avm__find_block(ctx, loc, 1);
+  if (index >= 0 && ctx->jit->blocks[index].state != BLOCK_REJECTED) {
+    reject(ctx, (size_t) index);
+  }
+}
+
+void avm__jit_free(AVM_Context *ctx)
+{
+  AVM_Jit *jit = ctx->jit;
+  if (jit == NULL) {
+    return;
+  }
+
+  avm__mark_blocks(ctx, 0);
+  munmap(jit->region, CODE_RESERVE);
+  my_free(jit->entries);
+  my_free(jit->blocks);
+  my_free(ctx->jit);
+}
+
+#else
+
+int avm_jit_enable(AVM_Context *ctx, int enabled)
+{
+  if (enabled) {
+    return avm__error(ctx, "the JIT compiler isn't available in this build");
+  }
+  return 0;
+}
+
+#endif /* AVM_JIT */
@@ -0,0 +1,92 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "avm.h"
+#include "avm_util.h"
+#include "avm_def.h"
+
+/* Limits are checked where a context grows: guest memory in avm_memory.c
+ * when it takes a page or table of its own, the operand stack in
+ * avm_stack.c and the call stack in avm__push_call when they run out of
+ * room. The stacks are never given more room than their limit, so the
+ * engines' own capacity checks end up at those places at the limit.
+ */
+
+int avm_init_limited(AVM_Context *ctx, const avm_int *initial_mem,
+                     size_t oplen, const AVM_Limits *limits)
+{
+  if (avm_init(ctx, initial_mem, oplen)) {
+    return 1;
+  }
+  return avm_set_limits(ctx, limits);
+}
+
+/* Shrinks the call stack to what its limit allows */
+static int fit_call_stack(AVM_Context *ctx)
+{
+  avm_size_t depth = ctx->limits.call_depth;
+  size_t cap = (size_t) depth + 1;
+  if (depth == 0 || ctx->call_stack_cap <= cap) {
+    return 0;
+  }
+  if (ctx->call_stack_size > depth) {
+    return avm__trap(ctx, AVM_TRAP_CALL_DEPTH, "Call stack holds %u frames, "
+                     "more than the limit of %u", ctx->call_stack_size, depth);
+  }
+
+  AVM_Stack_Frame *frames = my_realloc(ctx->call_stack,
+                                       cap * sizeof(AVM_Stack_Frame));
+  if (frames == NULL) {
+    return avm__error(ctx, "Unable to reallocate call stack of %zu elements",
+                      cap);
+  }
+  ctx->call_stack = frames;
+  ctx->call_stack_cap = (avm_size_t) cap;
+  return 0;
+}
+
+int avm_set_limits(AVM_Context *ctx, const AVM_Limits *limits)
+{
+  if (limits != NULL) {
+    ctx->limits = *limits;
+  } else {
+    ctx->limits = (AVM_Limits) { 0 };
+  }
+
+  if (ctx->limits.memory_pages != 0 &&
+      ctx->pages > ctx->limits.memory_pages) {
+    return avm__trap(ctx, AVM_TRAP_MEMORY_PAGES, "Guest memory holds %zu "
+                     "pages, more than the limit of %zu", ctx->pages,
+                     ctx->limits.memory_pages);
+  }
+  if (fit_call_stack(ctx) || avm__stack_fit(ctx)) {
+    return 1;
+  }
+  if (ctx->limits.bytes != 0 && avm__bytes(ctx) > ctx->limits.bytes) {
+    return avm__trap(ctx, AVM_TRAP_BYTES, "Context holds %zu bytes, more "
+                     "than the limit of %zu", avm__bytes(ctx),
+                     ctx->limits.bytes);
+  }
+  return 0;
+}
+
+AVM_Trap avm_trap(const AVM_Context *ctx)
+{
+  return ctx->trap;
+}
+
+size_t avm__bytes(const AVM_Context *ctx)
+{
+  return ctx->memory_bytes + avm__stack_bytes(ctx) +
+         (size_t) ctx->call_stack_cap * sizeof(AVM_Stack_Frame);
+}
+
+int avm__limit_bytes(AVM_Context *ctx, size_t more)
+{
+  size_t limit = ctx->limits.bytes;
+  if (limit != 0 && avm__bytes(ctx) + more > limit) {
+    return avm__trap(ctx, AVM_TRAP_BYTES, "Unable to allocate %zu bytes: "
+                     "limit of %zu bytes reached", more, limit);
+  }
+  return 0;
+}
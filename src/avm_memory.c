@@ -0,0 +1,301 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "avm.h"
+#include "avm_util.h"
+#include "avm_def.h"
+
+/* Guest memory is a two level table of fixed size pages covering the whole
+ * 32 bit address space. Every table entry starts out pointing at a single
+ * page of zeroes shared by all contexts, and every directory entry at a
+ * table of those, so reads never need to check for missing pages. A page
+ * is only allocated when something other than 0 is written to it, so
+ * memory use follows the pages a program touches rather than the highest
+ * address it uses.
+ *
+ * Tables and pages count the directories and tables that point at them, so
+ * that avm_fork can share them. A shared table or page is copied the first
+ * time it's written to through avm__page_write. The zero page and pages of
+ * a mapped image aren't counted, they are borrowed and always copied.
+ *
+ * A context also counts the tables and pages of its own it points at, for
+ * AVM_Limits. Pages it shares with forks count for each of them.
+ */
+
+typedef struct {
+  size_t refs;
+  avm_int words[AVM_PAGE_WORDS];
+} Page;
+
+typedef struct {
+  size_t refs;
+  avm_int *pages[AVM_TABLE_SIZE];
+} Table;
+
+#define PAGE_OF(p)  ((Page *) ((char *) (p) - offsetof(Page, words)))
+#define TABLE_OF(p) ((Table *) ((char *) (p) - offsetof(Table, pages)))
+
+static Page zero_page;
+static Table zero_table;
+
+#define DIR_INDEX(loc)   ((loc) >> (AVM_PAGE_BITS + AVM_TABLE_BITS))
+#define TABLE_INDEX(loc) (((loc) >> AVM_PAGE_BITS) & (AVM_TABLE_SIZE - 1))
+
+static void zero_table_init(void)
+{
+  // 0 untouched, 1 being filled, 2 ready
+  static int state;
+  if (__atomic_load_n(&state, __ATOMIC_ACQUIRE) == 2) {
+    return;
+  }
+
+  int expected = 0;
+  if (__atomic_compare_exchange_n(&state, &expected, 1, 0, __ATOMIC_ACQ_REL,
+                                  __ATOMIC_ACQUIRE)) {
+    for (size_t i = 0; i < AVM_TABLE_SIZE; ++i) {
+      zero_table.pages[i] = zero_page.words;
+    }
+    __atomic_store_n(&state, 2, __ATOMIC_RELEASE);
+    return;
+  }
+
+  while (__atomic_load_n(&state, __ATOMIC_ACQUIRE) != 2) {
+    // another context is filling it in
+  }
+}
+
+int avm__memory_init(AVM_Context *ctx)
+{
+  zero_table_init();
+  for (size_t i = 0; i < AVM_DIR_SIZE; ++i) {
+    ctx->memory[i] = zero_table.pages;
+  }
+  ctx->image = NULL;
+  ctx->pages = 0;
+  ctx->tables = 0;
+  ctx->memory_bytes = 0;
+  return 0;
+}
+
+static int borrowed(const AVM_Context *ctx, const avm_int *words)
+{
+  return words == zero_page.words ||
+         (ctx->image != NULL && words >= ctx->image->words &&
+          words < ctx->image->end);
+}
+
+/* Counts `pages` more pages and `tables` more tables for `ctx`, failing if
+ * that would be beyond its limits
+ */
+static int account(AVM_Context *ctx, int pages, int tables, avm_size_t loc)
+{
+  if (pages > 0 && ctx->limits.memory_pages != 0 &&
+      ctx->pages + (size_t) pages > ctx->limits.memory_pages) {
+    return avm__trap(ctx, AVM_TRAP_MEMORY_PAGES, "Unable to write to %x: "
+                     "limit of %zu memory pages reached", loc,
+                     ctx->limits.memory_pages);
+  }
+  size_t bytes = (size_t) pages * sizeof(Page) +
+                 (size_t) tables * sizeof(Table);
+  if ((pages > 0 || tables > 0) && avm__limit_bytes(ctx, bytes)) {
+    return 1;
+  }
+
+  // negative counts wrap around to the same result
+  ctx->pages += (size_t) pages;
+  ctx->tables += (size_t) tables;
+  ctx->memory_bytes += bytes;
+  return 0;
+}
+
+static void page_release(const AVM_Context *ctx, avm_int *words)
+{
+  if (borrowed(ctx, words)) {
+    return;
+  }
+  Page *page = PAGE_OF(words);
+  if (__atomic_sub_fetch(&page->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(page);
+  }
+}
+
+static void table_release(const AVM_Context *ctx, avm_int **pages)
+{
+  if (pages == zero_table.pages) {
+    return;
+  }
+  Table *table = TABLE_OF(pages);
+  if (__atomic_sub_fetch(&table->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+    return;
+  }
+
+  for (size_t i = 0; i < AVM_TABLE_SIZE; ++i) {
+    page_release(ctx, table->pages[i]);
+  }
+  free(table);
+}
+
+void avm__memory_free(AVM_Context *ctx)
+{
+  for (size_t i = 0; i < AVM_DIR_SIZE; ++i) {
+    table_release(ctx, ctx->memory[i]);
+    ctx->memory[i] = zero_table.pages;
+  }
+  avm__image_release(ctx->image);
+  ctx->image = NULL;
+  ctx->pages = 0;
+  ctx->tables = 0;
+  ctx->memory_bytes = 0;
+}
+
+void avm__memory_share(const AVM_Context *from, AVM_Context *to)
+{
+  for (size_t i = 0; i < AVM_DIR_SIZE; ++i) {
+    avm_int **pages = from->memory[i];
+    if (pages != zero_table.pages) {
+      __atomic_add_fetch(&TABLE_OF(pages)->refs, 1, __ATOMIC_RELAXED);
+    }
+    to->memory[i] = pages;
+  }
+
+  to->image = from->image;
+  if (to->image != NULL) {
+    __atomic_add_fetch(&to->image->refs, 1, __ATOMIC_RELAXED);
+  }
+  to->pages = from->pages;
+  to->tables = from->tables;
+  to->memory_bytes = from->memory_bytes;
+}
+
+/* A table only `ctx` points at, holding the same pages as `pages` */
+static avm_int **table_own(AVM_Context *ctx, avm_int **pages, avm_size_t loc)
+{
+  if (pages != zero_table.pages &&
+      __atomic_load_n(&TABLE_OF(pages)->refs, __ATOMIC_ACQUIRE) == 1) {
+    return pages;
+  }
+  int fresh = pages == zero_table.pages;
+  if (fresh && account(ctx, 0, 1, loc)) {
+    return NULL;
+  }
+
+  Table *copy = my_malloc(sizeof(Table));
+  if (copy == NULL) {
+    account(ctx, 0, -fresh, loc);
+    avm__error(ctx, "unable to allocate memory table for %x", loc);
+    return NULL;
+  }
+  copy->refs = 1;
+  for (size_t i = 0; i < AVM_TABLE_SIZE; ++i) {
+    avm_int *words = pages[i];
+    if (!borrowed(ctx, words)) {
+      __atomic_add_fetch(&PAGE_OF(words)->refs, 1, __ATOMIC_RELAXED);
+    }
+    copy->pages[i] = words;
+  }
+  table_release(ctx, pages);
+  return copy->pages;
+}
+
+avm_int *avm__page_write(AVM_Context *ctx, avm_size_t loc)
+{
+  avm_int ***table = &ctx->memory[DIR_INDEX(loc)];
+  avm_int **pages = table_own(ctx, *table, loc);
+  if (pages == NULL) {
+    return NULL;
+  }
+  *table = pages;
+
+  avm_int **words = &pages[TABLE_INDEX(loc)];
+  if (!borrowed(ctx, *words) &&
+      __atomic_load_n(&PAGE_OF(*words)->refs, __ATOMIC_ACQUIRE) == 1) {
+    return *words;
+  }
+
+  int counted = borrowed(ctx, *words);
+  if (counted && account(ctx, 1, 0, loc)) {
+    return NULL;
+  }
+
+  Page *fresh;
+  if (*words == zero_page.words) {
+    fresh = my_calloc(1, sizeof(Page));
+  } else {
+    fresh = my_malloc(sizeof(Page));
+  }
+  if (fresh == NULL) {
+    account(ctx, -counted, 0, loc);
+    avm__error(ctx, "unable to allocate memory page for %x", loc);
+    return NULL;
+  }
+  if (*words != zero_page.words) {
+    memcpy(fresh->words, *words, sizeof(fresh->words));
+    page_release(ctx, *words);
+  }
+  fresh->refs = 1;
+  *words = fresh->words;
+  return *words;
+}
+
+int avm__page_is_zero(const AVM_Context *ctx, avm_size_t loc)
+{
+  return avm__page(ctx, loc) == zero_page.words;
+}
+
+/* Points the page holding `to` at `words`, which it takes a reference to */
+static int page_set(AVM_Context *ctx, avm_size_t to, avm_int *words)
+{
+  avm_int ***table = &ctx->memory[DIR_INDEX(to)];
+  avm_int **pages = table_own(ctx, *table, to);
+  if (pages == NULL) {
+    return 1;
+  }
+  *table = pages;
+
+  avm_int *old = pages[TABLE_INDEX(to)];
+  if (account(ctx, !borrowed(ctx, words) - !borrowed(ctx, old), 0, to)) {
+    return 1;
+  }
+  if (!borrowed(ctx, words)) {
+    __atomic_add_fetch(&PAGE_OF(words)->refs, 1, __ATOMIC_RELAXED);
+  }
+  page_release(ctx, pages[TABLE_INDEX(to)]);
+  pages[TABLE_INDEX(to)] = words;
+  return 0;
+}
+
+int avm__page_clear(AVM_Context *ctx, avm_size_t loc)
+{
+  if (avm__page_is_zero(ctx, loc)) {
+    return 0;
+  }
+  return page_set(ctx, loc, zero_page.words);
+}
+
+int avm__page_alias(AVM_Context *ctx, avm_size_t to, avm_size_t from)
+{
+  avm_int *words = (avm_int *) avm__page(ctx, from);
+  if (avm__page(ctx, to) == words) {
+    return 0;
+  }
+  return page_set(ctx, to, words);
+}
+
+int avm__memory_map(AVM_Context *ctx, AVM_Image *image)
+{
+  ctx->image = image;
+
+  for (const avm_int *words = image->words; words < image->end;
+       words += AVM_PAGE_WORDS) {
+    avm_size_t loc = (avm_size_t) (words - image->words);
+    avm_int ***table = &ctx->memory[DIR_INDEX(loc)];
+    avm_int **pages = table_own(ctx, *table, loc);
+    if (pages == NULL) {
+      return 1;
+    }
+    *table = pages;
+    pages[TABLE_INDEX(loc)] = (avm_int *) words;
+  }
+  return 0;
+}
@@ -3,7 +3,6 @@
 #include "avm_util.h"
 #include <stdio.h>
 #include <string.h>
-#include <ctype.h>
 #include <stdlib.h>
 
 #define SLACK_SIZE 127
@@ -23,245 +22,943 @@ typedef struct {
   };
 } Token;
 
-static void skip_whitespace (const char **input)
+/* The part of the input still to be lexed. There's no NUL before `end`.
+ * `hit_end` is set once a token ran into `end`, where more input could
+ * have made it a different one, and `run` to what the first one to do so
+ * was reading.
+ */
+typedef struct {
+  const char *pos;
+  const char *end;
+  int hit_end;
+  int run;
+} Lexer;
+
+/* What a token that ran into the end was reading. More input of that kind
+ * still runs into the end, so it can't change the outcome.
+ */
+enum { run_any, run_space, run_digits, run_letters, run_line };
+
+static void hit_end(Lexer *lx, int run)
 {
-  while (isspace(**input)) {
-    *input += 1;
+  if (!lx->hit_end) {
+    lx->hit_end = 1;
+    lx->run = run;
   }
 }
 
-static void continue_until_newline (const char **input)
+static inline int is_space(char c)
+{
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static void skip_whitespace (Lexer *lx)
 {
-  while (*input[0] != '\n' && *input[0] != '\0') {
-    *input += 1;
+  while (lx->pos < lx->end && is_space(*lx->pos)) {
+    lx->pos += 1;
   }
 }
 
-static int try_lex_operation (const char **input, Token *result)
+static void continue_until_newline (Lexer *lx)
 {
-  static const char *str_to_opcode[opcode_count] = {
-    "error",
-    "load",
-    "store",
-    "push",
-    "add",
-    "sub",
-    "mul",
-    "div",
-    "and",
-    "or",
-    "xor",
-    "shr",
-    "shl",
-    "calli",
-    "call",
-    "ret",
-    "jmpez",
-    "quit",
-    "dup",
-  };
+  const char *newline = memchr(lx->pos, '\n', (size_t) (lx->end - lx->pos));
+  if (newline == NULL) {
+    hit_end(lx, run_line);
+  }
+  lx->pos = newline != NULL ? newline : lx->end;
+}
 
-  char *operation = my_malloc(SLACK_SIZE);
-  size_t opcap = SLACK_SIZE;
-  size_t oplen = 0;
+static inline int hex_digit(char c)
+{
+  unsigned digit = (unsigned) (c - '0');
+  if (digit < 10) {
+    return (int) digit;
+  }
+  digit = (unsigned) ((c | 0x20) - 'a');
+  return digit < 6 ? (int) digit + 10 : -1;
+}
 
-  while ((*input[0] >= 'a' && *input[0] <= 'z') ||
-         (*input[0] >= 'A' && *input[0] <= 'Z')) {
-    operation[oplen] = *input[0];
+/* Reads a number the way `scanf(" %lx")` does: whitespace, a sign, an
+ * optional 0x and hex digits, saturating on overflow. Leaves `lx` alone and
+ * returns 0 if there are no digits.
+ */
+static int scan_hex (Lexer *lx, avm_int *value)
+{
+  const char *p = lx->pos;
+  const char *end = lx->end;
+  while (p < end && is_space(*p)) {
+    p += 1;
+  }
+  const char *spaced = p;
 
-    *input += 1;
-    oplen += 1;
+  int negative = 0;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = *p == '-';
+    p += 1;
+  }
+  const char *digits = p;
+  if (end - p >= 2 && p[0] == '0' && (p[1] | 0x20) == 'x') {
+    // like scanf, takes the 0x even if no digits follow and reads it as 0
+    p += 2;
+    digits = p - 1;
+  }
 
-    if (oplen == opcap) {
-      opcap += SLACK_SIZE;
-      operation = my_realloc(operation, opcap);
-    }
+  avm_int result = 0;
+  int overflow = 0;
+  int digit;
+  while (p < end && (digit = hex_digit(*p)) >= 0) {
+    overflow |= result >> 60 != 0;
+    result = result << 4 | (avm_int) digit;
+    p += 1;
+  }
+  if (p == end) {
+    hit_end(lx, spaced == end ? run_space : p > digits ? run_digits : run_any);
+  }
+  if (p == digits) {
+    return 0;
+  }
+
+  if (overflow) {
+    result = AVM_INT_MAX;
+  } else if (negative) {
+    result = -result;
+  }
+  *value = result;
+  lx->pos = p;
+  return 1;
+}
+
+/* Opcodes by a perfect hash of their first two and last two letters, see
+ * `opcode_hash`
+ */
+#define OPCODE_SLOTS 64
+#define OPCODE_MAX_LEN 5
+
+static const struct {
+  const char *name;
+  AVM_Opcode opc;
+} opcode_table[OPCODE_SLOTS] = {
+  [ 4] = { "shr",   avm_opc_shr   },
+  [ 5] = { "load",  avm_opc_load  },
+  [ 6] = { "vadd",  avm_opc_vadd  },
+  [ 7] = { "calli", avm_opc_calli },
+  [11] = { "jmpez", avm_opc_jmpez },
+  [14] = { "vshl",  avm_opc_vshl  },
+  [16] = { "call",  avm_opc_call  },
+  [17] = { "error", avm_opc_error },
+  [19] = { "store", avm_opc_store },
+  [20] = { "and",   avm_opc_and   },
+  [21] = { "sub",   avm_opc_sub   },
+  [23] = { "vsub",  avm_opc_vsub  },
+  [27] = { "push",  avm_opc_push  },
+  [31] = { "copy",  avm_opc_copy  },
+  [32] = { "vshr",  avm_opc_vshr  },
+  [33] = { "dup",   avm_opc_dup   },
+  [34] = { "add",   avm_opc_add   },
+  [35] = { "quit",  avm_opc_quit  },
+  [36] = { "vand",  avm_opc_vand  },
+  [37] = { "or",    avm_opc_or    },
+  [38] = { "fill",  avm_opc_fill  },
+  [39] = { "mul",   avm_opc_mul   },
+  [41] = { "vmul",  avm_opc_vmul  },
+  [45] = { "vor",   avm_opc_vor   },
+  [49] = { "xor",   avm_opc_xor   },
+  [50] = { "shl",   avm_opc_shl   },
+  [55] = { "div",   avm_opc_div   },
+  [57] = { "ret",   avm_opc_ret   },
+  [63] = { "vxor",  avm_opc_vxor  },
+};
+
+static inline unsigned opcode_hash(const char *word, size_t len)
+{
+  unsigned first = (unsigned char) word[0];
+  unsigned second = (unsigned char) word[1];
+  unsigned penultimate = (unsigned char) word[len - 2];
+  unsigned last = (unsigned char) word[len - 1];
+  return (2 * first + 2 * second + 3 * penultimate + 3 * last) &
+         (OPCODE_SLOTS - 1);
+}
 
-    operation[oplen] = '\0'; // always have a trailing null
+static int try_lex_operation (Lexer *lx, Token *result)
+{
+  const char *word = lx->pos;
+  const char *p = word;
+  while (p < lx->end && ((*p | 0x20) >= 'a' && (*p | 0x20) <= 'z')) {
+    p += 1;
   }
 
-  if (oplen == 0) { 
-    my_free(operation);
+  size_t len = (size_t) (p - word);
+  if (p == lx->end) {
+    hit_end(lx, run_letters);
+  }
+  if (len < 2 || len > OPCODE_MAX_LEN) {
     return 0;
   }
 
-  for (AVM_Opcode i = 0; i < opcode_count; ++i) {
-    if (strcmp(str_to_opcode[i], operation) == 0) {
-      *result = (Token) { .type = tt_operation, .opc = i };
-      my_free(operation);
-      return 1;
-    }
+  unsigned slot = opcode_hash(word, len);
+  const char *name = opcode_table[slot].name;
+  if (name == NULL || strlen(name) != len || memcmp(name, word, len) != 0) {
+    return 0;
   }
 
-  my_free(operation);
-  *input -= oplen;
-  return 0;
+  *result = (Token) { .type = tt_operation, .opc = opcode_table[slot].opc };
+  lx->pos = p;
+  return 1;
+}
+
+static int lex_error(Token *result)
+{
+  *result = (Token) { .type = tt_error, .message = "unkown token" };
+  return 0; // always succeeds
 }
 
-static int try_lex_num (const char **input, Token *result)
+/* A label is a number with a trailing `:`, and takes precedence over an
+ * operation, which takes precedence over a number. Numbers skip whitespace
+ * in front of them, operations don't.
+ */
+static int lex_input(Lexer *lx, Token *result)
 {
-  avm_int target;
-  int len;
-  if (sscanf(*input, " %lx%n", &target, &len) == 1) {
-    *result = (Token) { .type = tt_num, .value = target };
-    *input += len;
+  // unusual, returns 0 on failure and 1 on success
+  Lexer num = *lx;
+  avm_int value;
+  int is_num = scan_hex(&num, &value);
+  if (num.hit_end) {
+    hit_end(lx, num.run);
+  }
+
+  if (is_num && num.pos < num.end && *num.pos == ':') {
+    *result = (Token) { .type = tt_label, .value = value };
+    lx->pos = num.pos + 1;
+    return 1;
+  }
+  if (try_lex_operation(lx, result)) {
     return 1;
   }
+  if (is_num) {
+    *result = (Token) { .type = tt_num, .value = value };
+    lx->pos = num.pos;
+    return 1;
+  }
+  if (lx->pos == lx->end) {
+    *result = (Token) { .type = tt_eof };
+    hit_end(lx, run_space);
+    return 1;
+  }
+  return lex_error(result);
+}
+
+/* Parsing runs a statement at a time: an operation and its operands up to
+ * the end of the line, or a label. Words are only emitted once a statement
+ * is complete, so that a streaming parser can drop one that ran into the
+ * end of a chunk and parse it again once more input arrived.
+ */
+struct AVM_Parser_s {
+  AVM_Parse_Sink sink;
+  void *user;
+
+  /* without a sink, words go here, everything before `zeroed` is set */
+  avm_int *image;
+  size_t cap;
+  size_t zeroed;
+
+  size_t memory_loc;
+  size_t offset;     /* of the first byte not consumed yet */
+  int ended;         /* a NUL ended the input */
+  int started;       /* whitespace is skipped after the first statement */
+  size_t at;         /* offset of the statement being emitted */
+  size_t labels;     /* labels parsed so far */
+  int done;          /* parsed up to the end of the input */
+  char *error;
+
+  /* the input of an unfinished statement and what was fed after it */
+  char *carry;
+  size_t carry_len;
+  size_t carry_cap;
+  int run;           /* what the statement was reading at the end of it */
+};
+
+enum { st_done, st_label, st_more, st_eof, st_error };
+
+static int fail(AVM_Parser *parser, size_t at, const char *message)
+{
+  parser->error = afmt("%zu: %s", at, message);
+  return st_error;
+}
 
+/* Makes room for the image to hold `end` words, zeroing what wasn't set */
+static int reserve(AVM_Parser *parser, size_t end)
+{
+  if (end > parser->cap || parser->image == NULL) {
+    size_t newcap = parser->cap * 2 > end + SLACK_SIZE ?
+                    parser->cap * 2 : end + SLACK_SIZE;
+    avm_int *image = my_realloc(parser->image, newcap * sizeof(avm_int));
+    if (image == NULL) {
+      return 1;
+    }
+    parser->image = image;
+    parser->cap = newcap;
+  }
   return 0;
 }
 
-static int try_lex_label (const char **input, Token *result)
+static int emit(AVM_Parser *parser, const avm_int *words, size_t count)
 {
-  // number with trailing `:`
-  int len;
-  avm_int target;
-  if (sscanf(*input, " %lx%n", &target, &len) == 1 &&
-      (*input)[len] == ':') {
-    *result = (Token) { .type = tt_label, .value = target };
-    *input += len + 1;
-    return 1;
+  size_t loc = parser->memory_loc;
+  if (parser->sink != NULL) {
+    return parser->sink(parser->user, (avm_size_t) loc, words, count);
   }
 
+  if (reserve(parser, loc + count)) {
+    return 1;
+  }
+  if (loc > parser->zeroed) {
+    memset(parser->image + parser->zeroed, 0,
+           (loc - parser->zeroed) * sizeof(avm_int));
+  }
+  memcpy(parser->image + loc, words, count * sizeof(avm_int));
+  if (loc + count > parser->zeroed) {
+    parser->zeroed = loc + count;
+  }
   return 0;
 }
 
-static int try_lex_eof (const char **input, Token *result)
+/* Parses the statement at `lx->pos`. Unless `final` is set, a statement
+ * that ran into the end of the input is left alone, with st_more.
+ */
+static int parse_statement(AVM_Parser *parser, Lexer *lx, const char *base,
+                           int final)
 {
-  if (*input[0] == '\0') {
-    *result = (Token) { .type = tt_eof };
+  Lexer start = *lx;
+  Token nextTok;
+  avm_int words[2];
+  size_t count = 0;
+  int status = st_done;
+  lx->hit_end = 0;
+
+  // errors count from the start of the input
+#define AT ((size_t) (lx->pos - base) + parser->offset)
+
+  lex_input(lx, &nextTok);
+
+  if (nextTok.type == tt_label) {
+    if (nextTok.value > AVM_SIZE_MAX) {
+      status = fail(parser, AT, "label address is out of bounds");
+    } else {
+      status = st_label;
+    }
+  } else if (nextTok.type == tt_eof) {
+    status = st_eof;
+  } else if (nextTok.type != tt_operation) {
+    status = fail(parser, AT, "unknown error\n");
+  } else if (nextTok.opc == avm_opc_load || nextTok.opc == avm_opc_store) {
+    Token size;
+    Token address;
+    if (!lex_input(lx, &size) || size.type != tt_num) {
+      status = fail(parser, AT, "expected size\n");
+    } else if (!lex_input(lx, &address) || address.type != tt_num) {
+      status = fail(parser, AT, "expected address\n");
+    } else if (size.value > (1 << 24) || address.value > AVM_SIZE_MAX) {
+      status = fail(parser, AT, "size or value out of bounds\n");
+    } else {
+      words[count++] = ((AVM_Operation) {
+        .kind = nextTok.opc,
+        .size = (avm_size_t) size.value,
+        .address = (avm_size_t) address.value
+      }).value;
+    }
+  } else if (nextTok.opc >= avm_opc_vadd && nextTok.opc <= avm_opc_vshl) {
+    Token lanes;
+    if (!lex_input(lx, &lanes) || lanes.type != tt_num) {
+      status = fail(parser, AT, "expected lane count\n");
+    } else if (lanes.value >= (1 << 24)) {
+      status = fail(parser, AT, "lane count out of bounds\n");
+    } else {
+      words[count++] = ((AVM_Operation) {
+        .kind = nextTok.opc,
+        .size = (avm_size_t) lanes.value
+      }).value;
+    }
+  } else if (nextTok.opc == avm_opc_calli || nextTok.opc == avm_opc_jmpez) {
+    Token address;
+    if (!lex_input(lx, &address) || address.type != tt_num) {
+      status = fail(parser, AT, "expected address\n");
+    } else {
+      words[count++] = ((AVM_Operation) {
+        .kind = nextTok.opc,
+        .address = (avm_size_t) address.value
+      }).value;
+    }
+  } else if (nextTok.opc == avm_opc_push) {
+    Token value;
+    if (!lex_input(lx, &value) || value.type != tt_num) {
+      parser->error = afmt("%zu: expected value to push, got %d\n", AT,
+                           value.type);
+      status = st_error;
+    } else {
+      words[count++] = ((AVM_Operation) { .kind = avm_opc_push }).value;
+      words[count++] = value.value;
+    }
+  } else {
+    words[count++] = ((AVM_Operation) { .kind = nextTok.opc }).value;
+  }
+
+  if (status == st_done) {
+    continue_until_newline(lx);
+  }
+
+  if (lx->hit_end && !final) {
+    // more input could change what this is, the error too
+    my_free(parser->error);
+    parser->run = lx->run;
+    *lx = start;
+    return st_more;
+  }
+
+  if (status == st_label) {
+    parser->memory_loc = (avm_size_t) nextTok.value;
+    parser->labels += 1;
+  } else if (status == st_done) {
+    parser->at = (size_t) (start.pos - base) + parser->offset;
+    if (emit(parser, words, count)) {
+      return fail(parser, AT, parser->sink != NULL ? "stopped by the sink\n" :
+                  "Allocation failed\n");
+    }
+    parser->memory_loc += count;
+  }
+#undef AT
+
+  if (status == st_done || status == st_label) {
+    // whitespace can be skipped across chunks, it's left out of `hit_end`
+    skip_whitespace(lx);
+    parser->started = 1;
+  }
+  return status;
+}
+
+/* Parses whole statements of `input`, returning how much of it they took
+ * up in `consumed`
+ */
+static int parse_buffer(AVM_Parser *parser, const char *input, size_t len,
+                        int final, size_t *consumed)
+{
+  Lexer lx = { .pos = input, .end = input + len };
+  int status;
+
+  if (parser->started) {
+    skip_whitespace(&lx);
+  }
+
+  do {
+    status = parse_statement(parser, &lx, input, final);
+  } while (status == st_done || status == st_label);
+
+  *consumed = (size_t) (lx.pos - input);
+  parser->offset += *consumed;
+  if (status == st_eof) {
+    parser->done = 1;
+  }
+  return status == st_error;
+}
+
+static void parser_init(AVM_Parser *parser, AVM_Parse_Sink sink, void *user)
+{
+  *parser = (AVM_Parser) { .sink = sink, .user = user };
+}
+
+/* Hands over the image, and the error if there was one */
+static int parser_result(AVM_Parser *parser, avm_int **output, char **error,
+                         size_t *outputlen)
+{
+  int failed = parser->error != NULL;
+  if (!failed && parser->sink == NULL) {
+    // a label at the very end still counts
+    if (reserve(parser, parser->memory_loc)) {
+      parser->error = afmt("%zu: Allocation failed\n", parser->offset);
+      failed = 1;
+    } else if (parser->memory_loc > parser->zeroed) {
+      memset(parser->image + parser->zeroed, 0,
+             (parser->memory_loc - parser->zeroed) * sizeof(avm_int));
+    }
+  }
+
+  if (output != NULL) {
+    *output = parser->image;
+  } else {
+    my_free(parser->image);
+  }
+  if (failed) {
+    *error = parser->error;
+  } else {
+    *outputlen = parser->memory_loc;
+  }
+  my_free(parser->carry);
+  return failed;
+}
+
+int avm_parse(const char *input, avm_int **output, char **error, size_t *outputlen)
+{
+  return avm_parse_len(input, strlen(input), output, error, outputlen);
+}
+
+int avm_parse_len(const char *input, size_t len, avm_int **output,
+                  char **error, size_t *outputlen)
+{
+  AVM_Parser parser;
+  parser_init(&parser, NULL, NULL);
+
+  // the input ends at the first NUL, like a string would
+  const char *nul = memchr(input, '\0', len);
+  size_t consumed;
+  parse_buffer(&parser, input, nul != NULL ? (size_t) (nul - input) : len, 1,
+               &consumed);
+  return parser_result(&parser, output, error, outputlen);
+}
+
+AVM_Parser *avm_parser_new(AVM_Parse_Sink sink, void *user)
+{
+  AVM_Parser *parser = my_malloc(sizeof(AVM_Parser));
+  if (parser != NULL) {
+    parser_init(parser, sink, user);
+  }
+  return parser;
+}
+
+/* Makes room for `len` bytes in the carry, at least doubling it */
+static int reserve_carry(AVM_Parser *parser, size_t len)
+{
+  if (len <= parser->carry_cap) {
+    return 0;
+  }
+  size_t cap = parser->carry_cap * 2 > len ? parser->carry_cap * 2 : len;
+  char *carry = my_realloc(parser->carry, cap);
+  if (carry == NULL) {
+    parser->error = afmt("%zu: Allocation failed\n", parser->offset);
     return 1;
   }
+  parser->carry = carry;
+  parser->carry_cap = cap;
   return 0;
 }
 
-static int lex_error(Token *result)
+/* Whether all of `chunk` goes on with the kind of token `run` */
+static int goes_on(int run, const char *chunk, size_t len)
 {
-  *result = (Token) { .type = tt_error, .message = "unkown token" };
-  return 0; // always succeeds
+  if (run == run_line) {
+    return memchr(chunk, '\n', len) == NULL;
+  }
+  for (size_t i = 0; i < len; ++i) {
+    char c = chunk[i];
+    int same = run == run_space ? is_space(c) :
+               run == run_digits ? hex_digit(c) >= 0 :
+               run == run_letters ? ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') :
+               0;
+    if (!same) {
+      return 0;
+    }
+  }
+  return 1;
 }
 
-static int lex_input(const char **input, Token *result)
+int avm_parser_feed(AVM_Parser *parser, const char *chunk, size_t len)
 {
-  // unusual, returns 0 on failure and 1 on success
-  return try_lex_label(input, result) ||
-         try_lex_operation(input, result) ||
-         try_lex_num(input, result) ||
-         try_lex_eof(input, result) ||
-         lex_error(result);
+  if (parser->error != NULL) {
+    return 1;
+  }
+  if (parser->ended) {
+    return 0;
+  }
+
+  if (len == 0) {
+    return 0;
+  }
+  const char *nul = memchr(chunk, '\0', len);
+  if (nul != NULL) {
+    len = (size_t) (nul - chunk);
+    parser->ended = 1;
+  }
+
+  const char *input = chunk;
+  size_t input_len = len;
+  if (parser->carry_len > 0) {
+    // finish the statement that was cut off, along with the new input
+    if (reserve_carry(parser, parser->carry_len + len)) {
+      return 1;
+    }
+    memcpy(parser->carry + parser->carry_len, chunk, len);
+    input = parser->carry;
+    input_len = parser->carry_len + len;
+
+    // a chunk that only goes on with what the statement ran into the end
+    // on can't finish it, so only the new bytes are looked at
+    if (goes_on(parser->run, chunk, len)) {
+      parser->carry_len = input_len;
+      return 0;
+    }
+  }
+
+  size_t consumed;
+  if (parse_buffer(parser, input, input_len, 0, &consumed)) {
+    return 1;
+  }
+
+  // keep what's left for the next chunk
+  size_t left = input_len - consumed;
+  if (reserve_carry(parser, left)) {
+    return 1;
+  }
+  if (left > 0) {
+    memmove(parser->carry, input + consumed, left);
+  }
+  parser->carry_len = left;
+  return 0;
 }
 
-int avm_parse(const char *input, avm_int **output, char **error, size_t *outputlen)
+int avm_parser_finish(AVM_Parser *parser, avm_int **output, char **error,
+                      size_t *outputlen)
 {
-  const char *input_var = input;
-  size_t memory_loc = 0;
-  Token nextTok;
+  if (parser->error == NULL && !parser->done) {
+    size_t consumed;
+    parse_buffer(parser, parser->carry, parser->carry_len, 1, &consumed);
+  }
+
+  int failed = parser_result(parser, output, error, outputlen);
+  my_free(parser);
+  return failed;
+}
 
-  *output = my_calloc(SLACK_SIZE, sizeof(avm_int));
-  size_t memorycap = SLACK_SIZE;
+/* Parallel parsing splits the input at lines that start with a label, which
+ * sets the address code goes to no matter what came before it. Regions are
+ * parsed on their own into runs of words, which are merged if no two runs
+ * overlap. Where a split turns out not to be at the start of a statement,
+ * as in an operand on the line after its operation, the input is parsed
+ * again as a single region instead.
+ */
 
-  while (lex_input(&input_var, &nextTok)) {
-    if (memory_loc + 2 >= memorycap) { // resize
-      size_t newcap = memory_loc + SLACK_SIZE;
-      *output = my_crealloc(*output, memorycap * sizeof(avm_int), newcap * sizeof(avm_int));
-      if (*output == NULL) {
-        *error = afmt("%d: Allocation failed\n", input_var - input);
+/* Words written to consecutive addresses, after the same label */
+typedef struct {
+  size_t start;
+  size_t count;
+  size_t first;  /* index into the words of the region */
+  size_t at;     /* offset of the statement that started it */
+} Run;
+
+typedef struct {
+  AVM_Parser parser;
+  const char *input;
+  size_t len;
+  int final;
+  int clean;     /* parsed up to its end, ready to be merged */
+
+  avm_int *words;
+  size_t word_count;
+  size_t word_cap;
+  size_t run_labels;  /* `labels` of the parser when the last run started */
+  Run *runs;
+  size_t run_count;
+  size_t run_cap;
+} Region;
+
+/* Regions per thread, so that uneven ones even out */
+#define REGIONS_PER_THREAD 4
+
+static int region_sink(void *user, avm_size_t loc, const avm_int *words,
+                       size_t count)
+{
+  Region *region = user;
+  Run *last = region->run_count > 0 ? &region->runs[region->run_count - 1] :
+              NULL;
+
+  if (last == NULL || last->start + last->count != loc ||
+      region->run_labels != region->parser.labels) {
+    region->run_labels = region->parser.labels;
+    if (region->run_count == region->run_cap) {
+      size_t cap = region->run_cap == 0 ? 16 : region->run_cap * 2;
+      Run *runs = my_realloc(region->runs, cap * sizeof(Run));
+      if (runs == NULL) {
         return 1;
       }
-      memorycap = newcap;
+      region->runs = runs;
+      region->run_cap = cap;
     }
+    last = &region->runs[region->run_count++];
+    *last = (Run) {
+      .start = loc,
+      .first = region->word_count,
+      .at = region->parser.at,
+    };
+  }
 
-    if (nextTok.type == tt_error) {
-      *error = afmt("%d: %s", input_var - input, nextTok.message);
+  if (region->word_count + count > region->word_cap) {
+    size_t cap = region->word_cap * 2 > region->word_count + SLACK_SIZE ?
+                 region->word_cap * 2 : region->word_count + SLACK_SIZE;
+    avm_int *grown = my_realloc(region->words, cap * sizeof(avm_int));
+    if (grown == NULL) {
       return 1;
-    } else if (nextTok.type == tt_label) {
-      if (nextTok.value > AVM_SIZE_MAX) {
-        *error = afmt("%d: label address is out of bounds");
-        return 1;
-      }
+    }
+    region->words = grown;
+    region->word_cap = cap;
+  }
 
-      memory_loc = (avm_size_t) nextTok.value;
-      skip_whitespace(&input_var); // do not continue to newline
-      continue;
-    } else if (nextTok.type == tt_operation) {
-      if (nextTok.opc == avm_opc_error) {
-        (*output)[memory_loc] = nextTok.value;
-        memory_loc += 1;
-      } else if (nextTok.opc == avm_opc_load || nextTok.opc == avm_opc_store) {
-        Token size;
-        Token address;
-        if (!lex_input(&input_var, &size) ||
-            size.type != tt_num) {
-          *error = afmt("%d: expected size\n", input_var - input);
-          return 1;
-        }
-        if (!lex_input(&input_var, &address) ||
-            address.type != tt_num) {
-          *error = afmt("%d: expected address\n", input_var - input);
-          return 1;
-        }
-
-        if (size.value > (1 << 24) || address.value > AVM_SIZE_MAX) {
-          *error = afmt("%d: size or value out of bounds\n", input_var - input);
-          return 1;
-        }
-
-        (*output)[memory_loc] = ((AVM_Operation) {
-          .kind = nextTok.opc,
-          .size = (avm_size_t) size.value,
-          .address = (avm_size_t) address.value
-        }).value;
-
-        memory_loc += 1;
-      } else if (nextTok.opc == avm_opc_calli ||
-          nextTok.opc == avm_opc_jmpez) {
-        Token address;
-        if (!lex_input(&input_var, &address) ||
-            address.type != tt_num) {
-          *error = afmt("%d: expected address\n", input_var - input);
-          return 1;
-        }
-
-        (*output)[memory_loc] = ((AVM_Operation) {
-          .kind = nextTok.opc,
-          .address = (avm_size_t) address.value
-        }).value;
-
-        memory_loc += 1;
-      } else if (nextTok.opc == avm_opc_push) {
-        Token value;
-        if (!lex_input(&input_var, &value) ||
-            value.type != tt_num) {
-          *error = afmt("%d: expected value to push, got %d\n", input_var - input, value.type);
-          return 1;
-        }
-
-        (*output)[memory_loc] = ((AVM_Operation) { .kind = avm_opc_push }).value;
-        (*output)[memory_loc + 1] = value.value;
-
-        memory_loc += 2;
-      } else if (nextTok.opc == avm_opc_error) {
-        (*output)[memory_loc] = nextTok.value;
-        memory_loc += 1;
-      } else if (nextTok.opc < opcode_count) {
-        (*output)[memory_loc] = ((AVM_Operation) { .kind = nextTok.opc }).value;
-        memory_loc += 1;
-      } else {
-        printf("Internal error: WTF");
-        exit(EXIT_FAILURE);
-      }
-    } else if (nextTok.type == tt_eof) {
-      *outputlen = memory_loc;
-      return 0;
-    } else {
-      *error = afmt("%d: unknown error\n", input_var - input);
+  for (size_t i = 0; i < count; ++i) {
+    region->words[region->word_count++] = words[i];
+  }
+  last->count += count;
+  return 0;
+}
+
+static void parse_region(Region *region)
+{
+  size_t consumed;
+  parse_buffer(&region->parser, region->input, region->len, region->final,
+               &consumed);
+  region->clean = region->parser.error == NULL &&
+                  (region->final ? region->parser.done :
+                   consumed == region->len);
+}
+
+/* The start of the first line at or after `from` that begins with a label */
+static const char *next_label_line(const char *from, const char *end)
+{
+  const char *line = from;
+  while (line < end) {
+    const char *newline = memchr(line, '\n', (size_t) (end - line));
+    if (newline == NULL) {
+      return end;
+    }
+    line = newline + 1;
+
+    const char *p = line;
+    while (p < end && (*p == ' ' || *p == '\t')) {
+      p += 1;
+    }
+    const char *digits = p;
+    while (p < end && hex_digit(*p) >= 0) {
+      p += 1;
+    }
+    if (p > digits && p < end && *p == ':') {
+      return line;
+    }
+  }
+  return end;
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+
+typedef struct {
+  Region *regions;
+  size_t count;
+  size_t next;
+} Region_Queue;
+
+static void *region_worker(void *data)
+{
+  Region_Queue *queue = data;
+  size_t i;
+  while ((i = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED)) <
+         queue->count) {
+    parse_region(&queue->regions[i]);
+  }
+  return NULL;
+}
+
+static void parse_regions(Region *regions, size_t count, unsigned threads)
+{
+  Region_Queue queue = { .regions = regions, .count = count };
+  pthread_t *workers = my_malloc(threads * sizeof(pthread_t));
+  unsigned started = 0;
+
+  // the calling thread works through the queue as well
+  while (workers != NULL && started + 1 < threads &&
+         pthread_create(&workers[started], NULL, region_worker, &queue) == 0) {
+    started += 1;
+  }
+  region_worker(&queue);
+
+  for (unsigned i = 0; i < started; ++i) {
+    pthread_join(workers[i], NULL);
+  }
+  my_free(workers);
+}
+
+#else
+
+static void parse_regions(Region *regions, size_t count, unsigned threads)
+{
+  (void) threads;
+  for (size_t i = 0; i < count; ++i) {
+    parse_region(&regions[i]);
+  }
+}
+
+#endif
+
+typedef struct {
+  const Run *run;
+  const Region *region;
+} Run_Ref;
+
+static int compare_runs(const void *a, const void *b)
+{
+  const Run *x = ((const Run_Ref *) a)->run;
+  const Run *y = ((const Run_Ref *) b)->run;
+  if (x->start != y->start) {
+    return x->start < y->start ? -1 : 1;
+  }
+  return x->at < y->at ? -1 : x->at > y->at;
+}
+
+/* Copies the runs of every region into one image of `outputlen` words */
+static int merge_regions(Region *regions, size_t count, avm_int **output,
+                         char **error, size_t outputlen)
+{
+  size_t run_count = 0;
+  for (size_t i = 0; i < count; ++i) {
+    run_count += regions[i].run_count;
+  }
+
+  Run_Ref *refs = my_malloc((run_count + 1) * sizeof(Run_Ref));
+  *output = my_calloc(outputlen + 1, sizeof(avm_int));
+  if (refs == NULL || *output == NULL) {
+    my_free(refs);
+    *error = afmt("%d: Allocation failed\n", 0);
+    return 1;
+  }
+
+  size_t n = 0;
+  for (size_t i = 0; i < count; ++i) {
+    for (size_t j = 0; j < regions[i].run_count; ++j) {
+      refs[n++] = (Run_Ref) { &regions[i].runs[j], &regions[i] };
+    }
+  }
+  qsort(refs, run_count, sizeof(Run_Ref), compare_runs);
+
+  // by address, then by where they are in the input, so errors don't
+  // depend on how the input was split
+  const Run *furthest = NULL;
+  for (size_t i = 0; i < run_count; ++i) {
+    const Run *run = refs[i].run;
+    if (furthest != NULL && run->start < furthest->start + furthest->count) {
+      size_t later = run->at > furthest->at ? run->at : furthest->at;
+      size_t earlier = run->at > furthest->at ? furthest->at : run->at;
+      *error = afmt("%zu: code at %zx overlaps code from %zu\n", later,
+                    run->start, earlier);
+      my_free(refs);
       return 1;
     }
+    if (furthest == NULL ||
+        run->start + run->count > furthest->start + furthest->count) {
+      furthest = run;
+    }
 
-    continue_until_newline(&input_var);
-    skip_whitespace(&input_var);
+    // like the sequential parser, nothing past the final address is kept
+    size_t end = run->start + run->count;
+    for (size_t k = run->start; k < end && k < outputlen; ++k) {
+      (*output)[k] = refs[i].region->words[run->first + k - run->start];
+    }
   }
 
-  *error = afmt("%d: unknown error\n", input_var - input);
-  return 1;
+  my_free(refs);
+  return 0;
+}
+
+/* Merges the regions, or hands over the first error in the input. Returns
+ * -1 without touching the output if a region stopped short of its end.
+ */
+static int collect_regions(Region *regions, size_t count, avm_int **output,
+                           char **error, size_t *outputlen)
+{
+  // the first error in the input is the one to report
+  for (size_t i = 0; i < count; ++i) {
+    if (regions[i].parser.error != NULL) {
+      *output = NULL;
+      *error = regions[i].parser.error;
+      regions[i].parser.error = NULL;
+      return 1;
+    } else if (!regions[i].clean) {
+      return -1;
+    }
+  }
+  if (count == 0) {
+    return -1;
+  }
+  *outputlen = regions[count - 1].parser.memory_loc;
+  return merge_regions(regions, count, output, error, *outputlen);
+}
+
+static void free_regions(Region *regions, size_t count)
+{
+  for (size_t i = 0; i < count; ++i) {
+    my_free(regions[i].parser.error);
+    my_free(regions[i].parser.carry);
+    my_free(regions[i].words);
+    my_free(regions[i].runs);
+  }
+}
+
+/* Parses all of the input as one region on this thread, which still finds
+ * code written over other code
+ */
+static int parse_unsplit(const char *input, const char *end,
+                         avm_int **output, char **error, size_t *outputlen)
+{
+  Region region = {
+    .input = input,
+    .len = (size_t) (end - input),
+    .final = 1,
+  };
+  parser_init(&region.parser, region_sink, &region);
+  parse_region(&region);
+
+  // the last region always reaches its end
+  int failed = collect_regions(&region, 1, output, error, outputlen);
+  free_regions(&region, 1);
+  return failed;
+}
+
+int avm_parse_parallel(const char *input, size_t len, unsigned threads,
+                       avm_int **output, char **error, size_t *outputlen)
+{
+  const char *nul = memchr(input, '\0', len);
+  const char *end = nul != NULL ? nul : input + len;
+  if (threads == 0) {
+    threads = avm__core_count();
+  }
+
+  size_t wanted = (size_t) threads * REGIONS_PER_THREAD;
+  Region *regions = my_calloc(wanted, sizeof(Region));
+  if (regions == NULL || threads == 1) {
+    my_free(regions);
+    return parse_unsplit(input, end, output, error, outputlen);
+  }
+
+  size_t count = 0;
+  const char *from = input;
+  while (from < end) {
+    const char *split = end;
+    if (count + 1 < wanted) {
+      size_t target = (size_t) (end - input) / wanted * (count + 1);
+      split = next_label_line(input + target > from ? input + target : from,
+                              end);
+    }
+
+    Region *region = &regions[count++];
+    region->input = from;
+    region->len = (size_t) (split - from);
+    region->final = split == end;
+    parser_init(&region->parser, region_sink, region);
+    region->parser.offset = (size_t) (from - input);
+    region->parser.started = from > input;
+    from = split;
+  }
+
+  parse_regions(regions, count, threads);
+  int failed = collect_regions(regions, count, output, error, outputlen);
+  free_regions(regions, count);
+  my_free(regions);
+
+  if (failed < 0) {
+    return parse_unsplit(input, end, output, error, outputlen);
+  }
+  return failed;
 }
@@ -0,0 +1,348 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include "avm.h"
+#include "avm_util.h"
+#include "avm_def.h"
+
+/* avm_profile runs a program on the interpreter, which counts every
+ * instruction it runs towards the next sample with avm__profile_step,
+ * fused pairs one at a time. An instruction counts once, and once more for
+ * each word it moves or works on past the first. The one that uses up what
+ * was left is sampled before it runs: its address and the targets of the
+ * frames on the call stack. One that counts for several intervals gets as
+ * many samples. Intervals vary around the one asked for so that loops whose
+ * length divides it aren't always sampled at the same instruction.
+ *
+ * Samples of the same stack are counted once, in an open addressing table
+ * keyed by a hash of the stack. The frames of every distinct stack are kept
+ * back to back in one array.
+ */
+
+/* Frames kept of a sampled call stack, the innermost ones */
+#define PROFILE_DEPTH 64
+
+typedef struct {
+  uint64_t hash;
+  uint64_t count;   /* 0 for an empty slot */
+  size_t frames;    /* where its frames start in `frames` */
+  avm_size_t depth;
+  avm_size_t ins;
+  int truncated;    /* deeper than PROFILE_DEPTH */
+} Stack;
+
+struct AVM_Profile_s {
+  Stack *stacks;
+  size_t stack_cap;   /* a power of two */
+  size_t stack_count;
+
+  avm_size_t *frames;
+  size_t frame_count;
+  size_t frame_cap;
+
+  uint64_t samples;
+  uint64_t interval;
+  uint64_t rng;
+};
+
+AVM_Profile *avm_profile_new(void)
+{
+  AVM_Profile *profile = my_calloc(1, sizeof(AVM_Profile));
+  if (profile == NULL) {
+    return NULL;
+  }
+  profile->stack_cap = 256;
+  profile->stacks = my_calloc(profile->stack_cap, sizeof(Stack));
+  if (profile->stacks == NULL) {
+    my_free(profile);
+    return NULL;
+  }
+  profile->rng = 0x9E3779B97F4A7C15u;
+  return profile;
+}
+
+void avm_profile_free(AVM_Profile *profile)
+{
+  if (profile != NULL) {
+    my_free(profile->stacks);
+    my_free(profile->frames);
+    my_free(profile);
+  }
+}
+
+uint64_t avm_profile_samples(const AVM_Profile *profile)
+{
+  return profile->samples;
+}
+
+/* FNV-1a over the frame targets and the instruction */
+static uint64_t hash_stack(const AVM_Stack_Frame *frames, avm_size_t depth,
+                           avm_size_t ins)
+{
+  uint64_t hash = 0xCBF29CE484222325u;
+  for (avm_size_t i = 0; i < depth; ++i) {
+    hash = (hash ^ frames[i].target) * 0x100000001B3u;
+  }
+  return (hash ^ ins) * 0x100000001B3u;
+}
+
+static int same_stack(const AVM_Profile *profile, const Stack *stack,
+                      const AVM_Stack_Frame *frames, avm_size_t depth,
+                      avm_size_t ins)
+{
+  if (stack->depth != depth || stack->ins != ins) {
+    return 0;
+  }
+  const avm_size_t *kept = profile->frames + stack->frames;
+  for (avm_size_t i = 0; i < depth; ++i) {
+    if (kept[i] != frames[i].target) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Doubles the table, the stacks keep their frames */
+static int grow_stacks(AVM_Profile *profile)
+{
+  size_t cap = profile->stack_cap * 2;
+  Stack *stacks = my_calloc(cap, sizeof(Stack));
+  if (stacks == NULL) {
+    return 1;
+  }
+  for (size_t i = 0; i < profile->stack_cap; ++i) {
+    const Stack *stack = &profile->stacks[i];
+    if (stack->count == 0) {
+      continue;
+    }
+    size_t slot = stack->hash & (cap - 1);
+    while (stacks[slot].count != 0) {
+      slot = (slot + 1) & (cap - 1);
+    }
+    stacks[slot] = *stack;
+  }
+  my_free(profile->stacks);
+  profile->stacks = stacks;
+  profile->stack_cap = cap;
+  return 0;
+}
+
+static int keep_frames(AVM_Profile *profile, const AVM_Stack_Frame *frames,
+                       avm_size_t depth)
+{
+  if (profile->frame_count + depth > profile->frame_cap) {
+    size_t cap = profile->frame_cap > 0 ? profile->frame_cap : 1024;
+    while (cap < profile->frame_count + depth) {
+      cap *= 2;
+    }
+    avm_size_t *grown = my_realloc(profile->frames,
+                                   cap * sizeof(avm_size_t));
+    if (grown == NULL) {
+      return 1;
+    }
+    profile->frames = grown;
+    profile->frame_cap = cap;
+  }
+  for (avm_size_t i = 0; i < depth; ++i) {
+    profile->frames[profile->frame_count + i] = frames[i].target;
+  }
+  profile->frame_count += depth;
+  return 0;
+}
+
+/* Counts `count` samples of `ctx` at the instruction at `ins` */
+static int sample(AVM_Profile *profile, const AVM_Context *ctx,
+                  avm_size_t ins, uint64_t count)
+{
+  avm_size_t depth = ctx->call_stack_size;
+  const AVM_Stack_Frame *frames = ctx->call_stack;
+  int truncated = depth > PROFILE_DEPTH;
+  if (truncated) {
+    frames += depth - PROFILE_DEPTH;
+    depth = PROFILE_DEPTH;
+  }
+
+  uint64_t hash = hash_stack(frames, depth, ins);
+  size_t mask = profile->stack_cap - 1;
+  size_t slot = hash & mask;
+  while (profile->stacks[slot].count != 0) {
+    Stack *stack = &profile->stacks[slot];
+    if (stack->hash == hash && stack->truncated == truncated &&
+        same_stack(profile, stack, frames, depth, ins)) {
+      stack->count += count;
+      profile->samples += count;
+      return 0;
+    }
+    slot = (slot + 1) & mask;
+  }
+
+  if (keep_frames(profile, frames, depth)) {
+    return 1;
+  }
+  profile->stacks[slot] = (Stack) {
+    .hash = hash,
+    .count = count,
+    .frames = profile->frame_count - depth,
+    .depth = depth,
+    .ins = ins,
+    .truncated = truncated,
+  };
+  profile->stack_count += 1;
+  profile->samples += count;
+
+  // kept at most half full
+  if (profile->stack_count * 2 > profile->stack_cap) {
+    return grow_stacks(profile);
+  }
+  return 0;
+}
+
+/* An interval between half and one and a half times the profile's */
+static uint64_t next_interval(AVM_Profile *profile)
+{
+  uint64_t x = profile->rng;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  profile->rng = x;
+  return profile->interval / 2 + 1 + x % profile->interval;
+}
+
+/* What running `d` counts for, at least 1 */
+static uint64_t cost(const AVM_Decoded *d, avm_int tos, avm_size_t depth)
+{
+  switch (d->op) {
+  case avm_opc_load:
+  case avm_opc_store:
+  case avm_opc_vadd: case avm_opc_vsub: case avm_opc_vmul:
+  case avm_opc_vand: case avm_opc_vor: case avm_opc_vxor:
+  case avm_opc_vshr: case avm_opc_vshl:
+    return d->imm > 1 ? d->imm : 1;
+  case avm_opc_copy:
+  case avm_opc_fill:
+    // the count is pushed last, and more than AVM_SIZE_MAX fails
+    return depth >= 3 && tos > 1 && tos <= AVM_SIZE_MAX ? tos : 1;
+  default:
+    return 1;
+  }
+}
+
+int avm__profile_step(AVM_Context *ctx, const AVM_Decoded *d, avm_size_t pc,
+                      avm_int tos, avm_size_t depth)
+{
+  uint64_t left = cost(d, tos, depth), count = 0;
+  while (left >= ctx->sample_in) {
+    left -= ctx->sample_in;
+    ctx->sample_in = next_interval(ctx->profile);
+    count += 1;
+  }
+  ctx->sample_in -= left;
+
+  if (count != 0 && sample(ctx->profile, ctx, pc, count)) {
+    return avm__error(ctx, "Unable to allocate profile samples");
+  }
+  return 0;
+}
+
+int avm_profile(AVM_Context *ctx, AVM_Profile *profile, uint64_t interval,
+                avm_int *result)
+{
+  // the engines run whole blocks, not an operation at a time
+  avm_ir_enable(ctx, 0);
+  profile->interval = interval != 0 ? interval : AVM_PROFILE_INTERVAL;
+  ctx->profile = profile;
+  ctx->sample_in = next_interval(profile);
+  int retcode = avm_eval(ctx, result);
+  ctx->profile = NULL;
+  return retcode;
+}
+
+int avm_profile_write_folded(const AVM_Profile *profile, FILE *out)
+{
+  for (size_t i = 0; i < profile->stack_cap; ++i) {
+    const Stack *stack = &profile->stacks[i];
+    if (stack->count == 0) {
+      continue;
+    }
+    const avm_size_t *frames = profile->frames + stack->frames;
+    if (stack->truncated) {
+      fputs("[truncated];", out);
+    }
+    for (avm_size_t k = 0; k < stack->depth; ++k) {
+      fprintf(out, "0x%.4x;", frames[k]);
+    }
+    fprintf(out, "0x%.4x %" PRIu64 "\n", stack->ins, stack->count);
+  }
+  return ferror(out) != 0;
+}
+
+typedef struct {
+  avm_size_t ins;
+  uint64_t count;
+} Hot_Spot;
+
+static int compare_ins(const void *a, const void *b)
+{
+  const Hot_Spot *x = a, *y = b;
+  return (x->ins > y->ins) - (x->ins < y->ins);
+}
+
+/* Most samples first, lower addresses first among equals */
+static int compare_count(const void *a, const void *b)
+{
+  const Hot_Spot *x = a, *y = b;
+  if (x->count != y->count) {
+    return x->count < y->count ? 1 : -1;
+  }
+  return compare_ins(a, b);
+}
+
+int avm_profile_write_hot_spots(const AVM_Profile *profile, AVM_Context *ctx,
+                                size_t count, FILE *out)
+{
+  Hot_Spot *spots = my_malloc((profile->stack_count + 1) * sizeof(Hot_Spot));
+  if (spots == NULL) {
+    return avm__error(ctx, "Unable to allocate the hot spot table");
+  }
+
+  // every stack's samples go to the instruction it stopped at
+  size_t used = 0;
+  for (size_t i = 0; i < profile->stack_cap; ++i) {
+    const Stack *stack = &profile->stacks[i];
+    if (stack->count != 0) {
+      spots[used++] = (Hot_Spot) { .ins = stack->ins, .count = stack->count };
+    }
+  }
+  qsort(spots, used, sizeof(Hot_Spot), compare_ins);
+  size_t merged = 0;
+  for (size_t i = 0; i < used; ++i) {
+    if (merged > 0 && spots[merged - 1].ins == spots[i].ins) {
+      spots[merged - 1].count += spots[i].count;
+    } else {
+      spots[merged++] = spots[i];
+    }
+  }
+  qsort(spots, merged, sizeof(Hot_Spot), compare_count);
+
+  int failed = 0;
+  for (size_t i = 0; i < merged && i < count && !failed; ++i) {
+    avm_size_t ins = spots[i].ins;
+    char *text;
+    if (avm_stringify(ctx, &ins, &text)) {
+      failed = 1;
+      break;
+    }
+    fprintf(out, "%5.1f%% %10" PRIu64 "  %.4x:\t%s\n",
+            100.0 * (double) spots[i].count / (double) profile->samples,
+            spots[i].count, spots[i].ins, text);
+    my_free(text);
+  }
+  my_free(spots);
+
+  if (!failed && ferror(out)) {
+    return avm__error(ctx, "Unable to write the hot spot table");
+  }
+  return failed;
+}
@@ -0,0 +1,121 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "avm.h"
+#include "avm_util.h"
+#include "avm_def.h"
+
+/* A program is a context that's set up like avm_init would, and never
+ * runs. Contexts set up from it share its guest memory like forks do, so
+ * the code words are only copied a page at a time as they're written to.
+ *
+ * They share the decoded code and blocks as well, as long as nothing
+ * changes them. Dropping the proofs switches a context over to `plain`,
+ * the same code decoded without them, so the evaluator never has to
+ * allocate for it. Writing over decoded code or turning an engine on gives
+ * the context its own copy first, through avm__code_own.
+ *
+ * Unlike avm_init, only the program itself is decoded, without the slack
+ * after it. Data stored right after the code then doesn't cost every
+ * context a copy of the table, and code generated there is decoded as it
+ * runs.
+ */
+
+AVM_Program *avm_program_new(const avm_int *code, size_t len, char **error)
+{
+  *error = NULL;
+  AVM_Program *program = my_calloc(1, sizeof(AVM_Program));
+  if (program == NULL) {
+    *error = afmt("%s", "unable to allocate program");
+    return NULL;
+  }
+  program->refs = 1;
+
+  AVM_Context *proto = &program->proto;
+  *proto = (AVM_Context) { .error = NULL };
+  if (len >= AVM_SIZE_MAX / 2) {
+    *error = afmt("%zu code words don't fit in memory", len);
+    my_free(program);
+    return NULL;
+  }
+  if (avm__memory_init(proto) || avm__load_program(proto, code, len) ||
+      avm__init_state(proto, (avm_size_t) len, 0)) {
+    *error = proto->error;
+    proto->error = NULL;
+    avm_free(proto);
+    my_free(program);
+    return NULL;
+  }
+
+  program->plain = avm__decode_table(proto, proto->code_size);
+
+  if (program->plain == NULL) {
+    *error = afmt("%s", "unable to allocate decoded code");
+    avm_free(proto);
+    my_free(program);
+    return NULL;
+  }
+
+  // the stacks are the contexts' own
+  avm__stack_free(proto);
+  my_free(proto->call_stack);
+  return program;
+}
+
+void avm__program_release(AVM_Program *program)
+{
+  if (program != NULL &&
+      __atomic_sub_fetch(&program->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    avm_free(&program->proto);
+    my_free(program->plain);
+    free(program);
+  }
+}
+
+void avm_program_free(AVM_Program *program)
+{
+  avm__program_release(program);
+}
+
+int avm_init_program(AVM_Context *ctx, AVM_Program *program)
+{
+  const AVM_Context *proto = &program->proto;
+
+  *ctx = (AVM_Context) { .error = NULL };
+  avm__memory_share(proto, ctx);
+
+  __atomic_add_fetch(&program->refs, 1, __ATOMIC_RELAXED);
+  ctx->program = program;
+  ctx->code = proto->code;
+  ctx->code_size = proto->code_size;
+  ctx->blocks = proto->blocks;
+  ctx->block_count = proto->block_count;
+  ctx->proven = proto->proven;
+  ctx->ins = proto->ins;
+
+  return avm__init_stacks(ctx);
+}
+
+int avm__code_own(AVM_Context *ctx)
+{
+  if (!avm__code_shared(ctx)) {
+    return 0;
+  }
+
+  size_t code_bytes = ((size_t) ctx->code_size + AVM_DECODE_SPAN) *
+                      sizeof(AVM_Decoded);
+  AVM_Decoded *code = my_malloc(code_bytes);
+  AVM_Block *blocks = my_malloc((ctx->block_count + 1) * sizeof(AVM_Block));
+  if (code == NULL || blocks == NULL) {
+    my_free(code);
+    my_free(blocks);
+    return avm__error(ctx, "unable to allocate decoded code (%u ops)",
+                      ctx->code_size);
+  }
+  memcpy(code, ctx->code, code_bytes);
+  memcpy(blocks, ctx->blocks, ctx->block_count * sizeof(AVM_Block));
+
+  ctx->code = code;
+  ctx->blocks = blocks;
+  return 0;
+}
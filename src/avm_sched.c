@@ -0,0 +1,518 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "avm.h"
+#include "avm_util.h"
+#include "avm_def.h"
+
+/* A scheduler runs each task a slice of avm_eval_steps at a time. Every
+ * worker has its own run queue, takes a task off the front, runs a slice
+ * and puts it back at the end if it isn't done, so the tasks of a queue
+ * take turns. A worker whose queue is empty takes the front half of the
+ * first other queue that isn't. Those have waited longest.
+ *
+ * A run queue holds a list per priority and picks between them by stride
+ * scheduling: every list has a pass, the one with the lowest is picked
+ * and its pass goes up by STRIDE over the weight of the list, `priority +
+ * 1` for every task on it. A task of priority p is picked p + 1 times as
+ * often as one of priority 0 on the same queue, without waiting for all
+ * of those to run first.
+ *
+ * Queues are guarded by their own lock and a worker never holds two. The
+ * stats of a worker are only written by the thread running it.
+ */
+
+typedef struct Entry_s {
+  AVM_Task *task;
+  uint64_t queued;        /* when it was put on a run queue, in ns */
+  unsigned level;         /* the list of a queue it goes on */
+  struct Entry_s *next;
+} Entry;
+
+#define STRIDE ((uint64_t) 1 << 32)
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+
+typedef pthread_mutex_t Lock;
+
+static void lock_init(Lock *lock)
+{
+  pthread_mutex_init(lock, NULL);
+}
+
+static void lock(Lock *lock)
+{
+  pthread_mutex_lock(lock);
+}
+
+static void unlock(Lock *lock)
+{
+  pthread_mutex_unlock(lock);
+}
+
+static void lock_free(Lock *lock)
+{
+  pthread_mutex_destroy(lock);
+}
+
+static uint64_t now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+#else
+
+// one worker, nothing to lock against
+typedef int Lock;
+
+static void lock_init(Lock *lock) { (void) lock; }
+static void lock(Lock *lock) { (void) lock; }
+static void unlock(Lock *lock) { (void) lock; }
+static void lock_free(Lock *lock) { (void) lock; }
+
+static uint64_t now(void)
+{
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+#endif
+
+typedef struct {
+  Entry *head;
+  Entry *tail;
+  size_t length;
+  uint64_t pass;          /* picked before lists with a later one */
+} Level;
+
+typedef struct {
+  Lock lock;
+  Level levels[AVM_SCHED_PRIORITIES];
+  size_t length;
+  uint64_t pass;          /* pass of the list picked last */
+  AVM_Sched_Stats stats;
+  AVM_Scheduler *sched;
+  unsigned index;
+} Queue;
+
+struct AVM_Scheduler_s {
+  Queue *queues;
+  unsigned count;
+  uint64_t slice;
+  size_t pending;         /* tasks added that haven't finished */
+  unsigned next;          /* the queue the next task is added to */
+  int failed;
+#if defined(__unix__) || defined(__APPLE__)
+  pthread_mutex_t idle_lock;
+  pthread_cond_t wake;    /* a task was queued or the last one ended */
+  unsigned idle;
+#endif
+};
+
+/* Wakes a worker waiting for tasks, all of them if `all` */
+static void wake(AVM_Scheduler *sched, int all)
+{
+#if defined(__unix__) || defined(__APPLE__)
+  if (__atomic_load_n(&sched->idle, __ATOMIC_ACQUIRE) == 0) {
+    return;
+  }
+  pthread_mutex_lock(&sched->idle_lock);
+  if (all) {
+    pthread_cond_broadcast(&sched->wake);
+  } else {
+    pthread_cond_signal(&sched->wake);
+  }
+  pthread_mutex_unlock(&sched->idle_lock);
+#else
+  (void) sched;
+  (void) all;
+#endif
+}
+
+/* Waits a little for another worker to queue a task */
+static void doze(AVM_Scheduler *sched)
+{
+#if defined(__unix__) || defined(__APPLE__)
+  pthread_mutex_lock(&sched->idle_lock);
+  __atomic_add_fetch(&sched->idle, 1, __ATOMIC_ACQ_REL);
+  if (__atomic_load_n(&sched->pending, __ATOMIC_ACQUIRE) != 0) {
+    // a wakeup can slip in before the wait, so it doesn't wait for long
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += 1000000;
+    if (until.tv_nsec >= 1000000000) {
+      until.tv_sec += 1;
+      until.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&sched->wake, &sched->idle_lock, &until);
+  }
+  __atomic_sub_fetch(&sched->idle, 1, __ATOMIC_ACQ_REL);
+  pthread_mutex_unlock(&sched->idle_lock);
+#else
+  (void) sched;
+#endif
+}
+
+// passes wrap around, only their distance counts
+static int before(uint64_t pass, uint64_t other)
+{
+  return (int64_t) (pass - other) < 0;
+}
+
+/* Appends the `count` entries from `head` to `tail` to list `level` of the
+ * queue, which is locked
+ */
+static void append(Queue *queue, unsigned level, Entry *head, Entry *tail,
+                   size_t count)
+{
+  Level *list = &queue->levels[level];
+  tail->next = NULL;
+  if (list->tail != NULL) {
+    list->tail->next = head;
+  } else {
+    list->head = head;
+    // a list that was empty doesn't get to catch up on the picks it missed
+    if (before(list->pass, queue->pass)) {
+      list->pass = queue->pass;
+    }
+  }
+  list->tail = tail;
+  list->length += count;
+  queue->length += count;
+  if (queue->length > queue->stats.longest) {
+    queue->stats.longest = queue->length;
+  }
+}
+
+static void push(Queue *queue, Entry *entry)
+{
+  lock(&queue->lock);
+  append(queue, entry->level, entry, entry, 1);
+  unlock(&queue->lock);
+}
+
+static Entry *pop(Queue *queue)
+{
+  lock(&queue->lock);
+  Level *list = NULL;
+  unsigned level = 0;
+  for (unsigned i = AVM_SCHED_PRIORITIES; i-- > 0;) {
+    Level *next = &queue->levels[i];
+    if (next->length != 0 && (list == NULL || before(next->pass, list->pass))) {
+      list = next;
+      level = i;
+    }
+  }
+
+  Entry *entry = NULL;
+  if (list != NULL) {
+    entry = list->head;
+    list->head = entry->next;
+    if (list->head == NULL) {
+      list->tail = NULL;
+    }
+    queue->pass = list->pass;
+    list->pass += STRIDE / ((uint64_t) (level + 1) * list->length);
+    list->length -= 1;
+    queue->length -= 1;
+  }
+  unlock(&queue->lock);
+  return entry;
+}
+
+/* Moves the front half of every list of another queue to the empty queue
+ * of `thief`. 0 if every other queue is empty.
+ */
+static int steal(Queue *thief)
+{
+  AVM_Scheduler *sched = thief->sched;
+  for (unsigned k = 1; k < sched->count; ++k) {
+    Queue *victim = &sched->queues[(thief->index + k) % sched->count];
+    Entry *heads[AVM_SCHED_PRIORITIES], *tails[AVM_SCHED_PRIORITIES];
+    size_t counts[AVM_SCHED_PRIORITIES], total = 0;
+
+    lock(&victim->lock);
+    for (unsigned level = 0; level < AVM_SCHED_PRIORITIES; ++level) {
+      Level *list = &victim->levels[level];
+      counts[level] = (list->length + 1) / 2;
+      heads[level] = tails[level] = list->head;
+      if (counts[level] == 0) {
+        continue;
+      }
+      for (size_t i = 1; i < counts[level]; ++i) {
+        tails[level] = tails[level]->next;
+      }
+      list->head = tails[level]->next;
+      if (list->head == NULL) {
+        list->tail = NULL;
+      }
+      list->length -= counts[level];
+      total += counts[level];
+    }
+    victim->length -= total;
+    unlock(&victim->lock);
+    if (total == 0) {
+      continue;
+    }
+
+    lock(&thief->lock);
+    for (unsigned level = 0; level < AVM_SCHED_PRIORITIES; ++level) {
+      if (counts[level] != 0) {
+        append(thief, level, heads[level], tails[level], counts[level]);
+      }
+    }
+    unlock(&thief->lock);
+    thief->stats.steals += 1;
+    thief->stats.stolen += total;
+    return 1;
+  }
+  return 0;
+}
+
+static void record_wait(AVM_Sched_Stats *stats, uint64_t waited)
+{
+  unsigned bucket = 0;
+  for (uint64_t us = waited / 1000; us > 1 &&
+       bucket < AVM_SCHED_WAIT_BUCKETS - 1; us >>= 1) {
+    bucket += 1;
+  }
+  stats->waits[bucket] += 1;
+  stats->wait_ns += waited;
+  if (waited > stats->max_wait_ns) {
+    stats->max_wait_ns = waited;
+  }
+}
+
+static void run_slice(Queue *queue, Entry *entry)
+{
+  AVM_Scheduler *sched = queue->sched;
+  AVM_Task *task = entry->task;
+  record_wait(&queue->stats, now() - entry->queued);
+
+  int status = avm_eval_steps(task->ctx, sched->slice, &task->result);
+  queue->stats.slices += 1;
+
+  if (status == AVM_EVAL_BUDGET) {
+    entry->queued = now();
+    push(queue, entry);
+    wake(sched, 0);
+    return;
+  }
+
+  if (status != 0) {
+    task->failed = 1;
+    task->error = task->ctx->error != NULL ? task->ctx->error
+                                           : afmt("%s", "unknown error");
+    task->trap = avm_trap(task->ctx);
+    task->ctx->error = NULL;
+    __atomic_store_n(&sched->failed, 1, __ATOMIC_RELAXED);
+  }
+  my_free(entry);
+  queue->stats.finished += 1;
+  if (__atomic_sub_fetch(&sched->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+    wake(sched, 1);
+  }
+}
+
+static void *work(void *data)
+{
+  Queue *queue = data;
+  AVM_Scheduler *sched = queue->sched;
+
+  while (1) {
+    Entry *entry = pop(queue);
+    if (entry != NULL) {
+      run_slice(queue, entry);
+    } else if (!steal(queue)) {
+      if (__atomic_load_n(&sched->pending, __ATOMIC_ACQUIRE) == 0) {
+        break;
+      }
+      // the tasks left are running on other workers
+      doze(sched);
+    }
+  }
+  return NULL;
+}
+
+AVM_Scheduler *avm_sched_new(unsigned threads, uint64_t slice)
+{
+#if defined(__unix__) || defined(__APPLE__)
+  if (threads == 0) {
+    threads = avm__core_count();
+  }
+#else
+  threads = 1;
+#endif
+
+  AVM_Scheduler *sched = my_calloc(1, sizeof(AVM_Scheduler));
+  if (sched == NULL) {
+    return NULL;
+  }
+  sched->queues = my_calloc(threads, sizeof(Queue));
+  if (sched->queues == NULL) {
+    my_free(sched);
+    return NULL;
+  }
+
+  sched->count = threads;
+  sched->slice = slice != 0 ? slice : AVM_SCHED_SLICE;
+  for (unsigned i = 0; i < threads; ++i) {
+    lock_init(&sched->queues[i].lock);
+    sched->queues[i].sched = sched;
+    sched->queues[i].index = i;
+  }
+#if defined(__unix__) || defined(__APPLE__)
+  pthread_mutex_init(&sched->idle_lock, NULL);
+  pthread_cond_init(&sched->wake, NULL);
+#endif
+  return sched;
+}
+
+int avm_sched_add(AVM_Scheduler *sched, AVM_Task *task)
+{
+  assert(sched != NULL);
+  assert(task != NULL && task->ctx != NULL);
+
+  Entry *entry = my_malloc(sizeof(Entry));
+  if (entry == NULL) {
+    return 1;
+  }
+  task->failed = 0;
+  task->result = 0;
+  task->error = NULL;
+  task->trap = AVM_TRAP_NONE;
+  entry->task = task;
+  entry->queued = now();
+  entry->level = task->priority < AVM_SCHED_PRIORITIES
+                   ? task->priority : AVM_SCHED_PRIORITIES - 1;
+
+  unsigned index = __atomic_fetch_add(&sched->next, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&sched->pending, 1, __ATOMIC_ACQ_REL);
+  push(&sched->queues[index % sched->count], entry);
+  wake(sched, 0);
+  return 0;
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+
+static void run_workers(AVM_Scheduler *sched)
+{
+  pthread_t *threads = my_malloc(sched->count * sizeof(pthread_t));
+  unsigned started = 1;
+
+  // the calling thread is the first worker, the others are only started
+  // if they can be
+  while (threads != NULL && started < sched->count &&
+         pthread_create(&threads[started], NULL, work,
+                        &sched->queues[started]) == 0) {
+    started += 1;
+  }
+  work(&sched->queues[0]);
+
+  for (unsigned i = 1; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  my_free(threads);
+}
+
+#else
+
+static void run_workers(AVM_Scheduler *sched)
+{
+  work(&sched->queues[0]);
+}
+
+#endif
+
+int avm_sched_run(AVM_Scheduler *sched)
+{
+  assert(sched != NULL);
+
+  // time spent queued before the run isn't waiting for a worker
+  uint64_t start = now();
+  for (unsigned i = 0; i < sched->count; ++i) {
+    lock(&sched->queues[i].lock);
+    for (unsigned level = 0; level < AVM_SCHED_PRIORITIES; ++level) {
+      Entry *e = sched->queues[i].levels[level].head;
+      for (; e != NULL; e = e->next) {
+        e->queued = start;
+      }
+    }
+    unlock(&sched->queues[i].lock);
+  }
+
+  sched->failed = 0;
+  run_workers(sched);
+  return sched->failed;
+}
+
+unsigned avm_sched_workers(const AVM_Scheduler *sched)
+{
+  return sched->count;
+}
+
+static void add_stats(AVM_Sched_Stats *to, const AVM_Sched_Stats *from)
+{
+  to->slices += from->slices;
+  to->finished += from->finished;
+  to->steals += from->steals;
+  to->stolen += from->stolen;
+  to->queued += from->queued;
+  to->longest = to->longest > from->longest ? to->longest : from->longest;
+  to->wait_ns += from->wait_ns;
+  if (from->max_wait_ns > to->max_wait_ns) {
+    to->max_wait_ns = from->max_wait_ns;
+  }
+  for (unsigned i = 0; i < AVM_SCHED_WAIT_BUCKETS; ++i) {
+    to->waits[i] += from->waits[i];
+  }
+}
+
+void avm_sched_stats(AVM_Scheduler *sched, unsigned worker,
+                     AVM_Sched_Stats *stats)
+{
+  assert(sched != NULL);
+  assert(stats != NULL);
+
+  memset(stats, 0, sizeof(AVM_Sched_Stats));
+  for (unsigned i = 0; i < sched->count; ++i) {
+    if (worker != sched->count && worker != i) {
+      continue;
+    }
+    Queue *queue = &sched->queues[i];
+    lock(&queue->lock);
+    queue->stats.queued = queue->length;
+    add_stats(stats, &queue->stats);
+    unlock(&queue->lock);
+  }
+}
+
+void avm_sched_free(AVM_Scheduler *sched)
+{
+  if (sched == NULL) {
+    return;
+  }
+  for (unsigned i = 0; i < sched->count; ++i) {
+    for (unsigned level = 0; level < AVM_SCHED_PRIORITIES; ++level) {
+      Entry *entry = sched->queues[i].levels[level].head;
+      while (entry != NULL) {
+        Entry *next = entry->next;
+        my_free(entry);
+        entry = next;
+      }
+    }
+    lock_free(&sched->queues[i].lock);
+  }
+#if defined(__unix__) || defined(__APPLE__)
+  pthread_mutex_destroy(&sched->idle_lock);
+  pthread_cond_destroy(&sched->wake);
+#endif
+  my_free(sched->queues);
+  my_free(sched);
+}
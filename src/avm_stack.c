@@ -0,0 +1,373 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "avm.h"
+#include "avm_util.h"
+#include "avm_def.h"
+
+/* The operand stack always has one spare slot in front of `ctx->stack`.
+ * The evaluator caches the top of the stack in a local and spills it to
+ * `stack[size - 1]` on every push, which writes that slot when the stack is
+ * empty instead of branching.
+ */
+
+#ifdef AVM_STACK_GUARD
+
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* With AVM_STACK_GUARD the stack is reserved once at its full size
+ * followed by an inaccessible guard page, so it never grows and pushes
+ * don't need a capacity check. Pages are only backed by memory once they're
+ * touched. Overflowing into the guard page raises SIGSEGV, which is turned
+ * into an error for the evaluation that caused it.
+ */
+
+/* What avm__stack_reset leaves backed by memory */
+#define STACK_KEPT_BYTES (64u << 10)
+
+static _Thread_local AVM_Guard *current_guard;
+static struct sigaction previous_action;
+static size_t page_size;
+
+/* Like a grown stack, a stack of `cap` slots only ever holds `cap - 1`
+ * items, the last slot is the start of the guard page
+ */
+static size_t stack_bytes(avm_size_t cap)
+{
+  // slack page in front, the slots in use, rounded up to a page
+  size_t bytes = (size_t) (cap - 1) * sizeof(avm_int);
+  return page_size + (bytes + page_size - 1) / page_size * page_size;
+}
+
+/* Room left in front of the first slot, so that the slots in use end right
+ * at the guard page
+ */
+static size_t stack_pad(avm_size_t cap)
+{
+  return stack_bytes(cap) - page_size - (size_t) (cap - 1) * sizeof(avm_int);
+}
+
+static char *stack_region(const avm_int *stack, avm_size_t cap)
+{
+  return (char *) stack - stack_pad(cap) - page_size;
+}
+
+/* Items a stack limited to `bytes` is reserved for, without a depth limit
+ * of its own. The stack alone can't take up more than the whole limit.
+ */
+static size_t bytes_depth(const AVM_Context *ctx)
+{
+  if (ctx->limits.stack_depth != 0 || ctx->limits.bytes == 0) {
+    return 0;
+  }
+  size_t depth = ctx->limits.bytes / sizeof(avm_int);
+  return depth > 0 ? depth : 1;
+}
+
+/* A stack limited to `stack_depth` items, or by `bytes`, faults once it
+ * holds one more
+ */
+static avm_size_t limited_cap(const AVM_Context *ctx, avm_size_t cap)
+{
+  size_t depth = ctx->limits.stack_depth;
+  if (depth == 0) {
+    depth = bytes_depth(ctx);
+  }
+  return depth != 0 && depth < (size_t) cap - 1 ? (avm_size_t) depth + 1 : cap;
+}
+
+int avm__stack_overflow(AVM_Context *ctx)
+{
+  size_t depth = bytes_depth(ctx);
+  if (depth != 0 && ctx->stack_cap - 1 == depth) {
+    return avm__trap(ctx, AVM_TRAP_BYTES, "Stack overflow: limit of %zu "
+                     "bytes reached", ctx->limits.bytes);
+  }
+  return avm__trap(ctx, AVM_TRAP_STACK_DEPTH, "Stack overflow");
+}
+
+static void on_segv(int sig, siginfo_t *info, void *uctx)
+{
+  AVM_Guard *guard = current_guard;
+  const char *addr = info->si_addr;
+
+  if (guard != NULL && addr >= guard->lo && addr < guard->hi) {
+    siglongjmp(guard->env, 1);
+  }
+
+  // not ours, the handler that was there before gets it and this one stays
+  if (previous_action.sa_flags & SA_SIGINFO) {
+    previous_action.sa_sigaction(sig, info, uctx);
+  } else if (previous_action.sa_handler == SIG_IGN) {
+    return;
+  } else if (previous_action.sa_handler != SIG_DFL) {
+    previous_action.sa_handler(sig);
+  } else {
+    // the default action ends the process, there's nothing to come back to
+    signal(sig, SIG_DFL);
+    raise(sig);
+  }
+}
+
+/* Installs the handler once per process. Contexts are set up on any
+ * thread, so none may go on before it's in place.
+ */
+static void install_handler(void)
+{
+  // 0 not installed, 1 being installed, 2 installed
+  static int state;
+  if (__atomic_load_n(&state, __ATOMIC_ACQUIRE) == 2) {
+    return;
+  }
+
+  int expected = 0;
+  if (!__atomic_compare_exchange_n(&state, &expected, 1, 0, __ATOMIC_ACQ_REL,
+                                   __ATOMIC_ACQUIRE)) {
+    while (__atomic_load_n(&state, __ATOMIC_ACQUIRE) != 2) {
+      // another context is installing it
+    }
+    return;
+  }
+
+  page_size = (size_t) sysconf(_SC_PAGESIZE);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = on_segv;
+  // the evaluator recovers with siglongjmp and doesn't restore the mask
+  action.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGSEGV, &action, &previous_action);
+  __atomic_store_n(&state, 2, __ATOMIC_RELEASE);
+}
+
+int avm__stack_init(AVM_Context *ctx, avm_size_t cap)
+{
+  install_handler();
+
+  cap = limited_cap(ctx, cap);
+  size_t bytes = stack_bytes(cap);
+  char *region = mmap(NULL, bytes + page_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (region == MAP_FAILED) {
+    ctx->stack = NULL;
+    return avm__error(ctx, "unable to reserve stack (%u avm_int)", cap);
+  }
+
+  if (mprotect(region + bytes, page_size, PROT_NONE)) {
+    munmap(region, bytes + page_size);
+    ctx->stack = NULL;
+    return avm__error(ctx, "unable to protect stack guard page");
+  }
+
+  ctx->stack = (avm_int *) (region + page_size + stack_pad(cap));
+  ctx->stack_cap = cap;
+  ctx->stack_size = 0;
+  return 0;
+}
+
+static void unmap_stack(avm_int *stack, avm_size_t cap)
+{
+  munmap(stack_region(stack, cap), stack_bytes(cap) + page_size);
+}
+
+int avm__stack_grow(AVM_Context *ctx)
+{
+  return avm__stack_overflow(ctx);
+}
+
+int avm__stack_reserve(AVM_Context *ctx, avm_size_t count)
+{
+  if (count >= ctx->stack_cap - ctx->stack_size) {
+    return avm__stack_overflow(ctx);
+  }
+  return 0;
+}
+
+int avm__stack_fit(AVM_Context *ctx)
+{
+  avm_size_t cap = limited_cap(ctx, ctx->stack_cap);
+  avm_size_t size = ctx->stack_size;
+  if (cap == ctx->stack_cap) {
+    return 0;
+  }
+  if (size >= cap && bytes_depth(ctx) != 0) {
+    return avm__trap(ctx, AVM_TRAP_BYTES, "Stack holds %u items, more than "
+                     "the limit of %zu bytes", size, ctx->limits.bytes);
+  }
+  if (size >= cap) {
+    return avm__trap(ctx, AVM_TRAP_STACK_DEPTH, "Stack holds %u items, "
+                     "more than the limit of %u", size,
+                     ctx->limits.stack_depth);
+  }
+
+  // reserved again with the guard page where the limit is
+  avm_int *old = ctx->stack;
+  avm_size_t old_cap = ctx->stack_cap;
+  if (avm__stack_init(ctx, cap)) {
+    ctx->stack = old;
+    ctx->stack_cap = old_cap;
+    ctx->stack_size = size;
+    return 1;
+  }
+  memcpy(ctx->stack, old, size * sizeof(avm_int));
+  ctx->stack_size = size;
+  unmap_stack(old, old_cap);
+  return 0;
+}
+
+size_t avm__stack_bytes(const AVM_Context *ctx)
+{
+  // reserved, and only backed by memory where it's been touched. Under a
+  // byte limit, the reservation itself is bounded by the limit instead.
+  (void) ctx;
+  return 0;
+}
+
+void avm__stack_reset(AVM_Context *ctx)
+{
+  // a deep stack would otherwise stay resident for every later program
+  char *slots = stack_region(ctx->stack, ctx->stack_cap) + page_size;
+  size_t bytes = stack_bytes(ctx->stack_cap) - page_size;
+  size_t keep = STACK_KEPT_BYTES < bytes ? STACK_KEPT_BYTES : bytes;
+  madvise(slots + keep, bytes - keep, MADV_DONTNEED);
+  ctx->stack_size = 0;
+}
+
+void avm__stack_free(AVM_Context *ctx)
+{
+  if (ctx->stack != NULL) {
+    unmap_stack(ctx->stack, ctx->stack_cap);
+    ctx->stack = NULL;
+  }
+}
+
+void avm__guard_enter(AVM_Context *ctx, AVM_Guard *guard)
+{
+  guard->lo = (const char *) (ctx->stack + ctx->stack_cap - 1);
+  guard->hi = guard->lo + page_size;
+  guard->prev = current_guard;
+  current_guard = guard;
+}
+
+void avm__guard_leave(AVM_Guard *guard)
+{
+  current_guard = guard->prev;
+}
+
+#else
+
+/* A stack limited to `stack_depth` items has to grow to take one more */
+static size_t limited_cap(const AVM_Context *ctx, size_t cap)
+{
+  size_t most = ctx->limits.stack_depth != 0 ?
+                (size_t) ctx->limits.stack_depth + 1 : AVM_SIZE_MAX;
+  return cap < most ? cap : most;
+}
+
+int avm__stack_init(AVM_Context *ctx, avm_size_t cap)
+{
+  cap = (avm_size_t) limited_cap(ctx, cap);
+
+  // malloc used because stack semantics guarantee
+  // uninitialized data cannot be read
+  avm_int *region = my_malloc(((size_t) cap + 1) * sizeof(avm_int));
+  if (region == NULL) {
+    ctx->stack = NULL;
+    return avm__error(ctx, "unable to allocate stack (%d bytes)", cap);
+  }
+
+  ctx->stack = region + 1;
+  ctx->stack_cap = cap;
+  ctx->stack_size = 0;
+  return 0;
+}
+
+static int resize(AVM_Context *ctx, avm_size_t new_cap)
+{
+  avm_int *region = my_realloc(ctx->stack - 1,
+                               ((size_t) new_cap + 1) * sizeof(avm_int));
+  if (region == NULL) {
+    return avm__error(ctx, "unable to increase stack size (%d bytes)", new_cap);
+  }
+
+  ctx->stack = region + 1;
+  ctx->stack_cap = new_cap;
+  return 0;
+}
+
+/* Grows the stack to `new_cap` items, or as far as the limits allow if
+ * that still holds `need`
+ */
+static int grow(AVM_Context *ctx, size_t need, size_t new_cap)
+{
+  new_cap = limited_cap(ctx, new_cap);
+  if (new_cap < need) {
+    return avm__trap(ctx, AVM_TRAP_STACK_DEPTH, "Stack overflow: limit of "
+                     "%u items reached", ctx->limits.stack_depth);
+  }
+  if (avm__limit_bytes(ctx, (new_cap - ctx->stack_cap) * sizeof(avm_int))) {
+    return 1;
+  }
+  return resize(ctx, (avm_size_t) new_cap);
+}
+
+int avm__stack_grow(AVM_Context *ctx)
+{
+  return grow(ctx, (size_t) ctx->stack_size + 2,
+              min((size_t) ctx->stack_cap * 2, AVM_SIZE_MAX));
+}
+
+int avm__stack_reserve(AVM_Context *ctx, avm_size_t count)
+{
+  if (count < ctx->stack_cap - ctx->stack_size) {
+    return 0;
+  }
+  if (count >= AVM_SIZE_MAX - ctx->stack_size) {
+    return avm__trap(ctx, AVM_TRAP_STACK_DEPTH, "Stack overflow");
+  }
+
+  // the capacity it would have doubled to, in one step
+  size_t need = (size_t) ctx->stack_size + count + 1;
+  size_t new_cap = ctx->stack_cap > 0 ? ctx->stack_cap : 1;
+  while (new_cap < need) {
+    new_cap *= 2;
+  }
+  return grow(ctx, need, min(new_cap, AVM_SIZE_MAX));
+}
+
+int avm__stack_fit(AVM_Context *ctx)
+{
+  size_t cap = limited_cap(ctx, ctx->stack_cap);
+  if (cap == ctx->stack_cap) {
+    return 0;
+  }
+  if (ctx->stack_size >= cap) {
+    return avm__trap(ctx, AVM_TRAP_STACK_DEPTH, "Stack holds %u items, "
+                     "more than the limit of %u", ctx->stack_size,
+                     ctx->limits.stack_depth);
+  }
+  return resize(ctx, (avm_size_t) cap);
+}
+
+size_t avm__stack_bytes(const AVM_Context *ctx)
+{
+  return (size_t) ctx->stack_cap * sizeof(avm_int);
+}
+
+void avm__stack_reset(AVM_Context *ctx)
+{
+  ctx->stack_size = 0;
+}
+
+void avm__stack_free(AVM_Context *ctx)
+{
+  if (ctx->stack != NULL) {
+    free(ctx->stack - 1);
+    ctx->stack = NULL;
+  }
+}
+
+#endif /* AVM_STACK_GUARD */
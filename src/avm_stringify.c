@@ -1,78 +1,86 @@
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
 #include "avm.h"
 #include "avm_util.h"
 #include "avm_def.h"
 
+/* Instructions are formatted into a fixed buffer on the stack, and the
+ * lines of a listing gather in a chunk that goes to the sink whenever it
+ * fills up. A listing takes time linear in its length, and allocates
+ * nothing but the table of labels, if asked for.
+ */
+
+/* Longer than the text of any instruction */
+#define LINE_SIZE 80
+
+/* Text handed to a sink at a time */
+#define CHUNK_SIZE 4096
 
-typedef int (*Stringifier)(AVM_Context *, avm_size_t *ins, char **);
+typedef int (*Stringifier)(AVM_Context *, avm_size_t *ins, char *out);
 
 #define SIMPLE_BINOP(NAME) \
-static int stringify_ ## NAME (AVM_Context* ctx, avm_size_t* ins, char** out) { \
-  (*out) = afmt(#NAME); \
-  if((*out) == NULL) return 1; \
-  return 0; \
+static int stringify_ ## NAME (AVM_Context* ctx, avm_size_t* ins, char* out) { \
+  return snprintf(out, LINE_SIZE, #NAME); \
+}
+
+#define VECTOR_OP(NAME) \
+static int stringify_ ## NAME (AVM_Context* ctx, avm_size_t* ins, char* out) { \
+  AVM_Operation op; \
+  avm_heap_get(ctx, (avm_int *) &op, *ins); \
+  return snprintf(out, LINE_SIZE, #NAME "\t%dw", op.size); \
 }
 
-static int stringify_load(AVM_Context *ctx, avm_size_t *ins, char **out)
+static int stringify_load(AVM_Context *ctx, avm_size_t *ins, char *out)
 {
   AVM_Operation op;
   avm_heap_get(ctx, (avm_int *) &op, *ins);
 
-  (*out) = afmt("load\t%dw\t0x%.4x", op.size, op.address);
-  if (*out == NULL) { return 1; }
-  return 0;
+  return snprintf(out, LINE_SIZE, "load\t%dw\t0x%.4x", op.size, op.address);
 }
 
-static int stringify_store(AVM_Context *ctx, avm_size_t *ins, char **out)
+static int stringify_store(AVM_Context *ctx, avm_size_t *ins, char *out)
 {
   AVM_Operation op;
   avm_heap_get(ctx, (avm_int *) &op, *ins);
 
-  (*out) = afmt("store\t%dw\t0x%.4x", op.size, op.address);
-  if (*out == NULL) { return 1; }
-  return 0;
+  return snprintf(out, LINE_SIZE, "store\t%dw\t0x%.4x", op.size, op.address);
 }
 
-static int stringify_push(AVM_Context *ctx, avm_size_t *ins, char **out)
+static int stringify_push(AVM_Context *ctx, avm_size_t *ins, char *out)
 {
   avm_int val;
   avm_heap_get(ctx, &val, *ins + 1);
 
-  (*out) = afmt("push\t0x%.16lx (dec. %ld)", val, val);
-  if (*out == NULL) { return 1; }
   *ins += 1;
-  return 0;
+  return snprintf(out, LINE_SIZE, "push\t0x%.16" PRIx64 " (dec. %" PRId64 ")",
+                  val, (int64_t) val);
 }
 
-static int stringify_calli(AVM_Context *ctx, avm_size_t *ins, char **out)
+static int stringify_calli(AVM_Context *ctx, avm_size_t *ins, char *out)
 {
   AVM_Operation op;
   avm_heap_get(ctx, (avm_int *) &op, *ins);
 
-  (*out) = afmt("call\t0x%.4x", op.address);
-  if (*out == NULL) { return 1; }
-  return 0;
+  return snprintf(out, LINE_SIZE, "call\t0x%.4x", op.address);
 }
 
-static int stringify_error(AVM_Context *ctx, avm_size_t *ins, char **out)
+static int stringify_error(AVM_Context *ctx, avm_size_t *ins, char *out)
 {
   AVM_Operation op;
   avm_heap_get(ctx, (avm_int *) &op, *ins);
 
-  (*out) = afmt("error\t0x%.16lx", op.value);
-  if (*out == NULL) { return 1; }
-  return 0;
+  return snprintf(out, LINE_SIZE, "error\t0x%.16" PRIx64, op.value);
 }
 
-static int stringify_jmpez(AVM_Context *ctx, avm_size_t *ins, char **out)
+static int stringify_jmpez(AVM_Context *ctx, avm_size_t *ins, char *out)
 {
   AVM_Operation op;
   avm_heap_get(ctx, (avm_int *) &op, *ins);
 
-  (*out) = afmt("jumpez\t0x%.4x", op.address);
-  if (*out == NULL) { return 1; }
-  return 0;
+  return snprintf(out, LINE_SIZE, "jumpez\t0x%.4x", op.address);
 }
 
 // *INDENT-OFF*
@@ -89,6 +97,16 @@ SIMPLE_BINOP(ret)
 SIMPLE_BINOP(call)
 SIMPLE_BINOP(quit)
 SIMPLE_BINOP(dup)
+SIMPLE_BINOP(copy)
+SIMPLE_BINOP(fill)
+VECTOR_OP(vadd)
+VECTOR_OP(vsub)
+VECTOR_OP(vmul)
+VECTOR_OP(vand)
+VECTOR_OP(vor)
+VECTOR_OP(vxor)
+VECTOR_OP(vshr)
+VECTOR_OP(vshl)
 // *INDENT-ON*
 
 static const Stringifier stringifiers[opcode_count] = {
@@ -111,13 +129,22 @@ static const Stringifier stringifiers[opcode_count] = {
   [avm_opc_jmpez] = &stringify_jmpez,
   [avm_opc_quit ] = &stringify_quit,
   [avm_opc_dup ] = &stringify_dup,
+  [avm_opc_copy ] = &stringify_copy,
+  [avm_opc_fill ] = &stringify_fill,
+  [avm_opc_vadd ] = &stringify_vadd,
+  [avm_opc_vsub ] = &stringify_vsub,
+  [avm_opc_vmul ] = &stringify_vmul,
+  [avm_opc_vand ] = &stringify_vand,
+  [avm_opc_vor  ] = &stringify_vor,
+  [avm_opc_vxor ] = &stringify_vxor,
+  [avm_opc_vshr ] = &stringify_vshr,
+  [avm_opc_vshl ] = &stringify_vshl,
 };
 
-/* Stringifies the instruction in memory at the given
- * memory pointer. `ins` is incremented according to
- * the amount that has been stringified
+/* Formats the instruction at `*ins` into `out`, LINE_SIZE bytes, and moves
+ * `ins` past it. The length of the text.
  */
-int avm_stringify(AVM_Context *ctx, avm_size_t *ins, char **output)
+static size_t format_op(AVM_Context *ctx, avm_size_t *ins, char *out)
 {
   AVM_Operation op;
   avm_heap_get(ctx, (avm_int *) &op, *ins);
@@ -126,38 +153,194 @@ int avm_stringify(AVM_Context *ctx, avm_size_t *ins, char **output)
     op.kind = avm_opc_error;
   }
 
-  int retcode = stringifiers[op.kind](ctx, ins, output);
+  int len = stringifiers[op.kind](ctx, ins, out);
   *ins += 1;
-  return retcode;
+  return (size_t) len;
 }
 
-int avm_stringify_count(AVM_Context *ctx, avm_size_t ins, avm_size_t len,
-                        char **output)
+/* Stringifies the instruction in memory at the given
+ * memory pointer. `ins` is incremented according to
+ * the amount that has been stringified
+ */
+int avm_stringify(AVM_Context *ctx, avm_size_t *ins, char **output)
+{
+  char line[LINE_SIZE];
+  size_t len = format_op(ctx, ins, line);
+
+  *output = my_malloc(len + 1);
+  if (*output == NULL) {
+    return 1;
+  }
+  memcpy(*output, line, len + 1);
+  return 0;
+}
+
+typedef struct {
+  AVM_Disasm_Sink sink;
+  void *user;
+  size_t used;
+  int stopped;
+  char chunk[CHUNK_SIZE];
+} Writer;
+
+static void flush(Writer *writer)
+{
+  if (writer->used > 0 && !writer->stopped) {
+    writer->stopped = writer->sink(writer->user, writer->chunk, writer->used);
+  }
+  writer->used = 0;
+}
+
+static void write_text(Writer *writer, const char *text, size_t len)
+{
+  if (writer->used + len > CHUNK_SIZE) {
+    flush(writer);
+  }
+  memcpy(writer->chunk + writer->used, text, len);
+  writer->used += len;
+}
+
+/* Marks of the words of a listing that are branched to */
+enum { jump_target = 1, call_target = 2 };
+
+/* Marks the targets of jmpez and calli within the `len` words from `ins`,
+ * a byte a word
+ */
+static uint8_t *find_targets(AVM_Context *ctx, avm_size_t ins, avm_size_t len)
+{
+  uint8_t *targets = my_calloc(len > 0 ? len : 1, 1);
+  if (targets == NULL) {
+    return NULL;
+  }
+  for (avm_size_t i = ins; i < ins + len; ++i) {
+    AVM_Operation op;
+    avm_heap_get(ctx, (avm_int *) &op, i);
+    if (op.kind == avm_opc_push) {
+      i += 1;
+    } else if ((op.kind == avm_opc_jmpez || op.kind == avm_opc_calli) &&
+               op.address >= ins && op.address - ins < len) {
+      targets[op.address - ins] |= op.kind == avm_opc_calli ? call_target :
+                                   jump_target;
+    }
+  }
+  return targets;
+}
+
+int avm_disassemble(AVM_Context *ctx, avm_size_t ins, avm_size_t len,
+                    unsigned flags, AVM_Disasm_Sink sink, void *user)
 {
   if (asizet_add_bounds_check(ins, len)) {
     return avm__error(ctx, "Index %d and length %d are out of bounds", ins, len);
   }
 
-  *output = calloc(1, 1);
+  uint8_t *targets = NULL;
+  if (flags & AVM_DISASM_LABELS) {
+    targets = find_targets(ctx, ins, len);
+    if (targets == NULL) {
+      return avm__error(ctx, "Unable to allocate the label table");
+    }
+  }
 
-  for (avm_size_t i = ins; i < (ins + len);) {
+  Writer writer = { .sink = sink, .user = user };
+  char line[LINE_SIZE + 32];
+  for (avm_size_t i = ins; i < ins + len && !writer.stopped;) {
     avm_size_t op_idx = i;
-    char *tmpout;
-    if (avm_stringify(ctx, &i, &tmpout)) {
-      my_free(tmpout);
-      return 1;
+    size_t used = 0;
+    if (targets != NULL && targets[i - ins] & call_target) {
+      used = (size_t) snprintf(line, sizeof(line), "\nfn_%.4x:\n", i);
+    } else if (targets != NULL && targets[i - ins] & jump_target) {
+      used = (size_t) snprintf(line, sizeof(line), "L_%.4x:\n", i);
     }
+    used += (size_t) snprintf(line + used, sizeof(line) - used, "%.4x:\t",
+                              op_idx);
+    used += format_op(ctx, &i, line + used);
+    line[used++] = '\n';
+    write_text(&writer, line, used);
+  }
+  flush(&writer);
+  my_free(targets);
 
-    char *oldvalue = *output;
-    *output = afmt("%s\n%.4x:\t%s", oldvalue, op_idx, tmpout);
+  if (writer.stopped) {
+    return avm__error(ctx, "Disassembly stopped by the sink");
+  }
+  return 0;
+}
 
-    my_free(oldvalue);
-    my_free(tmpout);
+static int file_sink(void *user, const char *text, size_t len)
+{
+  return fwrite(text, 1, len, user) != len;
+}
 
-    if (*output == NULL) {
-      return avm__error(ctx, "Unable to concatenate operation strings");
+int avm_disassemble_file(AVM_Context *ctx, avm_size_t ins, avm_size_t len,
+                         unsigned flags, FILE *out)
+{
+  return avm_disassemble(ctx, ins, len, flags, file_sink, out);
+}
+
+/* A string that doubles when it fills up, always NUL terminated */
+typedef struct {
+  char *text;
+  size_t len;
+  size_t cap;
+} String;
+
+static int string_sink(void *user, const char *text, size_t len)
+{
+  String *string = user;
+  if (string->len + len >= string->cap) {
+    size_t cap = string->cap > 0 ? string->cap : CHUNK_SIZE;
+    while (string->len + len >= cap) {
+      cap *= 2;
+    }
+    char *grown = my_realloc(string->text, cap);
+    if (grown == NULL) {
+      return 1;
     }
+    string->text = grown;
+    string->cap = cap;
+  }
+  memcpy(string->text + string->len, text, len);
+  string->len += len;
+  string->text[string->len] = '\0';
+  return 0;
+}
+
+int avm_disassemble_string(AVM_Context *ctx, avm_size_t ins, avm_size_t len,
+                           unsigned flags, char **output, size_t *length)
+{
+  String string = { NULL, 0, 0 };
+  int failed = avm_disassemble(ctx, ins, len, flags, string_sink, &string);
+  // an empty listing is still a string
+  if (!failed && string_sink(&string, "", 0)) {
+    failed = avm__error(ctx, "Unable to allocate the listing");
+  }
+  if (failed) {
+    my_free(string.text);
+    string.text = NULL;
+    string.len = 0;
+  }
+  *output = string.text;
+  if (length != NULL) {
+    *length = string.len;
   }
+  return failed;
+}
 
+/* A newline, then the lines of avm_disassemble without the last newline */
+int avm_stringify_count(AVM_Context *ctx, avm_size_t ins, avm_size_t len,
+                        char **output)
+{
+  String string = { NULL, 0, 0 };
+  if (string_sink(&string, "\n", 1)) {
+    *output = NULL;
+    return avm__error(ctx, "Unable to concatenate operation strings");
+  }
+  if (avm_disassemble(ctx, ins, len, 0, string_sink, &string)) {
+    my_free(string.text);
+    *output = NULL;
+    return 1;
+  }
+  string.text[--string.len] = '\0';
+  *output = string.text;
   return 0;
 }
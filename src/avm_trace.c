@@ -0,0 +1,214 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include "avm.h"
+#include "avm_util.h"
+#include "avm_def.h"
+
+/* A traced context writes a record for every instruction it runs into a
+ * ring of a power of two records, overwriting the oldest. The evaluating
+ * thread is the only writer, and avm_trace_read may take records out of
+ * the ring on another thread while it runs, without locks.
+ *
+ * The ring works like a seqlock. The writer bumps `started` before it
+ * writes a slot and `written` once it's done. A reader copies up to
+ * `written`, then checks `started` to drop the copies the writer may have
+ * been overwriting meanwhile.
+ *
+ * Evaluation only looks at whether `ctx->trace` is set where it starts,
+ * and picks a dispatch table whose every entry records the instruction
+ * before running it. Untraced evaluation runs the same code as before.
+ */
+
+struct AVM_Trace_s {
+  uint64_t started;   /* records the writer began */
+  uint64_t written;   /* records the writer finished */
+  uint64_t read;      /* records handed out or lost */
+  size_t mask;
+  AVM_Trace_Record records[];
+};
+
+/* Starts trace files, followed by the size of a record as a uint32_t */
+static const char trace_magic[4] = { 'A', 'V', 'M', 'T' };
+
+static const char *const opcode_names[256] = {
+  [avm_opc_error] = "error",
+  [avm_opc_load ] = "load",
+  [avm_opc_store] = "store",
+  [avm_opc_push ] = "push",
+  [avm_opc_add  ] = "add",
+  [avm_opc_sub  ] = "sub",
+  [avm_opc_mul  ] = "mul",
+  [avm_opc_div  ] = "div",
+  [avm_opc_and  ] = "and",
+  [avm_opc_or   ] = "or",
+  [avm_opc_xor  ] = "xor",
+  [avm_opc_shr  ] = "shr",
+  [avm_opc_shl  ] = "shl",
+  [avm_opc_calli] = "calli",
+  [avm_opc_call ] = "call",
+  [avm_opc_ret  ] = "ret",
+  [avm_opc_jmpez] = "jmpez",
+  [avm_opc_quit ] = "quit",
+  [avm_opc_dup  ] = "dup",
+  [avm_opc_copy ] = "copy",
+  [avm_opc_fill ] = "fill",
+  [avm_opc_vadd ] = "vadd",
+  [avm_opc_vsub ] = "vsub",
+  [avm_opc_vmul ] = "vmul",
+  [avm_opc_vand ] = "vand",
+  [avm_opc_vor  ] = "vor",
+  [avm_opc_vxor ] = "vxor",
+  [avm_opc_vshr ] = "vshr",
+  [avm_opc_vshl ] = "vshl",
+};
+
+void avm__trace_free(AVM_Context *ctx)
+{
+  my_free(ctx->trace);
+  ctx->trace = NULL;
+}
+
+int avm_trace_enable(AVM_Context *ctx, size_t capacity)
+{
+  avm__trace_free(ctx);
+  if (capacity == 0) {
+    return 0;
+  }
+  // the engines run whole blocks, not an instruction at a time
+  avm_ir_enable(ctx, 0);
+
+  size_t cap = 1;
+  while (cap < capacity && cap <= SIZE_MAX / 2 / sizeof(AVM_Trace_Record)) {
+    cap *= 2;
+  }
+  AVM_Trace *trace = my_malloc(sizeof(AVM_Trace) +
+                               cap * sizeof(AVM_Trace_Record));
+  if (trace == NULL) {
+    return avm__error(ctx, "unable to allocate a trace of %zu records", cap);
+  }
+  trace->started = 0;
+  trace->written = 0;
+  trace->read = 0;
+  trace->mask = cap - 1;
+  ctx->trace = trace;
+  return 0;
+}
+
+void avm__trace_record(AVM_Context *ctx, avm_size_t pc, avm_int tos,
+                       avm_size_t depth)
+{
+  AVM_Trace *trace = ctx->trace;
+  AVM_Operation op;
+  avm_heap_get(ctx, (avm_int *) &op, pc);
+
+  uint64_t index = trace->written;
+  __atomic_store_n(&trace->started, index + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  trace->records[index & trace->mask] = (AVM_Trace_Record) {
+    .tos = depth > 0 ? tos : 0,
+    .pc = pc,
+    .depth = depth,
+    .op = op.kind,
+  };
+  __atomic_store_n(&trace->written, index + 1, __ATOMIC_RELEASE);
+}
+
+size_t avm_trace_read(AVM_Context *ctx, AVM_Trace_Record *records,
+                      size_t max, uint64_t *lost)
+{
+  AVM_Trace *trace = ctx->trace;
+  if (lost != NULL) {
+    *lost = 0;
+  }
+  if (trace == NULL) {
+    return 0;
+  }
+
+  uint64_t cap = (uint64_t) trace->mask + 1;
+  uint64_t written = __atomic_load_n(&trace->written, __ATOMIC_ACQUIRE);
+  uint64_t from = trace->read;
+  if (written - from > cap) {
+    from = written - cap;
+  }
+  size_t count = (size_t) min(written - from, max);
+  for (size_t i = 0; i < count; ++i) {
+    records[i] = trace->records[(from + i) & trace->mask];
+  }
+
+  // slots the writer has started on since may hold parts of newer records
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  uint64_t started = __atomic_load_n(&trace->started, __ATOMIC_RELAXED);
+  size_t torn = 0;
+  if (started - from > cap) {
+    torn = (size_t) min(started - cap - from, count);
+    memmove(records, records + torn,
+            (count - torn) * sizeof(AVM_Trace_Record));
+  }
+
+  if (lost != NULL) {
+    *lost = from - trace->read + torn;
+  }
+  trace->read = from + count;
+  return count - torn;
+}
+
+int avm_trace_write(AVM_Context *ctx, FILE *out, uint64_t *lost)
+{
+  uint32_t size = sizeof(AVM_Trace_Record);
+  AVM_Trace_Record records[256];
+  size_t count;
+  uint64_t dropped;
+
+  fwrite(trace_magic, 1, sizeof(trace_magic), out);
+  fwrite(&size, sizeof(size), 1, out);
+  *lost = 0;
+  do {
+    count = avm_trace_read(ctx, records, sizeof(records) / sizeof(*records),
+                           &dropped);
+    fwrite(records, sizeof(AVM_Trace_Record), count, out);
+    *lost += dropped;
+  } while (count > 0);
+
+  if (ferror(out)) {
+    return avm__error(ctx, "unable to write the trace");
+  }
+  return 0;
+}
+
+int avm_trace_decode(FILE *in, FILE *out, char **error)
+{
+  char magic[sizeof(trace_magic)];
+  uint32_t size;
+  *error = NULL;
+
+  if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) ||
+      memcmp(magic, trace_magic, sizeof(magic)) != 0 ||
+      fread(&size, sizeof(size), 1, in) != 1) {
+    *error = afmt("%s", "not a trace");
+    return 1;
+  }
+  if (size != sizeof(AVM_Trace_Record)) {
+    *error = afmt("records of %" PRIu32 " bytes, expected %zu", size,
+                  sizeof(AVM_Trace_Record));
+    return 1;
+  }
+
+  AVM_Trace_Record record;
+  while (fread(&record, sizeof(record), 1, in) == 1) {
+    const char *name = opcode_names[record.op];
+    if (name == NULL) {
+      name = "?";
+    }
+    fprintf(out, "%.4x:\t%-5s\tdepth %u\ttos 0x%.16" PRIx64 "\n", record.pc,
+            name, record.depth, record.tos);
+  }
+
+  if (ferror(in) || ferror(out)) {
+    *error = afmt("%s", "unable to decode the trace");
+    return 1;
+  }
+  return 0;
+}
@@ -12,8 +12,25 @@ int asizet_add_bounds_check(avm_size_t address, avm_size_t size)
 }
 
 
+/* Allocations made through the wrappers below, for avm_alloc_stats */
+static uint64_t alloc_count;
+static uint64_t alloc_bytes;
+
+static void count_alloc(size_t size)
+{
+  __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&alloc_bytes, size, __ATOMIC_RELAXED);
+}
+
+void avm_alloc_stats(AVM_Alloc_Stats *stats)
+{
+  stats->count = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+  stats->bytes = __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED);
+}
+
 void *my_crealloc(void *buffer, size_t oldsize, size_t newsize)
 {
+  count_alloc(newsize);
   void *result = realloc(buffer, newsize);
 
   if (newsize > oldsize && result != NULL) {
@@ -26,14 +43,17 @@ void *my_crealloc(void *buffer, size_t oldsize, size_t newsize)
 
 void *my_malloc(size_t size)
 {
+  count_alloc(size);
   return malloc(size);
 }
 void *my_calloc(size_t count, size_t size)
 {
+  count_alloc(count * size);
   return calloc(count, size);
 }
 void *my_realloc(void *buffer, size_t newsize)
 {
+  count_alloc(newsize);
   return realloc(buffer, newsize);
 }
 
@@ -46,18 +66,24 @@ size_t min(size_t a, size_t b)
 #define BUFFER_SIZE 4095
 char *read_file(FILE *file, size_t *len)
 {
-  char buffer[BUFFER_SIZE];
   char *result = NULL;
   size_t resultlen = 0;
+  size_t cap = 0;
 
   while (1) {
-    size_t amount_read = fread(buffer, 1, BUFFER_SIZE, file);
-    size_t oldlen = resultlen;
-    resultlen += amount_read;
-
-    result = my_realloc(result, resultlen + 1);
+    if (cap - resultlen < BUFFER_SIZE + 1) {
+      // doubling keeps reading big inputs linear
+      cap = cap == 0 ? BUFFER_SIZE + 1 : cap * 2;
+      char *grown = my_realloc(result, cap);
+      if (grown == NULL) {
+        my_free(result);
+        return NULL;
+      }
+      result = grown;
+    }
 
-    memcpy(result + oldlen, buffer, amount_read);
+    size_t amount_read = fread(result + resultlen, 1, BUFFER_SIZE, file);
+    resultlen += amount_read;
 
     if (amount_read < BUFFER_SIZE) {
       *len = resultlen;
@@ -67,17 +93,101 @@ char *read_file(FILE *file, size_t *len)
   }
 }
 
+#if defined(__unix__) || defined(__APPLE__)
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+const char *map_file(const char *path, size_t *len)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  struct stat st;
+  void *map = NULL;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    *len = (size_t) st.st_size;
+    map = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      map = NULL;
+    }
+  }
+  close(fd);
+  return map;
+}
+
+void unmap_file(const char *data, size_t len)
+{
+  munmap((void *) data, len);
+}
+
+unsigned avm__core_count(void)
+{
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  return cores > 0 ? (unsigned) cores : 1;
+}
+
+#else
+
+const char *map_file(const char *path, size_t *len)
+{
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return NULL;
+  }
+  char *data = read_file(file, len);
+  fclose(file);
+  if (data != NULL && *len == 0) {
+    my_free(data);
+  }
+  return data;
+}
+
+void unmap_file(const char *data, size_t len)
+{
+  (void) len;
+  free((void *) data);
+}
+
+unsigned avm__core_count(void)
+{
+  return 1;
+}
+
+#endif
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wformat-nonliteral"
+static void set_error(AVM_Context *ctx, AVM_Trap trap, const char *fmt,
+                      va_list ap)
+{
+  // contexts are reused, and a failing callee may have set one already
+  my_free(ctx->error);
+  if (vasprintf(&ctx->error, fmt, ap) < 0) {
+    ctx->error = NULL;
+  }
+  ctx->trap = trap;
+}
+
 int avm__error(AVM_Context *ctx, const char *fmt, ...)
 {
   // black magic based on afmt()
   va_list ap;
   va_start(ap, fmt);
-  if (vasprintf(&ctx->error, fmt, ap) < 0) {
-    ctx->error = NULL;
-  }
+  set_error(ctx, AVM_TRAP_ERROR, fmt, ap);
+  va_end(ap);
+  return 1;
+}
+
+int avm__trap(AVM_Context *ctx, AVM_Trap trap, const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  set_error(ctx, trap, fmt, ap);
   va_end(ap);
   return 1;
 }
@@ -1,7 +1,7 @@
 #ifndef _AVM_UTIL_H
 #define _AVM_UTIL_H
 #include "asprintf.h"
-#include "avm_util.h"
+#include "avm_def.h"
 #include <stdio.h>
 
 void *my_malloc(size_t size);
@@ -10,12 +10,33 @@ void *my_crealloc(void *buffer, size_t oldsize, size_t newsize);
 void *my_realloc(void *buffer, size_t newsize);
 #define my_free(p)  { free(p); p = NULL; }
 
+/* The dispatch engine is chosen at build time. With GCC and clang the
+ * handlers are threaded together with computed gotos, every handler ending
+ * in its own indirect jump to the next one. Defining AVM_DISPATCH_SWITCH
+ * (or building with another compiler) selects a portable `switch` loop that
+ * runs the very same handler bodies.
+ */
+#if defined(__GNUC__) && !defined(AVM_DISPATCH_SWITCH)
+#define AVM_THREADED 1
+#else
+#define AVM_THREADED 0
+#endif
+
 size_t min(size_t a, size_t b);
 
 /* Reads the file until error or EOF
  */
 char *read_file(FILE *file, size_t *len);
 
+/* Maps the file read-only, or reads it where that isn't possible. NULL if
+ * it can't be opened or is empty.
+ */
+const char *map_file(const char *path, size_t *len);
+void unmap_file(const char *data, size_t len);
+
+/* Cores online, for sizing thread pools. 1 where that isn't known. */
+unsigned avm__core_count(void);
+
 int asizet_add_bounds_check(avm_size_t address, avm_size_t size);
 
 /* Sets an error code on the context with the given format
@@ -25,4 +46,208 @@ int asizet_add_bounds_check(avm_size_t address, avm_size_t size);
  */
 int avm__error(AVM_Context *ctx, const char *fmt, ...);
 
+/* avm__error with a trap code other than AVM_TRAP_ERROR */
+int avm__trap(AVM_Context *ctx, AVM_Trap trap, const char *fmt, ...);
+
+/* Bytes of guest memory and stacks `ctx` holds, as AVM_Limits counts them */
+size_t avm__bytes(const AVM_Context *ctx);
+
+/* Fails with AVM_TRAP_BYTES unless `more` bytes fit within the limit */
+int avm__limit_bytes(AVM_Context *ctx, size_t more);
+
+/* Bytes of the operand stack that count towards the limit */
+size_t avm__stack_bytes(const AVM_Context *ctx);
+
+/* Shrinks the operand stack to what its limit allows */
+int avm__stack_fit(AVM_Context *ctx);
+
+/* Allocates an empty operand stack with room for `cap` items */
+int avm__stack_init(AVM_Context *ctx, avm_size_t cap);
+
+/* Makes room for more items on the operand stack */
+int avm__stack_grow(AVM_Context *ctx);
+
+/* Makes room for `count` more items on the operand stack at once */
+int avm__stack_reserve(AVM_Context *ctx, avm_size_t count);
+
+void avm__stack_free(AVM_Context *ctx);
+
+/* Empties the operand stack for another program */
+void avm__stack_reset(AVM_Context *ctx);
+
+/* Points every page of guest memory at the shared zero page */
+int avm__memory_init(AVM_Context *ctx);
+
+void avm__memory_free(AVM_Context *ctx);
+
+/* Points guest memory at the full pages of code words in `image`, taking
+ * over the reference to it
+ */
+int avm__memory_map(AVM_Context *ctx, AVM_Image *image);
+
+void avm__image_release(AVM_Image *image);
+
+/* Points the memory of `to` at the tables of `from`, which are copied once
+ * either of them writes to them
+ */
+void avm__memory_share(const AVM_Context *from, AVM_Context *to);
+
+/* The page holding `loc`, only to be read from */
+static inline const avm_int *avm__page(const AVM_Context *ctx, avm_size_t loc)
+{
+  return ctx->memory[loc >> (AVM_PAGE_BITS + AVM_TABLE_BITS)]
+                    [(loc >> AVM_PAGE_BITS) & (AVM_TABLE_SIZE - 1)];
+}
+
+/* The page holding `loc`, allocated if it's still the zero page and copied
+ * if it's shared with a fork. NULL if it can't be allocated.
+ */
+avm_int *avm__page_write(AVM_Context *ctx, avm_size_t loc);
+
+/* Whether the page holding `loc` is still the zero page */
+int avm__page_is_zero(const AVM_Context *ctx, avm_size_t loc);
+
+/* Points the page holding `loc` back at the zero page */
+int avm__page_clear(AVM_Context *ctx, avm_size_t loc);
+
+/* Points the page holding `to` at the one holding `from`, which is copied
+ * once either of them is written to
+ */
+int avm__page_alias(AVM_Context *ctx, avm_size_t to, avm_size_t from);
+
+#ifdef AVM_STACK_GUARD
+#include <setjmp.h>
+
+/* While a guard is entered, overflowing the operand stack of the context it
+ * was entered for jumps back to `env`.
+ */
+typedef struct AVM_Guard_s {
+  sigjmp_buf env;
+  const char *lo;
+  const char *hi;
+  struct AVM_Guard_s *prev;
+} AVM_Guard;
+
+void avm__guard_enter(AVM_Context *ctx, AVM_Guard *guard);
+
+/* Fails with the trap of the limit a full guarded stack reached */
+int avm__stack_overflow(AVM_Context *ctx);
+void avm__guard_leave(AVM_Guard *guard);
+#endif
+
+/* Copies `oplen` words of code to the start of guest memory */
+int avm__load_program(AVM_Context *ctx, const avm_int *initial_mem,
+                      size_t oplen);
+
+/* Allocates empty operand and call stacks */
+int avm__init_stacks(AVM_Context *ctx);
+
+/* Sets up everything but guest memory for a program that starts at
+ * `entry`, decoding the first `code_size` words, and verifies it
+ */
+int avm__init_state(AVM_Context *ctx, avm_size_t code_size, avm_size_t entry);
+
+/* Decodes the instruction at `loc` into `out` */
+void avm__decode(AVM_Context *ctx, avm_size_t loc, AVM_Decoded *out);
+
+/* Switches `op` to its variant without underrun checks if `lo` allows */
+void avm__refine(AVM_Decoded *op);
+
+/* Counts a run of the decoded operation `op` if it's a fused pair */
+void avm__count_fusion(AVM_Context *ctx, uint8_t op);
+
+/* The first instruction of the fused pair `op`, or `op` if it isn't one.
+ * A fused entry keeps the immediate of its first instruction and is
+ * followed by the entry of its second, so running it as the first one
+ * runs the pair an instruction at a time.
+ */
+uint8_t avm__unfuse(uint8_t op);
+
+/* Builds `ctx->code` over the first `size` words of memory */
+int avm__decode_init(AVM_Context *ctx, avm_size_t size);
+
+/* A new table of the first `size` words of memory decoded, NULL if it
+ * can't be allocated
+ */
+AVM_Decoded *avm__decode_table(AVM_Context *ctx, avm_size_t size);
+
+/* Marks every decoded instruction that reads `loc` as stale */
+int avm__invalidate(AVM_Context *ctx, avm_size_t loc);
+
+/* Whether `code` and `blocks` still belong to the program of `ctx` */
+static inline int avm__code_shared(const AVM_Context *ctx)
+{
+  return ctx->program != NULL && ctx->blocks == ctx->program->proto.blocks;
+}
+
+/* Gives `ctx` its own copy of the code and blocks of its program, before
+ * anything changes them
+ */
+int avm__code_own(AVM_Context *ctx);
+
+/* Drops the reference of a context or caller to `program` */
+void avm__program_release(AVM_Program *program);
+
+/* Drops the proofs of avm_verify, verified code decodes as checked again */
+void avm__unverify(AVM_Context *ctx);
+
+/* Instructions shared by the evaluator and the JIT compiler */
+int avm__push_call(AVM_Context *ctx, AVM_Stack_Frame frame);
+int avm__eval_load(const AVM_Decoded *op, AVM_Context *ctx);
+int avm__eval_store(const AVM_Decoded *op, AVM_Context *ctx);
+int avm__eval_copy(AVM_Context *ctx);
+int avm__eval_fill(AVM_Context *ctx);
+int avm__eval_vector(const AVM_Decoded *op, AVM_Context *ctx);
+
+/* Index of the block starting at `loc`, or containing it if `containing`
+ * is set. -1 if there's none.
+ */
+int avm__find_block(AVM_Context *ctx, avm_size_t loc, int containing);
+
+/* Sets or clears AVM_DEC_ENGINE on every block */
+void avm__mark_blocks(AVM_Context *ctx, int enabled);
+
+/* What a block engine leaves the interpreter to do at `pc` */
+enum {
+  AVM_RUN_EXITED,   /* go on at `pc`, which may start another block */
+  AVM_RUN_ERROR,    /* fail at `pc` */
+  AVM_RUN_BAILED,   /* interpret the instruction at `pc` */
+  AVM_RUN_BUDGET,   /* `ctx->budget` ran out before the block at `pc` */
+};
+
+/* Runs the block starting at `pc` and the ones it leads to with the register
+ * engine.
+ */
+int avm__ir_run(AVM_Context *ctx, avm_size_t *pc);
+
+/* Drops the translation of blocks that read `loc` */
+void avm__ir_invalidate(AVM_Context *ctx, avm_size_t loc);
+
+void avm__ir_free(AVM_Context *ctx);
+
+#ifdef AVM_JIT
+/* Runs the native code of the block starting at `pc`, compiling it first
+ * if it has become hot.
+ */
+int avm__jit_run(AVM_Context *ctx, avm_size_t *pc);
+
+/* Drops native code that read `loc` */
+void avm__jit_invalidate(AVM_Context *ctx, avm_size_t loc);
+
+void avm__jit_free(AVM_Context *ctx);
+#endif
+
+/* Appends the instruction at `pc` to the trace of `ctx`, which is on */
+void avm__trace_record(AVM_Context *ctx, avm_size_t pc, avm_int tos,
+                       avm_size_t depth);
+
+void avm__trace_free(AVM_Context *ctx);
+
+/* Counts the operation `d` at `pc` towards the next sample of the profile
+ * of `ctx`, which is on, and samples it if it's due. `tos` is the top of
+ * a stack `depth` deep.
+ */
+int avm__profile_step(AVM_Context *ctx, const AVM_Decoded *d, avm_size_t pc,
+                      avm_int tos, avm_size_t depth);
+
 #endif
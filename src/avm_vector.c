@@ -0,0 +1,100 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "avm.h"
+#include "avm_util.h"
+#include "avm_def.h"
+
+/* Vector instructions pop two groups of `size` words, the second pushed
+ * after the first, and push the scalar operation of every pair of words at
+ * the same position in their groups. The results take the place of the
+ * first group, so the loops below run in place on the operand stack.
+ *
+ * The loops work on four words at a time in the compiler's vector types.
+ * On x86-64 Linux they're also built for AVX2, and the version the CPU
+ * supports is picked when the library is loaded. Anywhere else they use
+ * whatever the target has, SSE2 on any x86-64.
+ */
+
+#if defined(__GNUC__)
+typedef avm_int Lanes __attribute__((vector_size(4 * sizeof(avm_int))));
+#endif
+
+#if defined(__x86_64__) && defined(__linux__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define CLONES __attribute__((target_clones("avx2", "default")))
+#endif
+#endif
+#ifndef CLONES
+#define CLONES
+#endif
+
+typedef void (*Kernel)(avm_int *a, const avm_int *b, avm_size_t count);
+
+/* `a[i] = a[i] OP b[i]`, where `x` and `y` are a word of each or a vector
+ * of them
+ */
+#if defined(__GNUC__)
+#define KERNEL(NAME, EXPR) \
+  static CLONES void NAME(avm_int *a, const avm_int *b, avm_size_t count) \
+  { \
+    avm_size_t i = 0; \
+    for (; i + 4 <= count; i += 4) { \
+      Lanes x, y; \
+      memcpy(&x, a + i, sizeof(x)); \
+      memcpy(&y, b + i, sizeof(y)); \
+      x = (EXPR); \
+      memcpy(a + i, &x, sizeof(x)); \
+    } \
+    for (; i < count; ++i) { \
+      avm_int x = a[i], y = b[i]; \
+      a[i] = (EXPR); \
+    } \
+  }
+#else
+#define KERNEL(NAME, EXPR) \
+  static void NAME(avm_int *a, const avm_int *b, avm_size_t count) \
+  { \
+    for (avm_size_t i = 0; i < count; ++i) { \
+      avm_int x = a[i], y = b[i]; \
+      a[i] = (EXPR); \
+    } \
+  }
+#endif
+
+// *INDENT-OFF*
+KERNEL(add_lanes, x + y)
+KERNEL(sub_lanes, x - y)
+KERNEL(mul_lanes, x * y)
+KERNEL(and_lanes, x & y)
+KERNEL(or_lanes, x | y)
+KERNEL(xor_lanes, x ^ y)
+KERNEL(shr_lanes, x >> (y & 0x3F))
+KERNEL(shl_lanes, x << (y & 0x3F))
+// *INDENT-ON*
+
+/* In the order of the opcodes from avm_opc_vadd */
+static const Kernel kernels[] = {
+  add_lanes, sub_lanes, mul_lanes, and_lanes,
+  or_lanes, xor_lanes, shr_lanes, shl_lanes,
+};
+
+_Static_assert(sizeof(kernels) / sizeof(*kernels) ==
+               avm_opc_vshl - avm_opc_vadd + 1, "a kernel for every opcode");
+
+/* Runs the vector operation `op->op` over `op->imm` lanes */
+int avm__eval_vector(const AVM_Decoded *op, AVM_Context *ctx)
+{
+  avm_size_t lanes = (avm_size_t) op->imm;
+
+  if (ctx->stack_size / 2 < lanes) {
+    // like NEED, as if the words had been popped one at a time
+    ctx->stack_size = 0;
+    return avm__error(ctx, "unable to pop item off stack: stack underrun");
+  }
+
+  avm_int *a = ctx->stack + ctx->stack_size - 2 * (size_t) lanes;
+  kernels[op->op - avm_opc_vadd](a, a + lanes, lanes);
+  ctx->stack_size -= lanes;
+  return 0;
+}
@@ -0,0 +1,374 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "avm.h"
+#include "avm_util.h"
+#include "avm_def.h"
+
+/* avm_verify follows every path through the decoded code that doesn't
+ * depend on runtime values, starting at the current instruction, and
+ * computes the least and most the stack can hold at each instruction.
+ * Instructions that can't underrun with the least depth get unchecked
+ * variants.
+ *
+ * The proof only covers entering the code where the analysis did. `call`
+ * with a target that isn't a constant, `ret` and a fresh avm_eval check
+ * the depth they enter verified code with, everything else (code outside of
+ * the table, unverified code, memory writes over verified instructions)
+ * makes the evaluator drop the proofs through avm__unverify.
+ */
+
+#define DEPTH_UNBOUNDED UINT32_MAX
+
+/* changes after which a shrinking minimum is assumed to be 0, and a
+ * growing maximum to be unbounded */
+#define WIDEN_AFTER 8
+
+typedef struct {
+  uint32_t lo;
+  uint32_t hi;
+  uint8_t reached;
+  uint8_t queued;
+  uint8_t visits;
+  uint8_t leader;
+  uint8_t top_known;  /* the top of the stack is always `top` */
+  avm_int top;
+} State;
+
+typedef struct {
+  State *states;
+  avm_size_t *work;
+  size_t work_len;
+  avm_size_t size;
+} Analysis;
+
+static uint32_t depth_add(uint32_t depth, avm_size_t amount)
+{
+  if (depth == DEPTH_UNBOUNDED ||
+      (uint64_t) depth + amount >= DEPTH_UNBOUNDED) {
+    return DEPTH_UNBOUNDED;
+  }
+  return depth + amount;
+}
+
+/* Merges `in` into the state at `loc`, queueing it again if it changed */
+static void flow(Analysis *an, avm_size_t loc, State in)
+{
+  if (loc >= an->size) {
+    return;  // executed through the resync handler, unverified
+  }
+
+  State *st = &an->states[loc];
+  if (!st->reached) {
+    uint8_t was_leader = st->leader;
+    *st = in;
+    st->reached = 1;
+    st->visits = 0;
+    st->leader = was_leader;
+  } else {
+    State merged = *st;
+    merged.lo = in.lo < st->lo ? in.lo : st->lo;
+    merged.hi = in.hi > st->hi ? in.hi : st->hi;
+    merged.top_known = st->top_known && in.top_known && st->top == in.top;
+
+    if (merged.lo != st->lo && st->visits >= WIDEN_AFTER) {
+      merged.lo = 0;
+    }
+    if (merged.hi != st->hi && st->visits >= WIDEN_AFTER) {
+      merged.hi = DEPTH_UNBOUNDED;
+    }
+
+    if (merged.lo == st->lo && merged.hi == st->hi &&
+        merged.top_known == st->top_known) {
+      return;
+    }
+
+    merged.visits = st->visits + (st->visits < UINT8_MAX);
+    *st = merged;
+  }
+
+  if (!st->queued) {
+    st->queued = 1;
+    an->work[an->work_len++] = loc;
+  }
+}
+
+/* The state after popping `pops` items and pushing `pushes`. Execution
+ * only continues if the pops succeeded.
+ *
+ * Operations that can only underrun still flow on, as code entered through
+ * a checked `call` or `ret` may have more on the stack than `hi`.
+ */
+static State effect(State in, avm_size_t pops, avm_size_t pushes)
+{
+  uint32_t lo = in.lo > pops ? in.lo - (uint32_t) pops : 0;
+  uint32_t hi = in.hi == DEPTH_UNBOUNDED ? in.hi :
+                in.hi > pops ? in.hi - (uint32_t) pops : 0;
+
+  return (State) {
+    .lo = depth_add(lo, pushes),
+    .hi = depth_add(hi, pushes),
+    .reached = 1,
+  };
+}
+
+static void leader(Analysis *an, avm_size_t loc)
+{
+  if (loc < an->size) {
+    an->states[loc].leader = 1;
+  }
+}
+
+static void step(AVM_Context *ctx, Analysis *an, avm_size_t loc)
+{
+  State in = an->states[loc];
+  State out;
+  AVM_Operation op;
+  avm_heap_get(ctx, (avm_int *) &op, loc);
+
+  // anything a `call` or `ret` comes back to, the depth is up to the callee
+  State returned = { .lo = 0, .hi = DEPTH_UNBOUNDED, .reached = 1 };
+
+  switch (op.kind) {
+  case avm_opc_push:
+    out = effect(in, 0, 1);
+    avm_heap_get(ctx, &out.top, loc + 1);
+    out.top_known = 1;
+    flow(an, loc + 2, out);
+    break;
+  case avm_opc_load:
+    flow(an, loc + 1, effect(in, 0, op.size));
+    break;
+  case avm_opc_store:
+    flow(an, loc + 1, effect(in, op.size, 0));
+    break;
+  case avm_opc_copy:
+  case avm_opc_fill:
+    flow(an, loc + 1, effect(in, 3, 0));
+    break;
+  case avm_opc_vadd:
+  case avm_opc_vsub:
+  case avm_opc_vmul:
+  case avm_opc_vand:
+  case avm_opc_vor:
+  case avm_opc_vxor:
+  case avm_opc_vshr:
+  case avm_opc_vshl:
+    flow(an, loc + 1, effect(in, 2 * op.size, op.size));
+    break;
+  case avm_opc_add:
+  case avm_opc_sub:
+  case avm_opc_mul:
+  case avm_opc_div:
+  case avm_opc_and:
+  case avm_opc_or:
+  case avm_opc_xor:
+  case avm_opc_shr:
+  case avm_opc_shl:
+    flow(an, loc + 1, effect(in, 2, 1));
+    break;
+  case avm_opc_dup:
+    out = effect(in, 1, 2);
+    out.top_known = in.top_known;
+    out.top = in.top;
+    flow(an, loc + 1, out);
+    break;
+  case avm_opc_jmpez:
+    out = effect(in, 1, 0);
+    leader(an, op.address);
+    leader(an, loc + 1);
+    flow(an, op.address, out);
+    flow(an, loc + 1, out);
+    break;
+  case avm_opc_calli:
+    leader(an, op.address);
+    leader(an, loc + 1);
+    flow(an, op.address, in);
+    flow(an, loc + 1, returned);
+    break;
+  case avm_opc_call:
+    if (in.top_known) {
+      leader(an, (avm_size_t) in.top);
+      flow(an, (avm_size_t) in.top, effect(in, 1, 0));
+    }
+    leader(an, loc + 1);
+    flow(an, loc + 1, returned);
+    break;
+  default:
+    // ret, quit and errors don't continue anywhere known
+    break;
+  }
+}
+
+static int terminates_block(AVM_Opcode kind)
+{
+  return kind == avm_opc_jmpez || kind == avm_opc_calli ||
+         kind == avm_opc_call || kind == avm_opc_ret ||
+         kind == avm_opc_quit || kind == avm_opc_error ||
+         kind >= opcode_count;
+}
+
+static int collect_blocks(AVM_Context *ctx, Analysis *an)
+{
+  size_t cap = 16;
+  my_free(ctx->blocks);
+  ctx->block_count = 0;
+  ctx->blocks = my_malloc(cap * sizeof(AVM_Block));
+  if (ctx->blocks == NULL) {
+    return avm__error(ctx, "unable to allocate basic blocks");
+  }
+
+  for (avm_size_t start = 0; start < an->size; ++start) {
+    State *st = &an->states[start];
+    if (!st->reached || !st->leader) {
+      continue;
+    }
+
+    avm_size_t end = start;
+    while (1) {
+      AVM_Operation op;
+      avm_heap_get(ctx, (avm_int *) &op, end);
+      end += op.kind == avm_opc_push ? 2 : 1;
+
+      if (terminates_block(op.kind) || end >= an->size ||
+          !an->states[end].reached || an->states[end].leader) {
+        break;
+      }
+    }
+
+    if (ctx->block_count == cap) {
+      cap *= 2;
+      AVM_Block *blocks = my_realloc(ctx->blocks, cap * sizeof(AVM_Block));
+      if (blocks == NULL) {
+        return avm__error(ctx, "unable to allocate basic blocks");
+      }
+      ctx->blocks = blocks;
+    }
+
+    ctx->blocks[ctx->block_count++] = (AVM_Block) {
+      .start = start,
+      .end = end,
+      .min_depth = st->lo,
+      .max_depth = st->hi == DEPTH_UNBOUNDED ? AVM_SIZE_MAX : st->hi,
+    };
+  }
+
+  return 0;
+}
+
+int avm_verify(AVM_Context *ctx)
+{
+  if (avm__code_own(ctx)) {
+    return 1;
+  }
+
+  Analysis an = { .size = ctx->code_size };
+  an.states = my_calloc(an.size + 1, sizeof(State));
+  an.work = my_malloc(((size_t) an.size + 1) * sizeof(avm_size_t));
+  if (an.states == NULL || an.work == NULL) {
+    my_free(an.states);
+    my_free(an.work);
+    return avm__error(ctx, "unable to allocate verifier state");
+  }
+
+  avm__unverify(ctx);
+
+  // engines keep their code per block, start over once they're found again
+  int ir = ctx->ir != NULL;
+  avm__ir_free(ctx);
+#ifdef AVM_JIT
+  int jit = ctx->jit != NULL;
+  avm__jit_free(ctx);
+#endif
+
+  leader(&an, ctx->ins);
+  flow(&an, ctx->ins, (State) {
+    .lo = ctx->stack_size,
+    .hi = ctx->stack_size,
+    .reached = 1,
+  });
+
+  while (an.work_len > 0) {
+    avm_size_t loc = an.work[--an.work_len];
+    an.states[loc].queued = 0;
+    step(ctx, &an, loc);
+  }
+
+  int retcode = collect_blocks(ctx, &an);
+
+  for (avm_size_t i = 0; i < an.size && retcode == 0; ++i) {
+    State *st = &an.states[i];
+    if (!st->reached) {
+      continue;
+    }
+
+    AVM_Decoded *entry = &ctx->code[i];
+    entry->lo = st->lo > UINT8_MAX ? UINT8_MAX : (uint8_t) st->lo;
+    entry->flags |= AVM_DEC_VERIFIED | (st->leader ? AVM_DEC_LEADER : 0);
+    avm__refine(entry);
+  }
+
+  ctx->proven = retcode == 0;
+
+  if (retcode == 0 && ir) {
+    retcode = avm_ir_enable(ctx, 1);
+  }
+#ifdef AVM_JIT
+  if (retcode == 0 && jit) {
+    retcode = avm_jit_enable(ctx, 1);
+  }
+#endif
+
+  my_free(an.states);
+  my_free(an.work);
+  return retcode;
+}
+
+int avm__find_block(AVM_Context *ctx, avm_size_t loc, int containing)
+{
+  size_t lo = 0, hi = ctx->block_count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    AVM_Block *block = &ctx->blocks[mid];
+    if (loc < block->start) {
+      hi = mid;
+    } else if (loc == block->start || (containing && loc < block->end)) {
+      return (int) mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return -1;
+}
+
+void avm__mark_blocks(AVM_Context *ctx, int enabled)
+{
+  for (size_t i = 0; i < ctx->block_count; ++i) {
+    AVM_Decoded *entry = &ctx->code[ctx->blocks[i].start];
+    if (enabled) {
+      entry->flags |= AVM_DEC_ENGINE;
+    } else {
+      entry->flags &= (uint8_t) ~AVM_DEC_ENGINE;
+    }
+  }
+}
+
+void avm__unverify(AVM_Context *ctx)
+{
+  ctx->proven = 0;
+
+  if (avm__code_shared(ctx)) {
+    // the program has its code decoded without proofs as well
+    ctx->code = ctx->program->plain;
+    return;
+  }
+
+  for (avm_size_t i = 0; i < ctx->code_size; ++i) {
+    AVM_Decoded *entry = &ctx->code[i];
+    if (entry->flags & AVM_DEC_VERIFIED) {
+      entry->flags &= (uint8_t) ~(AVM_DEC_VERIFIED | AVM_DEC_LEADER);
+      entry->lo = 0;
+      entry->op = avm_dop_stale;
+    }
+  }
+}
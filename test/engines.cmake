@@ -0,0 +1,28 @@
+# Runs PROGRAM with AVM on the interpreter, then with --ir and, when the JIT
+# is built, --jit, and fails unless every run exits with the same status and
+# prints the same output
+
+set(modes --ir)
+if(JIT)
+  list(APPEND modes --jit)
+endif()
+
+execute_process(COMMAND ${AVM} ${PROGRAM}
+  RESULT_VARIABLE expected_status
+  OUTPUT_VARIABLE expected_output
+  ERROR_VARIABLE expected_error)
+
+foreach(mode ${modes})
+  execute_process(COMMAND ${AVM} ${mode} ${PROGRAM}
+    RESULT_VARIABLE status
+    OUTPUT_VARIABLE output
+    ERROR_VARIABLE error)
+  if(NOT status STREQUAL expected_status)
+    message(FATAL_ERROR "avm ${mode} exited with ${status}, "
+                        "the interpreter with ${expected_status}")
+  endif()
+  if(NOT output STREQUAL expected_output OR NOT error STREQUAL expected_error)
+    message(FATAL_ERROR "avm ${mode} printed\n${output}${error}\n"
+                        "the interpreter\n${expected_output}${expected_error}")
+  endif()
+endforeach()
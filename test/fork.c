@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "avm.h"
+#include "avm_def.h"
+
+/* Forks a context holding the program in argv[1] into a child full of
+ * garbage, runs both and fails unless the child evaluates to the same as
+ * the parent in about the same time. Nothing left over from the garbage
+ * may change how the child runs.
+ *
+ * usage: fork program.avm
+ */
+
+static char *read_source(const char *path)
+{
+  FILE *in = fopen(path, "rb");
+  if (in == NULL) {
+    return NULL;
+  }
+  size_t len = 0, cap = 4096;
+  char *source = malloc(cap);
+  size_t n;
+  while (source != NULL &&
+         (n = fread(source + len, 1, cap - len - 1, in)) > 0) {
+    len += n;
+    if (cap - len == 1) {
+      cap *= 2;
+      source = realloc(source, cap);
+    }
+  }
+  fclose(in);
+  if (source != NULL) {
+    source[len] = '\0';
+  }
+  return source;
+}
+
+/* Evaluates `ctx` and returns the CPU time it took, in seconds */
+static double timed_eval(AVM_Context *ctx, int *failed, avm_int *result)
+{
+  clock_t start = clock();
+  *failed = avm_eval(ctx, result);
+  return (double) (clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char **argv)
+{
+  char *source = argc > 1 ? read_source(argv[1]) : NULL;
+  if (source == NULL) {
+    fprintf(stderr, "usage: %s program.avm\n", argv[0]);
+    return 1;
+  }
+
+  avm_int *code;
+  char *error = NULL;
+  size_t words;
+  if (avm_parse(source, &code, &error, &words)) {
+    fprintf(stderr, "%s: %s\n", argv[1], error);
+    return 1;
+  }
+
+  AVM_Context parent, child;
+  memset(&child, 0xAB, sizeof(child));
+  if (avm_init(&parent, code, words) || avm_fork(&parent, &child)) {
+    fprintf(stderr, "%s: unable to fork\n", argv[1]);
+    return 1;
+  }
+
+  int parent_failed, child_failed;
+  avm_int parent_result = 0, child_result = 0;
+  double parent_time = timed_eval(&parent, &parent_failed, &parent_result);
+  double child_time = timed_eval(&child, &child_failed, &child_result);
+  printf("parent: %d %llx in %.3f s\nchild:  %d %llx in %.3f s\n",
+         parent_failed, (unsigned long long) parent_result, parent_time,
+         child_failed, (unsigned long long) child_result, child_time);
+
+  int failed = child_failed != parent_failed ||
+               child_result != parent_result;
+  if (failed) {
+    fprintf(stderr, "the child evaluated differently\n");
+  }
+  // timing is noisy, an instrumented run is several times slower
+  if (child_time > 1.5 * parent_time + 0.05) {
+    fprintf(stderr, "the child ran slower than the parent\n");
+    failed = 1;
+  }
+
+  avm_free(&parent);
+  avm_free(&child);
+  free(code);
+  free(error);
+  free(source);
+  return failed;
+}